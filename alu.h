@@ -0,0 +1,217 @@
+#ifndef EMU8080_ALUH
+#define EMU8080_ALUH
+#include <stdint.h>
+
+/* Built with scripts/build_alu */
+
+#ifdef EMU8080_PACKED_FLAGS
+/* Sign, zero, parity and carry of a 9-bit sum or difference */
+static const uint8_t szpc_table[512] = {
+        0x44, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x45, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05,
+        0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01,
+        0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01,
+        0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05,
+        0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01,
+        0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05,
+        0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05,
+        0x01, 0x05, 0x05, 0x01, 0x05, 0x01, 0x01, 0x05, 0x05, 0x01, 0x01, 0x05, 0x01, 0x05, 0x05, 0x01,
+        0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81,
+        0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85,
+        0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85,
+        0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81,
+        0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85,
+        0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81,
+        0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81,
+        0x85, 0x81, 0x81, 0x85, 0x81, 0x85, 0x85, 0x81, 0x81, 0x85, 0x85, 0x81, 0x85, 0x81, 0x81, 0x85,
+};
+
+/* Sign, zero, aux carry and parity after INR gives r */
+static const uint8_t inr_table[256] = {
+        0x54, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x10, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x10, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x14, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x10, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x14, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x14, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04,
+        0x10, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00, 0x04, 0x04, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x00,
+        0x90, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x94, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x94, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x90, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x94, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+        0x90, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x90, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80,
+        0x94, 0x80, 0x80, 0x84, 0x80, 0x84, 0x84, 0x80, 0x80, 0x84, 0x84, 0x80, 0x84, 0x80, 0x80, 0x84,
+};
+
+/* Sign, zero, aux carry and parity after DCR gives r */
+static const uint8_t dcr_table[256] = {
+        0x54, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x04,
+        0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x00,
+        0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x00,
+        0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x04,
+        0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x00,
+        0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x04,
+        0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x04,
+        0x10, 0x14, 0x14, 0x10, 0x14, 0x10, 0x10, 0x14, 0x14, 0x10, 0x10, 0x14, 0x10, 0x14, 0x14, 0x00,
+        0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x80,
+        0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x84,
+        0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x84,
+        0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x80,
+        0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x84,
+        0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x80,
+        0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x80,
+        0x94, 0x90, 0x90, 0x94, 0x90, 0x94, 0x94, 0x90, 0x90, 0x94, 0x94, 0x90, 0x94, 0x90, 0x90, 0x84,
+};
+#endif
+
+/* DAA by CY << 9 | AC << 8 | A: the flags in the high byte and the
+ * result in the low byte */
+static const uint16_t daa_table[1024] = {
+        0x4400, 0x0001, 0x0002, 0x0403, 0x0004, 0x0405, 0x0406, 0x0007,
+        0x0008, 0x0409, 0x1010, 0x1411, 0x1412, 0x1013, 0x1414, 0x1015,
+        0x0010, 0x0411, 0x0412, 0x0013, 0x0414, 0x0015, 0x0016, 0x0417,
+        0x0418, 0x0019, 0x1020, 0x1421, 0x1422, 0x1023, 0x1424, 0x1025,
+        0x0020, 0x0421, 0x0422, 0x0023, 0x0424, 0x0025, 0x0026, 0x0427,
+        0x0428, 0x0029, 0x1430, 0x1031, 0x1032, 0x1433, 0x1034, 0x1435,
+        0x0430, 0x0031, 0x0032, 0x0433, 0x0034, 0x0435, 0x0436, 0x0037,
+        0x0038, 0x0439, 0x1040, 0x1441, 0x1442, 0x1043, 0x1444, 0x1045,
+        0x0040, 0x0441, 0x0442, 0x0043, 0x0444, 0x0045, 0x0046, 0x0447,
+        0x0448, 0x0049, 0x1450, 0x1051, 0x1052, 0x1453, 0x1054, 0x1455,
+        0x0450, 0x0051, 0x0052, 0x0453, 0x0054, 0x0455, 0x0456, 0x0057,
+        0x0058, 0x0459, 0x1460, 0x1061, 0x1062, 0x1463, 0x1064, 0x1465,
+        0x0460, 0x0061, 0x0062, 0x0463, 0x0064, 0x0465, 0x0466, 0x0067,
+        0x0068, 0x0469, 0x1070, 0x1471, 0x1472, 0x1073, 0x1474, 0x1075,
+        0x0070, 0x0471, 0x0472, 0x0073, 0x0474, 0x0075, 0x0076, 0x0477,
+        0x0478, 0x0079, 0x9080, 0x9481, 0x9482, 0x9083, 0x9484, 0x9085,
+        0x8080, 0x8481, 0x8482, 0x8083, 0x8484, 0x8085, 0x8086, 0x8487,
+        0x8488, 0x8089, 0x9490, 0x9091, 0x9092, 0x9493, 0x9094, 0x9495,
+        0x8490, 0x8091, 0x8092, 0x8493, 0x8094, 0x8495, 0x8496, 0x8097,
+        0x8098, 0x8499, 0x5500, 0x1101, 0x1102, 0x1503, 0x1104, 0x1505,
+        0x4500, 0x0101, 0x0102, 0x0503, 0x0104, 0x0505, 0x0506, 0x0107,
+        0x0108, 0x0509, 0x1110, 0x1511, 0x1512, 0x1113, 0x1514, 0x1115,
+        0x0110, 0x0511, 0x0512, 0x0113, 0x0514, 0x0115, 0x0116, 0x0517,
+        0x0518, 0x0119, 0x1120, 0x1521, 0x1522, 0x1123, 0x1524, 0x1125,
+        0x0120, 0x0521, 0x0522, 0x0123, 0x0524, 0x0125, 0x0126, 0x0527,
+        0x0528, 0x0129, 0x1530, 0x1131, 0x1132, 0x1533, 0x1134, 0x1535,
+        0x0530, 0x0131, 0x0132, 0x0533, 0x0134, 0x0535, 0x0536, 0x0137,
+        0x0138, 0x0539, 0x1140, 0x1541, 0x1542, 0x1143, 0x1544, 0x1145,
+        0x0140, 0x0541, 0x0542, 0x0143, 0x0544, 0x0145, 0x0146, 0x0547,
+        0x0548, 0x0149, 0x1550, 0x1151, 0x1152, 0x1553, 0x1154, 0x1555,
+        0x0550, 0x0151, 0x0152, 0x0553, 0x0154, 0x0555, 0x0556, 0x0157,
+        0x0158, 0x0559, 0x1560, 0x1161, 0x1162, 0x1563, 0x1164, 0x1565,
+        0x0406, 0x0007, 0x0008, 0x0409, 0x040a, 0x000b, 0x040c, 0x000d,
+        0x000e, 0x040f, 0x1010, 0x1411, 0x1412, 0x1013, 0x1414, 0x1015,
+        0x0016, 0x0417, 0x0418, 0x0019, 0x001a, 0x041b, 0x001c, 0x041d,
+        0x041e, 0x001f, 0x1020, 0x1421, 0x1422, 0x1023, 0x1424, 0x1025,
+        0x0026, 0x0427, 0x0428, 0x0029, 0x002a, 0x042b, 0x002c, 0x042d,
+        0x042e, 0x002f, 0x1430, 0x1031, 0x1032, 0x1433, 0x1034, 0x1435,
+        0x0436, 0x0037, 0x0038, 0x0439, 0x043a, 0x003b, 0x043c, 0x003d,
+        0x003e, 0x043f, 0x1040, 0x1441, 0x1442, 0x1043, 0x1444, 0x1045,
+        0x0046, 0x0447, 0x0448, 0x0049, 0x004a, 0x044b, 0x004c, 0x044d,
+        0x044e, 0x004f, 0x1450, 0x1051, 0x1052, 0x1453, 0x1054, 0x1455,
+        0x0456, 0x0057, 0x0058, 0x0459, 0x045a, 0x005b, 0x045c, 0x005d,
+        0x005e, 0x045f, 0x1460, 0x1061, 0x1062, 0x1463, 0x1064, 0x1465,
+        0x0466, 0x0067, 0x0068, 0x0469, 0x046a, 0x006b, 0x046c, 0x006d,
+        0x006e, 0x046f, 0x1070, 0x1471, 0x1472, 0x1073, 0x1474, 0x1075,
+        0x0076, 0x0477, 0x0478, 0x0079, 0x007a, 0x047b, 0x007c, 0x047d,
+        0x047e, 0x007f, 0x9080, 0x9481, 0x9482, 0x9083, 0x9484, 0x9085,
+        0x8086, 0x8487, 0x8488, 0x8089, 0x808a, 0x848b, 0x808c, 0x848d,
+        0x848e, 0x808f, 0x9490, 0x9091, 0x9092, 0x9493, 0x9094, 0x9495,
+        0x8496, 0x8097, 0x8098, 0x8499, 0x849a, 0x809b, 0x849c, 0x809d,
+        0x809e, 0x849f, 0x5500, 0x1101, 0x1102, 0x1503, 0x1104, 0x1505,
+        0x0506, 0x0107, 0x0108, 0x0509, 0x050a, 0x010b, 0x050c, 0x010d,
+        0x010e, 0x050f, 0x1110, 0x1511, 0x1512, 0x1113, 0x1514, 0x1115,
+        0x0116, 0x0517, 0x0518, 0x0119, 0x011a, 0x051b, 0x011c, 0x051d,
+        0x051e, 0x011f, 0x1120, 0x1521, 0x1522, 0x1123, 0x1524, 0x1125,
+        0x0126, 0x0527, 0x0528, 0x0129, 0x012a, 0x052b, 0x012c, 0x052d,
+        0x052e, 0x012f, 0x1530, 0x1131, 0x1132, 0x1533, 0x1134, 0x1535,
+        0x0536, 0x0137, 0x0138, 0x0539, 0x053a, 0x013b, 0x053c, 0x013d,
+        0x013e, 0x053f, 0x1140, 0x1541, 0x1542, 0x1143, 0x1544, 0x1145,
+        0x0146, 0x0547, 0x0548, 0x0149, 0x014a, 0x054b, 0x014c, 0x054d,
+        0x054e, 0x014f, 0x1550, 0x1151, 0x1152, 0x1553, 0x1154, 0x1555,
+        0x0556, 0x0157, 0x0158, 0x0559, 0x055a, 0x015b, 0x055c, 0x015d,
+        0x015e, 0x055f, 0x1560, 0x1161, 0x1162, 0x1563, 0x1164, 0x1565,
+        0x0560, 0x0161, 0x0162, 0x0563, 0x0164, 0x0565, 0x0566, 0x0167,
+        0x0168, 0x0569, 0x1170, 0x1571, 0x1572, 0x1173, 0x1574, 0x1175,
+        0x0170, 0x0571, 0x0572, 0x0173, 0x0574, 0x0175, 0x0176, 0x0577,
+        0x0578, 0x0179, 0x9180, 0x9581, 0x9582, 0x9183, 0x9584, 0x9185,
+        0x8180, 0x8581, 0x8582, 0x8183, 0x8584, 0x8185, 0x8186, 0x8587,
+        0x8588, 0x8189, 0x9590, 0x9191, 0x9192, 0x9593, 0x9194, 0x9595,
+        0x8590, 0x8191, 0x8192, 0x8593, 0x8194, 0x8595, 0x8596, 0x8197,
+        0x8198, 0x8599, 0x95a0, 0x91a1, 0x91a2, 0x95a3, 0x91a4, 0x95a5,
+        0x85a0, 0x81a1, 0x81a2, 0x85a3, 0x81a4, 0x85a5, 0x85a6, 0x81a7,
+        0x81a8, 0x85a9, 0x91b0, 0x95b1, 0x95b2, 0x91b3, 0x95b4, 0x91b5,
+        0x81b0, 0x85b1, 0x85b2, 0x81b3, 0x85b4, 0x81b5, 0x81b6, 0x85b7,
+        0x85b8, 0x81b9, 0x95c0, 0x91c1, 0x91c2, 0x95c3, 0x91c4, 0x95c5,
+        0x85c0, 0x81c1, 0x81c2, 0x85c3, 0x81c4, 0x85c5, 0x85c6, 0x81c7,
+        0x81c8, 0x85c9, 0x91d0, 0x95d1, 0x95d2, 0x91d3, 0x95d4, 0x91d5,
+        0x81d0, 0x85d1, 0x85d2, 0x81d3, 0x85d4, 0x81d5, 0x81d6, 0x85d7,
+        0x85d8, 0x81d9, 0x91e0, 0x95e1, 0x95e2, 0x91e3, 0x95e4, 0x91e5,
+        0x81e0, 0x85e1, 0x85e2, 0x81e3, 0x85e4, 0x81e5, 0x81e6, 0x85e7,
+        0x85e8, 0x81e9, 0x95f0, 0x91f1, 0x91f2, 0x95f3, 0x91f4, 0x95f5,
+        0x85f0, 0x81f1, 0x81f2, 0x85f3, 0x81f4, 0x85f5, 0x85f6, 0x81f7,
+        0x81f8, 0x85f9, 0x5500, 0x1101, 0x1102, 0x1503, 0x1104, 0x1505,
+        0x4500, 0x0101, 0x0102, 0x0503, 0x0104, 0x0505, 0x0506, 0x0107,
+        0x0108, 0x0509, 0x1110, 0x1511, 0x1512, 0x1113, 0x1514, 0x1115,
+        0x0110, 0x0511, 0x0512, 0x0113, 0x0514, 0x0115, 0x0116, 0x0517,
+        0x0518, 0x0119, 0x1120, 0x1521, 0x1522, 0x1123, 0x1524, 0x1125,
+        0x0120, 0x0521, 0x0522, 0x0123, 0x0524, 0x0125, 0x0126, 0x0527,
+        0x0528, 0x0129, 0x1530, 0x1131, 0x1132, 0x1533, 0x1134, 0x1535,
+        0x0530, 0x0131, 0x0132, 0x0533, 0x0134, 0x0535, 0x0536, 0x0137,
+        0x0138, 0x0539, 0x1140, 0x1541, 0x1542, 0x1143, 0x1544, 0x1145,
+        0x0140, 0x0541, 0x0542, 0x0143, 0x0544, 0x0145, 0x0146, 0x0547,
+        0x0548, 0x0149, 0x1550, 0x1151, 0x1152, 0x1553, 0x1154, 0x1555,
+        0x0550, 0x0151, 0x0152, 0x0553, 0x0154, 0x0555, 0x0556, 0x0157,
+        0x0158, 0x0559, 0x1560, 0x1161, 0x1162, 0x1563, 0x1164, 0x1565,
+        0x0566, 0x0167, 0x0168, 0x0569, 0x056a, 0x016b, 0x056c, 0x016d,
+        0x016e, 0x056f, 0x1170, 0x1571, 0x1572, 0x1173, 0x1574, 0x1175,
+        0x0176, 0x0577, 0x0578, 0x0179, 0x017a, 0x057b, 0x017c, 0x057d,
+        0x057e, 0x017f, 0x9180, 0x9581, 0x9582, 0x9183, 0x9584, 0x9185,
+        0x8186, 0x8587, 0x8588, 0x8189, 0x818a, 0x858b, 0x818c, 0x858d,
+        0x858e, 0x818f, 0x9590, 0x9191, 0x9192, 0x9593, 0x9194, 0x9595,
+        0x8596, 0x8197, 0x8198, 0x8599, 0x859a, 0x819b, 0x859c, 0x819d,
+        0x819e, 0x859f, 0x95a0, 0x91a1, 0x91a2, 0x95a3, 0x91a4, 0x95a5,
+        0x85a6, 0x81a7, 0x81a8, 0x85a9, 0x85aa, 0x81ab, 0x85ac, 0x81ad,
+        0x81ae, 0x85af, 0x91b0, 0x95b1, 0x95b2, 0x91b3, 0x95b4, 0x91b5,
+        0x81b6, 0x85b7, 0x85b8, 0x81b9, 0x81ba, 0x85bb, 0x81bc, 0x85bd,
+        0x85be, 0x81bf, 0x95c0, 0x91c1, 0x91c2, 0x95c3, 0x91c4, 0x95c5,
+        0x85c6, 0x81c7, 0x81c8, 0x85c9, 0x85ca, 0x81cb, 0x85cc, 0x81cd,
+        0x81ce, 0x85cf, 0x91d0, 0x95d1, 0x95d2, 0x91d3, 0x95d4, 0x91d5,
+        0x81d6, 0x85d7, 0x85d8, 0x81d9, 0x81da, 0x85db, 0x81dc, 0x85dd,
+        0x85de, 0x81df, 0x91e0, 0x95e1, 0x95e2, 0x91e3, 0x95e4, 0x91e5,
+        0x81e6, 0x85e7, 0x85e8, 0x81e9, 0x81ea, 0x85eb, 0x81ec, 0x85ed,
+        0x85ee, 0x81ef, 0x95f0, 0x91f1, 0x91f2, 0x95f3, 0x91f4, 0x95f5,
+        0x85f6, 0x81f7, 0x81f8, 0x85f9, 0x85fa, 0x81fb, 0x85fc, 0x81fd,
+        0x81fe, 0x85ff, 0x5500, 0x1101, 0x1102, 0x1503, 0x1104, 0x1505,
+        0x0506, 0x0107, 0x0108, 0x0509, 0x050a, 0x010b, 0x050c, 0x010d,
+        0x010e, 0x050f, 0x1110, 0x1511, 0x1512, 0x1113, 0x1514, 0x1115,
+        0x0116, 0x0517, 0x0518, 0x0119, 0x011a, 0x051b, 0x011c, 0x051d,
+        0x051e, 0x011f, 0x1120, 0x1521, 0x1522, 0x1123, 0x1524, 0x1125,
+        0x0126, 0x0527, 0x0528, 0x0129, 0x012a, 0x052b, 0x012c, 0x052d,
+        0x052e, 0x012f, 0x1530, 0x1131, 0x1132, 0x1533, 0x1134, 0x1535,
+        0x0536, 0x0137, 0x0138, 0x0539, 0x053a, 0x013b, 0x053c, 0x013d,
+        0x013e, 0x053f, 0x1140, 0x1541, 0x1542, 0x1143, 0x1544, 0x1145,
+        0x0146, 0x0547, 0x0548, 0x0149, 0x014a, 0x054b, 0x014c, 0x054d,
+        0x054e, 0x014f, 0x1550, 0x1151, 0x1152, 0x1553, 0x1154, 0x1555,
+        0x0556, 0x0157, 0x0158, 0x0559, 0x055a, 0x015b, 0x055c, 0x015d,
+        0x015e, 0x055f, 0x1560, 0x1161, 0x1162, 0x1563, 0x1164, 0x1565,
+};
+#endif
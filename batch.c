@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "io.h"
+#include "pool.h"
+#include "batch.h"
+
+#define SLICE_CYCLES 10000000
+
+struct Batch {
+    struct Job *jobs;
+    struct Image **images;  /* per job, shared by jobs naming the same file */
+    uint64_t limit;
+};
+
+/* Manifest lines are "ROM [OFFSET]"; blank lines and '#' comments are skipped */
+struct Job *batch_load_manifest(const char *manifest, size_t *njobs)
+{
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        perror("fopen");
+        return NULL;
+    }
+
+    struct Job *jobs = NULL;
+    size_t count = 0, capacity = 0;
+    char line[4096];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), file)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *rom = strtok(line, " \t\r\n");
+        if (!rom)
+            continue;
+        char *offstr = strtok(NULL, " \t\r\n");
+        size_t offset = 0;
+        if (offstr) {
+            char *end;
+            errno = 0;
+            offset = strtoul(offstr, &end, 0);
+            if (errno || *end || offset >= MEM_SIZE) {
+                fprintf(stderr, "%s:%u: bad offset %s\n", manifest, lineno, offstr);
+                goto fail;
+            }
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            struct Job *grown = realloc(jobs, capacity * sizeof(*jobs));
+            if (!grown) {
+                perror("realloc");
+                goto fail;
+            }
+            jobs = grown;
+        }
+        jobs[count] = (struct Job) {.rom = strdup(rom), .offset = offset};
+        if (!jobs[count].rom) {
+            perror("strdup");
+            goto fail;
+        }
+        ++count;
+    }
+    fclose(file);
+    *njobs = count;
+    return jobs;
+
+fail:
+    fclose(file);
+    batch_free(jobs, count);
+    return NULL;
+}
+
+void batch_free(struct Job *jobs, size_t njobs)
+{
+    for (size_t i = 0; i < njobs; ++i)
+        free(jobs[i].rom);
+    free(jobs);
+}
+
+/* Raw files at a host page boundary are mapped as ROM, so every job
+ * running one reads the same page cache; anything else is copied in */
+static int load_job(struct CPU *cpu, const struct Image *image, size_t offset)
+{
+    if (!image->hex && offset < MEM_SIZE && !(offset % (size_t) sysconf(_SC_PAGESIZE)) &&
+        !image_map_rom(cpu, image, offset))
+        return 0;
+    return image_load(cpu, image, offset);
+}
+
+static void run_job(size_t index, void *arg)
+{
+    struct Batch *batch = arg;
+    struct Job *job = &batch->jobs[index];
+    struct CPU *cpu = cpu_create();
+
+    job->exit = JOB_ERROR;
+    if (!cpu)
+        return;
+    if (!batch->images[index] || load_job(cpu, batch->images[index], job->offset) < 0) {
+        cpu_destroy(cpu);
+        return;
+    }
+    cpu->regs.pc = job->offset;
+    job->exit = JOB_LIMIT;
+    while (!batch->limit || cpu->cycles < batch->limit) {
+        uint64_t slice = SLICE_CYCLES;
+        if (batch->limit && batch->limit - cpu->cycles < slice)
+            slice = batch->limit - cpu->cycles;
+        int ret = run(cpu, slice);
+        /* nothing here raises interrupts, so a halted machine is done */
+        if (ret != EXIT_BUDGET || cpu->halted) {
+            job->exit = cpu->halted ? EXIT_HLT : ret;
+            break;
+        }
+    }
+    job->instructions = cpu->instructions;
+    job->cycles = cpu->cycles;
+    cpu_destroy(cpu);
+}
+
+/* Run every job to completion on its own machine. Each file is opened once,
+ * however many jobs name it; jobs whose file cannot be opened fail. */
+void batch_run(struct Job *jobs, size_t njobs, unsigned nthreads, uint64_t limit)
+{
+    struct Batch batch = {.jobs = jobs, .limit = limit};
+    /* first[d] is the first job naming the d-th distinct file */
+    size_t *first = malloc(njobs * sizeof(*first));
+    batch.images = calloc(njobs, sizeof(*batch.images));
+    if (!first || !batch.images) {
+        perror("malloc");
+        for (size_t i = 0; i < njobs; ++i)
+            jobs[i].exit = JOB_ERROR;
+        free(first);
+        free(batch.images);
+        return;
+    }
+    size_t ndistinct = 0;
+    for (size_t i = 0; i < njobs; ++i) {
+        size_t d;
+        for (d = 0; d < ndistinct && strcmp(jobs[first[d]].rom, jobs[i].rom); ++d)
+            ;
+        if (d == ndistinct) {
+            first[ndistinct++] = i;
+            batch.images[i] = image_open(jobs[i].rom);
+        } else {
+            batch.images[i] = batch.images[first[d]];
+        }
+    }
+    pool_run(njobs, nthreads, run_job, &batch);
+    for (size_t d = 0; d < ndistinct; ++d)
+        image_close(batch.images[first[d]]);
+    free(first);
+    free(batch.images);
+}
+
+static const char *exit_reason(int exit)
+{
+    switch (exit) {
+        case EXIT_HLT:
+            return "hlt";
+        case EXIT_RST:
+            return "rst";
+        case JOB_LIMIT:
+            return "limit";
+        case JOB_ERROR:
+            return "error";
+        default:
+            return "unknown";
+    }
+}
+
+void batch_report(FILE *out, const struct Job *jobs, size_t njobs)
+{
+    for (size_t i = 0; i < njobs; ++i) {
+        fprintf(out, "%s\t0x%04zx\t%s\t%llu\t%llu\n", jobs[i].rom, jobs[i].offset,
+                exit_reason(jobs[i].exit), (unsigned long long) jobs[i].instructions,
+                (unsigned long long) jobs[i].cycles);
+    }
+}
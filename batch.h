@@ -0,0 +1,23 @@
+#ifndef EMU8080_BATCHH
+#define EMU8080_BATCHH
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define JOB_LIMIT (-2)
+#define JOB_ERROR (-3)
+
+/* One machine to run; filled in from a manifest line */
+struct Job {
+    char *rom;
+    size_t offset;
+    int exit;
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+extern struct Job *batch_load_manifest(const char *manifest, size_t *njobs);
+extern void batch_free(struct Job *jobs, size_t njobs);
+extern void batch_run(struct Job *jobs, size_t njobs, unsigned nthreads, uint64_t limit);
+extern void batch_report(FILE *out, const struct Job *jobs, size_t njobs);
+#endif
@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "io.h"
+#include "cpm.h"
+
+/* Short enough that the clock is read often, long enough not to matter */
+#define SLICE_CYCLES 1000000
+#define LOAD_OFFSET 0x100
+
+/* Count BC down from 0 to 0 and start over */
+static const uint8_t kernel_loop[] = {
+        LXI_B, 0x00, 0x00,
+        DCX_B,                  /* 0x103 */
+        MOV_A_B,
+        ORA_C,
+        JNZ, 0x03, 0x01,
+        JMP, 0x00, 0x01,
+};
+
+/* Every flag-setting ALU form, round and round */
+static const uint8_t kernel_alu[] = {
+        MVI_B, 0x37,
+        MVI_C, 0x5A,
+        MVI_D, 0x81,
+        MVI_E, 0x0F,
+        ADD_B,                  /* 0x108 */
+        ADC_C,
+        SUB_D,
+        SBB_E,
+        ANA_B,
+        XRA_C,
+        ORA_D,
+        CMP_E,
+        INR_A,
+        DCR_B,
+        ADI, 0x11,
+        SUI, 0x03,
+        CPI, 0x40,
+        RLC,
+        DAA,
+        DAD_B,
+        JMP, 0x08, 0x01,
+};
+
+/* Copy 4 KiB from 0x1000 to 0x2000 a byte at a time */
+static const uint8_t kernel_copy[] = {
+        LXI_H, 0x00, 0x10,
+        LXI_D, 0x00, 0x20,
+        LXI_B, 0x00, 0x10,
+        MOV_A_M,                /* 0x109 */
+        STAX_D,
+        INX_H,
+        INX_D,
+        DCX_B,
+        MOV_A_B,
+        ORA_C,
+        JNZ, 0x09, 0x01,
+        JMP, 0x00, 0x01,
+};
+
+/* Two levels of calls with a push and pop at the bottom */
+static const uint8_t kernel_calls[] = {
+        LXI_SP, 0x00, 0xF0,
+        CALL, 0x12, 0x01,       /* 0x103 */
+        CALL, 0x12, 0x01,
+        CALL, 0x12, 0x01,
+        CALL, 0x12, 0x01,
+        JMP, 0x03, 0x01,
+        CALL, 0x16, 0x01,       /* 0x112 */
+        RET,
+        PUSH_B,                 /* 0x116 */
+        POP_B,
+        RET,
+};
+
+/* Either a ROM under roms/ or one of the kernels above */
+struct Workload {
+    const char *name;
+    const char *rom;
+    const uint8_t *code;
+    size_t size;
+};
+
+#define KERNEL(name, code) {name, NULL, code, sizeof(code)}
+
+static const struct Workload workloads[] = {
+        {"cputest", "CPUTEST.COM", NULL, 0},
+        {"tst8080", "TST8080.COM", NULL, 0},
+        {"8080pre", "8080PRE.COM", NULL, 0},
+        {"8080exm", "8080EXM.COM", NULL, 0},
+        KERNEL("loop", kernel_loop),
+        KERNEL("alu", kernel_alu),
+        KERNEL("copy", kernel_copy),
+        KERNEL("calls", kernel_calls),
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Power the machine on with the program loaded; ROMs run under CP/M,
+ * whose console drops their output */
+static int load(struct Cpm *cpm, const struct Workload *w, const struct Image *image)
+{
+    struct CPU *cpu = cpm->cpu;
+    cpu_reset(cpu);
+    if (image_load(cpu, image, LOAD_OFFSET) < 0)
+        return -1;
+    if (w->rom)
+        cpm_boot(cpm, NULL);
+    cpu->regs.pc = LOAD_OFFSET;
+    return 0;
+}
+
+/* Run w for at least seconds, starting it over whenever it finishes.
+ * Returns the elapsed time and adds up what was executed. ROMs are mapped
+ * once up front so restarting a short one is only a copy. */
+static double measure(struct Cpm *cpm, const struct Workload *w, double seconds,
+                      uint64_t *instructions, uint64_t *cycles)
+{
+    struct CPU *cpu = cpm->cpu;
+    struct Image kernel = {.data = w->code, .size = w->size, .fd = -1};
+    struct Image *image = &kernel;
+    if (w->rom && !(image = image_open(w->rom)))
+        return -1;
+
+    *instructions = *cycles = 0;
+    double start = now(), elapsed = -1;
+    if (load(cpm, w, image))
+        goto done;
+    do {
+        int ret = run(cpu, SLICE_CYCLES);
+        if (ret != EXIT_BUDGET) {
+            *instructions += cpu->instructions;
+            *cycles += cpu->cycles;
+            if (load(cpm, w, image)) {
+                elapsed = -1;
+                goto done;
+            }
+        }
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    *instructions += cpu->instructions;
+    *cycles += cpu->cycles;
+done:
+    if (image != &kernel)
+        image_close(image);
+    return elapsed;
+}
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-r runs] [workload...]\nworkloads:", program_name);
+    for (size_t i = 0; i < NWORKLOADS; ++i)
+        fprintf(stderr, " %s", workloads[i].name);
+    fputc('\n', stderr);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program_name = argv[0];
+    double seconds = 1.0;
+    unsigned runs = 5;
+    int c;
+    while ((c = getopt(argc, argv, "ht:r:")) != -1) {
+        switch (c) {
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'r':
+                runs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(program_name);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (seconds <= 0 || runs == 0) {
+        usage(program_name);
+        return EXIT_FAILURE;
+    }
+    bool selected[NWORKLOADS] = {0};
+    for (int argind = optind; argind < argc; ++argind) {
+        size_t i;
+        for (i = 0; i < NWORKLOADS && strcmp(argv[argind], workloads[i].name); ++i)
+            ;
+        if (i == NWORKLOADS) {
+            fprintf(stderr, "%s: unknown workload %s\n", program_name, argv[argind]);
+            usage(program_name);
+            return EXIT_FAILURE;
+        }
+        selected[i] = true;
+    }
+
+    struct CPU *cpu = cpu_create();
+    if (!cpu) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    struct Cpm *cpm = cpm_create(cpu, ".", NULL, NULL);
+    if (!cpm) {
+        cpu_destroy(cpu);
+        return EXIT_FAILURE;
+    }
+    printf("%-10s %10s %8s %10s %10s\n", "workload", "MIPS", "+-", "MHz", "ns/instr");
+    for (size_t i = 0; i < NWORKLOADS; ++i) {
+        if (optind < argc && !selected[i])
+            continue;
+        /* Welford's running mean and variance over the runs */
+        double mean = 0, m2 = 0, mhz = 0;
+        for (unsigned r = 0; r < runs; ++r) {
+            uint64_t instructions, cycles;
+            double elapsed = measure(cpm, &workloads[i], seconds, &instructions, &cycles);
+            if (elapsed < 0) {
+                cpm_destroy(cpm);
+                cpu_destroy(cpu);
+                return EXIT_FAILURE;
+            }
+            double mips = instructions / elapsed / 1e6;
+            double delta = mips - mean;
+            mean += delta / (r + 1);
+            m2 += delta * (mips - mean);
+            mhz += cycles / elapsed / 1e6 / runs;
+        }
+        double sd = runs > 1 ? sqrt(m2 / (runs - 1)) : 0;
+        printf("%-10s %10.1f %8.1f %10.1f %10.2f\n", workloads[i].name, mean, sd, mhz, 1e3 / mean);
+        fflush(stdout);
+    }
+    cpm_destroy(cpm);
+    cpu_destroy(cpu);
+}
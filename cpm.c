@@ -0,0 +1,751 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cpm.h"
+
+#define RECORD 128
+#define CTRL_Z 0x1A
+#define DEFAULT_FCB 0x005C
+#define DEFAULT_DMA 0x0080
+
+/* Offsets into a file control block */
+#define FCB_NAME 1
+#define FCB_EX 12
+#define FCB_S2 14
+#define FCB_RC 15
+#define FCB_NEW_NAME 17     /* where rename finds the new name */
+#define FCB_CR 32
+#define FCB_R0 33
+
+/* BDOS functions, by the number in C */
+enum {
+    BDOS_RESET = 0,
+    BDOS_CONIN = 1,
+    BDOS_CONOUT = 2,
+    BDOS_READER = 3,
+    BDOS_PUNCH = 4,
+    BDOS_LIST = 5,
+    BDOS_DIRECT_IO = 6,
+    BDOS_PRINT = 9,
+    BDOS_READ_LINE = 10,
+    BDOS_CONSOLE_STATUS = 11,
+    BDOS_VERSION = 12,
+    BDOS_RESET_DISKS = 13,
+    BDOS_SELECT_DISK = 14,
+    BDOS_OPEN = 15,
+    BDOS_CLOSE = 16,
+    BDOS_SEARCH_FIRST = 17,
+    BDOS_SEARCH_NEXT = 18,
+    BDOS_DELETE = 19,
+    BDOS_READ = 20,
+    BDOS_WRITE = 21,
+    BDOS_MAKE = 22,
+    BDOS_RENAME = 23,
+    BDOS_LOGIN_VECTOR = 24,
+    BDOS_CURRENT_DISK = 25,
+    BDOS_SET_DMA = 26,
+    BDOS_USER = 32,
+    BDOS_READ_RANDOM = 33,
+    BDOS_WRITE_RANDOM = 34,
+    BDOS_FILE_SIZE = 35,
+    BDOS_SET_RANDOM = 36,
+    BDOS_WRITE_RANDOM_ZERO = 40,
+};
+
+/* BIOS calls, by their place in the jump table */
+enum {
+    BIOS_BOOT,
+    BIOS_WBOOT,
+    BIOS_CONST,
+    BIOS_CONIN,
+    BIOS_CONOUT,
+    BIOS_LIST,
+    BIOS_PUNCH,
+    BIOS_READER,
+    BIOS_HOME,
+    BIOS_SELDSK,
+    BIOS_SETTRK,
+    BIOS_SETSEC,
+    BIOS_SETDMA,
+    BIOS_READ,
+    BIOS_WRITE,
+    BIOS_LISTST,
+    BIOS_SECTRAN,
+};
+
+void cpm_flush(struct Cpm *cpm)
+{
+    if (cpm->len && cpm->out) {
+        fwrite(cpm->console, 1, cpm->len, cpm->out);
+        fflush(cpm->out);
+    }
+    cpm->len = 0;
+}
+
+static void console_out(struct Cpm *cpm, uint8_t c)
+{
+    if (!cpm->out)
+        return;
+    if (cpm->len == sizeof(cpm->console))
+        cpm_flush(cpm);
+    cpm->console[cpm->len++] = c;
+}
+
+/* Waits for a character. Input is not echoed: a terminal already does. */
+static uint8_t console_in(struct Cpm *cpm)
+{
+    cpm_flush(cpm);
+    int c = cpm->in ? getc(cpm->in) : EOF;
+    return c == EOF ? CTRL_Z : c == '\n' ? '\r' : c;
+}
+
+static void terminate(struct Cpm *cpm)
+{
+    cpm->done = true;
+    cpm_flush(cpm);
+    cpm->cpu->regs.pc = CPM_EXIT;
+}
+
+static void poke(struct CPU *cpu, uint16_t addr, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        write_byte(cpu, addr + i, data[i]);
+}
+
+static void peek(struct CPU *cpu, uint16_t addr, uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        data[i] = read_byte(cpu, addr + i);
+}
+
+/* Names in FCBs are 8 + 3 characters padded with spaces; the top bits are
+ * attributes */
+static void fcb_name(struct CPU *cpu, uint16_t addr, uint8_t name[11])
+{
+    peek(cpu, addr, name, 11);
+    for (int i = 0; i < 11; ++i)
+        name[i] = toupper(name[i] & 0x7F);
+}
+
+/* The FCB name of a host file, if it has one */
+static bool host_to_fcb(const char *host, uint8_t name[11])
+{
+    const char *dot = strrchr(host, '.');
+    size_t base = dot ? (size_t) (dot - host) : strlen(host), ext = dot ? strlen(dot + 1) : 0;
+    if (!base || base > 8 || ext > 3)
+        return false;
+    memset(name, ' ', 11);
+    for (size_t i = 0; i < base + (dot ? 1 + ext : 0); ++i) {
+        unsigned char c = host[i];
+        if (i == base)
+            continue;
+        if (c <= ' ' || c >= 0x7F || c == '.' || c == '?' || c == '*')
+            return false;
+        name[i < base ? i : 8 + i - base - 1] = toupper(c);
+    }
+    return true;
+}
+
+/* Characters CP/M allows in a file name. The rest must not reach the host
+ * either: a '/' would leave the directory. */
+static bool name_char(uint8_t c)
+{
+    return c > ' ' && c < 0x7F && c != '/' && !strchr("<>.,;:=?*[]", c);
+}
+
+/* Lowercase name.ext for files that do not exist yet, or false if the
+ * name is not one CP/M allows */
+static bool fcb_to_host(const uint8_t name[11], char host[13])
+{
+    size_t len = 0;
+    if (name[0] == ' ')
+        return false;
+    for (int i = 0; i < 8 && name[i] != ' '; ++i) {
+        if (!name_char(name[i]))
+            return false;
+        host[len++] = tolower(name[i]);
+    }
+    if (name[8] != ' ')
+        host[len++] = '.';
+    for (int i = 8; i < 11 && name[i] != ' '; ++i) {
+        if (!name_char(name[i]))
+            return false;
+        host[len++] = tolower(name[i]);
+    }
+    host[len] = '\0';
+    return true;
+}
+
+static bool matches(const uint8_t pattern[11], const uint8_t name[11])
+{
+    for (int i = 0; i < 11; ++i)
+        if (pattern[i] != '?' && pattern[i] != name[i])
+            return false;
+    return true;
+}
+
+static DIR *open_dir(struct Cpm *cpm)
+{
+    int fd = dup(cpm->dir);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    rewinddir(dir);
+    return dir;
+}
+
+/* The next regular file in dir matching pattern, whatever its case */
+static struct dirent *next_match(struct Cpm *cpm, DIR *dir, const uint8_t pattern[11],
+                                 uint8_t name[11])
+{
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir))) {
+        if (host_to_fcb(entry->d_name, name) && matches(pattern, name) &&
+            !fstatat(cpm->dir, entry->d_name, &st, 0) && S_ISREG(st.st_mode))
+            return entry;
+    }
+    return NULL;
+}
+
+static bool find(struct Cpm *cpm, const uint8_t pattern[11], uint8_t name[11], char *host, size_t size)
+{
+    DIR *dir = open_dir(cpm);
+    struct dirent *entry = dir ? next_match(cpm, dir, pattern, name) : NULL;
+    bool found = entry;
+    if (found)
+        snprintf(host, size, "%s", entry->d_name);
+    if (dir)
+        closedir(dir);
+    return found;
+}
+
+static struct CpmFile *lookup(struct Cpm *cpm, const uint8_t name[11])
+{
+    for (int i = 0; i < CPM_FILES; ++i)
+        if (cpm->files[i].fd != -1 && !memcmp(cpm->files[i].name, name, 11))
+            return &cpm->files[i];
+    return NULL;
+}
+
+static void forget(struct Cpm *cpm, const uint8_t name[11])
+{
+    struct CpmFile *file = lookup(cpm, name);
+    if (file) {
+        close(file->fd);
+        file->fd = -1;
+    }
+}
+
+static int remember(struct Cpm *cpm, const uint8_t name[11], int fd)
+{
+    struct CpmFile *file = NULL;
+    for (int i = 0; i < CPM_FILES && !file; ++i)
+        if (cpm->files[i].fd == -1)
+            file = &cpm->files[i];
+    if (!file) {
+        file = &cpm->files[cpm->next_file++ % CPM_FILES];
+        close(file->fd);
+    }
+    memcpy(file->name, name, 11);
+    file->fd = fd;
+    return fd;
+}
+
+/* The host file behind an FCB, opened again if it was closed or never
+ * opened: programs may read and write through an FCB after closing it */
+static int file_fd(struct Cpm *cpm, const uint8_t name[11])
+{
+    struct CpmFile *file = lookup(cpm, name);
+    if (file)
+        return file->fd;
+    uint8_t found[11];
+    char host[NAME_MAX + 1];
+    if (!find(cpm, name, found, host, sizeof(host)))
+        return -1;
+    int fd = openat(cpm->dir, host, O_RDWR);
+    if (fd == -1 && errno == EACCES)
+        fd = openat(cpm->dir, host, O_RDONLY);
+    return fd == -1 ? -1 : remember(cpm, name, fd);
+}
+
+/* Records are numbered by module (S2), extent (EX) and current record */
+static uint32_t fcb_record(struct CPU *cpu, uint16_t fcb)
+{
+    return (read_byte(cpu, fcb + FCB_S2) & 0x3F) << 12 | (read_byte(cpu, fcb + FCB_EX) & 0x1F) << 7 |
+           (read_byte(cpu, fcb + FCB_CR) & 0x7F);
+}
+
+/* Point the FCB at record, with RC counting the records of its extent */
+static void fcb_seek(struct CPU *cpu, uint16_t fcb, uint32_t record, int fd)
+{
+    struct stat st;
+    uint32_t records = fd != -1 && !fstat(fd, &st) ? (st.st_size + RECORD - 1) / RECORD : 0;
+    uint32_t extent = record & ~0x7Fu;
+    write_byte(cpu, fcb + FCB_CR, record & 0x7F);
+    write_byte(cpu, fcb + FCB_EX, record >> 7 & 0x1F);
+    write_byte(cpu, fcb + FCB_S2, record >> 12);
+    write_byte(cpu, fcb + FCB_RC, records <= extent ? 0 : records - extent > 0x80 ? 0x80 : records - extent);
+}
+
+/* Read and write record of the FCB's file, setting *fd to the file used:
+ * the record read may land on the FCB itself, so its name cannot be
+ * looked at again afterwards */
+static uint8_t read_record(struct Cpm *cpm, uint16_t fcb, uint32_t record, int *fd)
+{
+    uint8_t name[11], data[RECORD];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, name);
+    if ((*fd = file_fd(cpm, name)) == -1)
+        return 0xFF;
+    ssize_t n = pread(*fd, data, RECORD, (off_t) record * RECORD);
+    if (n <= 0)
+        return 1;
+    memset(data + n, CTRL_Z, RECORD - n);
+    poke(cpm->cpu, cpm->dma, data, RECORD);
+    return 0;
+}
+
+static uint8_t write_record(struct Cpm *cpm, uint16_t fcb, uint32_t record, int *fd)
+{
+    uint8_t name[11], data[RECORD];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, name);
+    if ((*fd = file_fd(cpm, name)) == -1)
+        return 0xFF;
+    peek(cpm->cpu, cpm->dma, data, RECORD);
+    return pwrite(*fd, data, RECORD, (off_t) record * RECORD) == RECORD ? 0 : 2;
+}
+
+/* The record R0-R2 names, or -1 past the 8 MiB a file can hold */
+static int32_t random_record(struct CPU *cpu, uint16_t fcb)
+{
+    if (read_byte(cpu, fcb + FCB_R0 + 2))
+        return -1;
+    return read_byte(cpu, fcb + FCB_R0) | read_byte(cpu, fcb + FCB_R0 + 1) << 8;
+}
+
+static void set_random_record(struct CPU *cpu, uint16_t fcb, uint32_t record)
+{
+    write_byte(cpu, fcb + FCB_R0, (uint8_t) record);
+    write_byte(cpu, fcb + FCB_R0 + 1, (uint8_t) (record >> 8));
+    write_byte(cpu, fcb + FCB_R0 + 2, (uint8_t) (record >> 16));
+}
+
+static uint8_t search_next(struct Cpm *cpm)
+{
+    uint8_t name[11];
+    struct dirent *entry = cpm->search ? next_match(cpm, cpm->search, cpm->pattern, name) : NULL;
+    if (!entry) {
+        if (cpm->search)
+            closedir(cpm->search);
+        cpm->search = NULL;
+        return 0xFF;
+    }
+    /* a directory entry at the start of the DMA buffer */
+    uint8_t dir_entry[32] = {0};
+    struct stat st;
+    memcpy(dir_entry + FCB_NAME, name, 11);
+    if (!fstatat(cpm->dir, entry->d_name, &st, 0)) {
+        off_t records = (st.st_size + RECORD - 1) / RECORD;
+        dir_entry[FCB_RC] = records > 0x80 ? 0x80 : records;
+    }
+    poke(cpm->cpu, cpm->dma, dir_entry, sizeof(dir_entry));
+    return 0;
+}
+
+static uint8_t search_first(struct Cpm *cpm, uint16_t fcb)
+{
+    if (cpm->search)
+        closedir(cpm->search);
+    if (read_byte(cpm->cpu, fcb) == '?')
+        memset(cpm->pattern, '?', 11);
+    else
+        fcb_name(cpm->cpu, fcb + FCB_NAME, cpm->pattern);
+    cpm->search = open_dir(cpm);
+    return search_next(cpm);
+}
+
+static uint8_t open_file(struct Cpm *cpm, uint16_t fcb)
+{
+    uint8_t pattern[11], name[11];
+    char host[NAME_MAX + 1];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, pattern);
+    if (!find(cpm, pattern, name, host, sizeof(host)))
+        return 0xFF;
+    /* a wildcard opens the first match, whose name the FCB gets */
+    poke(cpm->cpu, fcb + FCB_NAME, name, 11);
+    int fd = file_fd(cpm, name);
+    if (fd == -1)
+        return 0xFF;
+    write_byte(cpm->cpu, fcb + FCB_S2, 0);
+    fcb_seek(cpm->cpu, fcb, fcb_record(cpm->cpu, fcb), fd);
+    return 0;
+}
+
+static uint8_t make_file(struct Cpm *cpm, uint16_t fcb)
+{
+    uint8_t name[11], found[11];
+    char host[NAME_MAX + 1];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, name);
+    if (memchr(name, '?', 11))
+        return 0xFF;
+    if (!find(cpm, name, found, host, sizeof(host)) && !fcb_to_host(name, host))
+        return 0xFF;
+    forget(cpm, name);
+    int fd = openat(cpm->dir, host, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return 0xFF;
+    remember(cpm, name, fd);
+    write_byte(cpm->cpu, fcb + FCB_S2, 0);
+    fcb_seek(cpm->cpu, fcb, fcb_record(cpm->cpu, fcb), fd);
+    return 0;
+}
+
+static uint8_t delete_files(struct Cpm *cpm, uint16_t fcb)
+{
+    uint8_t pattern[11], name[11];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, pattern);
+    DIR *dir = open_dir(cpm);
+    if (!dir)
+        return 0xFF;
+    uint8_t ret = 0xFF;
+    struct dirent *entry;
+    while ((entry = next_match(cpm, dir, pattern, name))) {
+        forget(cpm, name);
+        if (!unlinkat(cpm->dir, entry->d_name, 0))
+            ret = 0;
+    }
+    closedir(dir);
+    return ret;
+}
+
+static uint8_t rename_file(struct Cpm *cpm, uint16_t fcb)
+{
+    uint8_t from[11], to[11], found[11];
+    char host[NAME_MAX + 1], new_host[13];
+    fcb_name(cpm->cpu, fcb + FCB_NAME, from);
+    fcb_name(cpm->cpu, fcb + FCB_NEW_NAME, to);
+    if (memchr(from, '?', 11) || !fcb_to_host(to, new_host) ||
+        !find(cpm, from, found, host, sizeof(host)))
+        return 0xFF;
+    forget(cpm, from);
+    forget(cpm, to);
+    return renameat(cpm->dir, host, cpm->dir, new_host) ? 0xFF : 0;
+}
+
+static uint16_t file_size(struct Cpm *cpm, uint16_t fcb)
+{
+    uint8_t name[11], found[11];
+    char host[NAME_MAX + 1];
+    struct stat st;
+    fcb_name(cpm->cpu, fcb + FCB_NAME, name);
+    if (!find(cpm, name, found, host, sizeof(host)) || fstatat(cpm->dir, host, &st, 0))
+        return 0xFF;
+    set_random_record(cpm->cpu, fcb, (st.st_size + RECORD - 1) / RECORD);
+    return 0;
+}
+
+static uint16_t read_line(struct Cpm *cpm, uint16_t buffer)
+{
+    uint8_t max = read_byte(cpm->cpu, buffer), len = 0;
+    cpm_flush(cpm);
+    while (len < max) {
+        int c = cpm->in ? getc(cpm->in) : EOF;
+        if (c == EOF || c == '\n')
+            break;
+        write_byte(cpm->cpu, buffer + 2 + len++, c);
+    }
+    write_byte(cpm->cpu, buffer + 1, len);
+    return 0;
+}
+
+static uint16_t bdos(struct Cpm *cpm)
+{
+    struct CPU *cpu = cpm->cpu;
+    uint16_t de = cpu->regs.de;
+    int32_t record;
+    switch (cpu->regs.c) {
+        case BDOS_RESET:
+            terminate(cpm);
+            return 0;
+        case BDOS_CONIN:
+        case BDOS_READER:
+            return console_in(cpm);
+        case BDOS_CONOUT:
+            console_out(cpm, cpu->regs.e);
+            return 0;
+        case BDOS_DIRECT_IO:
+            if (cpu->regs.e == 0xFF) {
+                int c = console_in(cpm);
+                return c == CTRL_Z ? 0 : c;
+            }
+            if (cpu->regs.e != 0xFE)
+                console_out(cpm, cpu->regs.e);
+            return 0;
+        case BDOS_PRINT:
+            /* stops at '$' or when it wraps back to where it began */
+            for (uint16_t addr = de; ; ) {
+                uint8_t c = read_byte(cpu, addr);
+                if (c == '$')
+                    break;
+                console_out(cpm, c);
+                if (++addr == de)
+                    break;
+            }
+            return 0;
+        case BDOS_READ_LINE:
+            return read_line(cpm, de);
+        case BDOS_VERSION:
+            return 0x0022;
+        case BDOS_RESET_DISKS:
+            cpm->dma = DEFAULT_DMA;
+            return 0;
+        case BDOS_LOGIN_VECTOR:
+            return 0x0001;
+        case BDOS_OPEN:
+            return open_file(cpm, de);
+        case BDOS_CLOSE: {
+            uint8_t name[11], found[11];
+            char host[NAME_MAX + 1];
+            fcb_name(cpu, de + FCB_NAME, name);
+            forget(cpm, name);
+            return find(cpm, name, found, host, sizeof(host)) ? 0 : 0xFF;
+        }
+        case BDOS_SEARCH_FIRST:
+            return search_first(cpm, de);
+        case BDOS_SEARCH_NEXT:
+            return search_next(cpm);
+        case BDOS_DELETE:
+            return delete_files(cpm, de);
+        case BDOS_READ:
+        case BDOS_WRITE: {
+            uint32_t next = fcb_record(cpu, de);
+            int fd;
+            uint8_t ret = cpu->regs.c == BDOS_READ ? read_record(cpm, de, next, &fd)
+                                                   : write_record(cpm, de, next, &fd);
+            if (!ret)
+                fcb_seek(cpu, de, next + 1, fd);
+            return ret;
+        }
+        case BDOS_MAKE:
+            return make_file(cpm, de);
+        case BDOS_RENAME:
+            return rename_file(cpm, de);
+        case BDOS_SET_DMA:
+            cpm->dma = de;
+            return 0;
+        case BDOS_READ_RANDOM:
+        case BDOS_WRITE_RANDOM:
+        case BDOS_WRITE_RANDOM_ZERO: {
+            if ((record = random_record(cpu, de)) < 0)
+                return 6;
+            int fd;
+            uint8_t ret = cpu->regs.c == BDOS_READ_RANDOM ? read_record(cpm, de, record, &fd)
+                                                          : write_record(cpm, de, record, &fd);
+            /* sequential access carries on from the same record */
+            if (ret != 0xFF)
+                fcb_seek(cpu, de, record, fd);
+            return ret;
+        }
+        case BDOS_FILE_SIZE:
+            return file_size(cpm, de);
+        case BDOS_SET_RANDOM:
+            set_random_record(cpu, de, fcb_record(cpu, de));
+            return 0;
+        case BDOS_PUNCH:
+        case BDOS_LIST:
+        case BDOS_CONSOLE_STATUS:
+        case BDOS_SELECT_DISK:
+        case BDOS_CURRENT_DISK:
+        case BDOS_USER:
+        default:
+            return 0;
+    }
+}
+
+static void bios(struct Cpm *cpm, unsigned call)
+{
+    struct CPU *cpu = cpm->cpu;
+    switch (call) {
+        case BIOS_BOOT:
+        case BIOS_WBOOT:
+            terminate(cpm);
+            break;
+        case BIOS_CONIN:
+            cpu->regs.a = console_in(cpm);
+            break;
+        case BIOS_CONOUT:
+            console_out(cpm, cpu->regs.c);
+            break;
+        case BIOS_READER:
+            cpu->regs.a = CTRL_Z;
+            break;
+        case BIOS_SELDSK:
+            /* there are no disks to read sectors from, only files */
+            cpu->regs.hl = 0;
+            break;
+        case BIOS_READ:
+        case BIOS_WRITE:
+            cpu->regs.a = 1;
+            break;
+        case BIOS_LISTST:
+            cpu->regs.a = 0xFF;
+            break;
+        case BIOS_SECTRAN:
+            cpu->regs.hl = cpu->regs.bc;
+            break;
+        default:
+            cpu->regs.a = 0;
+            break;
+    }
+}
+
+/* OUT CPM_PORT from a trap; pc is just past it. A program writing to the
+ * port anywhere else is ignored. */
+static void trap(void *device, uint8_t port, uint8_t value)
+{
+    struct Cpm *cpm = device;
+    struct CPU *cpu = cpm->cpu;
+    uint16_t from = cpu->regs.pc - 2;
+    (void) port;
+    (void) value;
+    if (from == CPM_BDOS) {
+        uint16_t ret = bdos(cpm);
+        /* results come back in HL, and in BA and A */
+        cpu->regs.hl = ret;
+        cpu->regs.a = cpu->regs.l;
+        cpu->regs.b = cpu->regs.h;
+    } else if (from >= CPM_BIOS_TRAPS && from < CPM_BIOS_TRAPS + 3 * CPM_BIOS_CALLS &&
+               !((from - CPM_BIOS_TRAPS) % 3)) {
+        bios(cpm, (from - CPM_BIOS_TRAPS) / 3);
+    }
+}
+
+struct Cpm *cpm_create(struct CPU *cpu, const char *dir, FILE *in, FILE *out)
+{
+    struct Cpm *cpm = calloc(1, sizeof(*cpm));
+    if (!cpm) {
+        perror("calloc");
+        return NULL;
+    }
+    cpm->cpu = cpu;
+    cpm->in = in;
+    cpm->out = out;
+    cpm->dma = DEFAULT_DMA;
+    for (int i = 0; i < CPM_FILES; ++i)
+        cpm->files[i].fd = -1;
+    if ((cpm->dir = open(dir, O_RDONLY | O_DIRECTORY)) == -1) {
+        perror(dir);
+        free(cpm);
+        return NULL;
+    }
+    if (cpu_attach_port(cpu, CPM_PORT, NULL, trap, cpm)) {
+        perror("calloc");
+        close(cpm->dir);
+        free(cpm);
+        return NULL;
+    }
+    return cpm;
+}
+
+void cpm_destroy(struct Cpm *cpm)
+{
+    if (!cpm)
+        return;
+    cpm_flush(cpm);
+    cpu_attach_port(cpm->cpu, CPM_PORT, NULL, NULL, NULL);
+    for (int i = 0; i < CPM_FILES; ++i)
+        if (cpm->files[i].fd != -1)
+            close(cpm->files[i].fd);
+    if (cpm->search)
+        closedir(cpm->search);
+    close(cpm->dir);
+    free(cpm);
+}
+
+/* Fill the FCB at addr from an argument such as B:NAME.* */
+static void parse_fcb(struct CPU *cpu, uint16_t addr, const char *arg, size_t len)
+{
+    uint8_t fcb[16] = {0};
+    memset(fcb + FCB_NAME, ' ', 11);
+    if (len >= 2 && arg[1] == ':') {
+        fcb[0] = toupper((unsigned char) arg[0]) - 'A' + 1;
+        arg += 2;
+        len -= 2;
+    }
+    for (size_t i = 0, field = 0, pos = 0; i < len; ++i) {
+        char c = toupper((unsigned char) arg[i]);
+        size_t size = field ? 3 : 8, start = field ? 9 : 1;
+        if (c == '.' && !field) {
+            field = 1;
+            pos = 0;
+        } else if (c == '*') {
+            memset(fcb + start + pos, '?', size - pos);
+            pos = size;
+        } else if (pos < size) {
+            fcb[start + pos++] = c;
+        }
+    }
+    poke(cpu, addr, fcb, sizeof(fcb));
+}
+
+void cpm_boot(struct Cpm *cpm, const char *tail)
+{
+    struct CPU *cpu = cpm->cpu;
+    const uint8_t trap_code[] = {OUT, CPM_PORT, RET};
+    const uint8_t page_zero[8] = {
+            JMP, (CPM_BIOS + 3) & 0xFF, (CPM_BIOS + 3) >> 8,    /* warm boot */
+            0, 0,                                               /* IOBYTE, drive */
+            JMP, CPM_BDOS & 0xFF, CPM_BDOS >> 8,
+    };
+    const uint8_t exit_code[] = {JMP, 0, 0};
+    poke(cpu, 0x0000, page_zero, sizeof(page_zero));
+    poke(cpu, CPM_BDOS, trap_code, sizeof(trap_code));
+    poke(cpu, CPM_EXIT, exit_code, sizeof(exit_code));
+    for (unsigned i = 0; i < CPM_BIOS_CALLS; ++i) {
+        uint16_t target = CPM_BIOS_TRAPS + 3 * i;
+        const uint8_t jump[] = {JMP, target & 0xFF, target >> 8};
+        poke(cpu, CPM_BIOS + 3 * i, jump, sizeof(jump));
+        poke(cpu, target, trap_code, sizeof(trap_code));
+    }
+
+    /* the command line as the CCP leaves it: upper case, after a space */
+    uint8_t line[RECORD] = {0};
+    size_t len = 0;
+    while (tail && *tail == ' ')
+        ++tail;
+    if (tail && *tail)
+        line[++len] = ' ';
+    for (; tail && *tail && len < RECORD - 2; ++tail)
+        line[++len] = toupper((unsigned char) *tail);
+    line[0] = len;
+    const uint8_t blank[36] = {0, ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+                               [16] = 0, ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    poke(cpu, DEFAULT_FCB, blank, sizeof(blank));
+    for (size_t i = 2, n = 0; i <= len && n < 2; ++n) {
+        size_t end = i;
+        while (end <= len && line[end] != ' ')
+            ++end;
+        parse_fcb(cpu, DEFAULT_FCB + 16 * n, (const char *) line + i, end - i);
+        for (i = end; i <= len && line[i] == ' '; ++i)
+            ;
+    }
+    poke(cpu, DEFAULT_DMA, line, sizeof(line));
+
+    cpm->dma = DEFAULT_DMA;
+    cpm->done = false;
+    /* a program that returns goes back to 0 */
+    cpu->regs.sp = CPM_BDOS - 2;
+    write_byte(cpu, cpu->regs.sp, 0);
+    write_byte(cpu, cpu->regs.sp + 1, 0);
+    cpu->regs.pc = CPM_TPA;
+}
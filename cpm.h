@@ -0,0 +1,52 @@
+#ifndef EMU8080_CPMH
+#define EMU8080_CPMH
+#include <stdbool.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define CPM_PORT 0xFF           /* OUT to it from the BDOS or BIOS entry traps */
+#define CPM_TPA 0x0100          /* where programs are loaded and started */
+#define CPM_BDOS 0xFE00         /* OUT CPM_PORT; RET, reached through 0x0005 */
+#define CPM_EXIT 0xFE03         /* JMP 0, so run() stops with EXIT_RST */
+#define CPM_BIOS 0xFF00         /* jump table, one entry per BIOS call */
+#define CPM_BIOS_CALLS 17
+#define CPM_BIOS_TRAPS (CPM_BIOS + 3 * CPM_BIOS_CALLS) /* OUT CPM_PORT; RET each */
+#define CPM_CONSOLE_BUFFER 4096
+#define CPM_FILES 16            /* host files kept open at once */
+
+/* A file an FCB has opened, found again by its name */
+struct CpmFile {
+    uint8_t name[11];
+    int fd;
+};
+
+struct Cpm {
+    struct CPU *cpu;
+    FILE *in, *out;         /* console; no input reads as ^Z, no output drops it */
+    int dir;                /* host directory standing in for every drive */
+    uint16_t dma;
+    bool done;              /* the program asked to be terminated */
+    struct CpmFile files[CPM_FILES];
+    unsigned next_file;     /* reused when the table is full */
+    DIR *search;            /* where search next carries on */
+    uint8_t pattern[11];
+    size_t len;
+    char console[CPM_CONSOLE_BUFFER];
+};
+
+/* Serve BDOS and BIOS calls of the program in cpu, with files from the
+ * directory dir and console on in and out, either of which may be NULL */
+extern struct Cpm *cpm_create(struct CPU *cpu, const char *dir, FILE *in, FILE *out);
+/* Flush the console, close the files and detach from the machine */
+extern void cpm_destroy(struct Cpm *cpm);
+/* Set up page zero, the BDOS and the BIOS, parse tail (the arguments the
+ * program was run with, or NULL) into the command line and default FCBs,
+ * and start the program at CPM_TPA. Load it first: this only writes the
+ * pages around it. */
+extern void cpm_boot(struct Cpm *cpm, const char *tail);
+/* Write out console output still buffered */
+extern void cpm_flush(struct Cpm *cpm);
+#endif
@@ -1,10 +1,19 @@
+#define _DEFAULT_SOURCE
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "cpu.h"
+#include "alu.h"
+#include "cycles.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "lockstep.h"
 
-/* Initialize processor state */
-uint8_t memory[MEM_SIZE] = {0};
-struct Registers regs = {0};
-bool interrupt_enabled = 0;
-
+#ifndef EMU8080_PACKED_FLAGS
 static const bool parity_table[256] = {
         1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
         0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
@@ -23,21 +32,211 @@ static const bool parity_table[256] = {
         0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
         1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
 };
+#endif
+
+/* Internal to run(): a control transfer happened and the JIT may take over */
+#define EXIT_BRANCH (16)
+
+#define PORT_BUFFER 256     /* bytes queued on a buffered port */
+
+/* Handlers for one I/O port; buffered ports have a queue */
+struct Port {
+    port_read read;
+    port_write write;
+    port_flush flush;
+    void *device;
+    uint8_t *buffer;
+    uint16_t len;
+};
+
+struct Bus {
+    struct Port ports[256];
+    uint8_t pending[256];   /* buffered ports with bytes queued */
+    unsigned npending;
+};
+
+/* What each page of the address space shows, when not plain RAM: the host
+ * buffer of a bank or ROM copied into cpu->memory, or a device */
+struct MemMap {
+    uint8_t *host[MEM_PAGES];
+    mem_read read[MEM_PAGES];
+    mem_write write[MEM_PAGES];
+    void *device[MEM_PAGES];
+};
+
+/* A page of saved RAM, shared by the snapshots that have it unchanged */
+struct Page {
+    atomic_uint refs;
+    uint8_t data[MEM_PAGE_SIZE];
+};
+
+struct Snapshot {
+    atomic_uint refs;   /* the owner and machines based on it */
+    struct Registers regs;
+    bool interrupt_enabled;
+    bool interrupt_pending;
+    uint8_t interrupt_vector;
+    bool halted;
+    uint8_t port;
+    uint64_t cycles;
+    uint64_t instructions;
+    struct Page *pages[MEM_PAGES];  /* NULL where there was no RAM */
+};
+
+static size_t host_page(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+/* Machines are placed in their own mapping so that memory starts on a host
+ * page, where shared ROM can be mapped over it. This is how far in. */
+static size_t memory_skew(void)
+{
+    return (host_page() - offsetof(struct CPU, memory) % host_page()) % host_page();
+}
+
+/* Allocate a processor in its reset state */
+struct CPU *cpu_create(void)
+{
+    uint8_t *block = mmap(NULL, memory_skew() + sizeof(struct CPU), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+        return NULL;
+    struct CPU *cpu = (struct CPU *) (block + memory_skew());
+#ifdef EMU8080_JIT
+    /* without a code buffer the machine simply stays interpreted */
+    cpu->jit = jit_create(cpu);
+#endif
+    return cpu;
+}
+
+void cpu_destroy(struct CPU *cpu)
+{
+    if (!cpu)
+        return;
+    free(cpu->breakpoints);
+    jit_destroy(cpu->jit);
+    trace_destroy(cpu->trace);
+    profile_destroy(cpu->profile);
+    if (cpu->bus) {
+        for (unsigned i = 0; i < 256; ++i)
+            free(cpu->bus->ports[i].buffer);
+        free(cpu->bus);
+    }
+    free(cpu->map);
+    cpu_free_snapshot(cpu->base);
+    /* shared ROM goes with the rest of the mapping */
+    munmap((uint8_t *) cpu - memory_skew(), memory_skew() + sizeof(struct CPU));
+}
+
+static void save_page(struct CPU *cpu, unsigned page);
+static void load_page(struct CPU *cpu, unsigned page);
+
+/* Clear registers and memory, as if the machine was just powered on.
+ * Breakpoints, devices and the memory map belong to the host, so they are
+ * kept, and banks and ROMs keep what they hold. */
+void cpu_reset(struct CPU *cpu)
+{
+    uint8_t *breakpoints = cpu->breakpoints;
+    struct Jit *jit = cpu->jit;
+    struct Bus *bus = cpu->bus;
+    struct MemMap *map = cpu->map;
+    struct Snapshot *base = cpu->base;
+    struct Trace *trace = cpu->trace;
+    struct Profile *profile = cpu->profile;
+    struct LockstepLog *lockstep = cpu->lockstep;
+    uint8_t page_flags[MEM_PAGES];
+    memcpy(page_flags, cpu->page_flags, sizeof(page_flags));
+    for (unsigned page = 0; map && page < MEM_PAGES; ++page)
+        save_page(cpu, page);
+    memset(cpu, 0, offsetof(struct CPU, memory));
+    /* shared ROM is read-only and has nothing to clear */
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        if (!(page_flags[page] & PAGE_SHARED))
+            memset(cpu->memory + page * MEM_PAGE_SIZE, 0, MEM_PAGE_SIZE);
+    cpu->breakpoints = breakpoints;
+    cpu->jit = jit;
+    cpu->bus = bus;
+    cpu->map = map;
+    cpu->base = base;
+    cpu->trace = trace;
+    cpu->profile = profile;
+    cpu->lockstep = lockstep;
+    memcpy(cpu->page_flags, page_flags, sizeof(page_flags));
+    for (unsigned page = 0; map && page < MEM_PAGES; ++page)
+        load_page(cpu, page);
+    cpu_invalidate(cpu);
+}
+
+/* Forget everything compiled so far; needed after writing to
+ * cpu->memory directly rather than through write_byte(). No page is taken
+ * to match the last snapshot any more either. */
+void cpu_invalidate(struct CPU *cpu)
+{
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        cpu->page_flags[page] &= ~PAGE_CLEAN;
+    if (cpu->jit)
+        jit_flush(cpu->jit);
+}
+
+/* Device pages; with nothing behind them reads float high */
+static uint8_t read_io(struct CPU *cpu, uint16_t addr)
+{
+    unsigned page = addr >> MEM_PAGE_SHIFT;
+    if (!cpu->map->read[page])
+        return 0xFF;
+    return cpu->map->read[page](cpu->map->device[page], addr);
+}
+
+/* Writes to pages with flags: devices take them, ROM drops them and a page
+ * that matched the last snapshot no longer does. Returns whether the write
+ * still goes to cpu->memory. */
+static bool write_flagged(struct CPU *cpu, uint16_t addr, uint8_t value)
+{
+    unsigned page = addr >> MEM_PAGE_SHIFT;
+    if (cpu->page_flags[page] & PAGE_IO) {
+        if (cpu->map->write[page])
+            cpu->map->write[page](cpu->map->device[page], addr, value);
+        return false;
+    }
+    if (cpu->page_flags[page] & PAGE_ROM)
+        return false;
+    cpu->page_flags[page] &= ~PAGE_CLEAN;
+    return true;
+}
 
 /* Read a byte from memory */
-uint8_t read_byte(uint16_t addr)
+uint8_t read_byte(struct CPU *cpu, uint16_t addr)
 {
-    return memory[addr];
+    if (cpu->page_flags[addr >> MEM_PAGE_SHIFT] & PAGE_IO)
+        return read_io(cpu, addr);
+    return cpu->memory[addr];
 }
 
-void write_byte(uint16_t addr, uint8_t value)
+void write_byte(struct CPU *cpu, uint16_t addr, uint8_t value)
 {
-    memory[addr] = value;
+#ifdef EMU8080_TRACE
+    if (cpu->trace)
+        trace_write(cpu->trace, addr, value);
+#endif
+#ifdef EMU8080_LOCKSTEP
+    if (cpu->lockstep)
+        lockstep_write(cpu->lockstep, cpu->instructions, addr, value);
+#endif
+    if (cpu->page_flags[addr >> MEM_PAGE_SHIFT] && !write_flagged(cpu, addr, value))
+        return;
+    cpu->memory[addr] = value;
+#ifdef EMU8080_JIT
+    if (cpu->jit && jit_is_code(cpu->jit, addr))
+        jit_invalidate(cpu->jit, addr);
+#endif
 }
 
-uint8_t read_next_byte()
+/* Instructions are fetched straight from cpu->memory, which holds a copy of
+ * whatever is mapped there */
+uint8_t read_next_byte(struct CPU *cpu)
 {
-    return read_byte(regs.pc++);
+    return cpu->memory[cpu->regs.pc++];
 }
 
 uint16_t merge_bytes(uint8_t lo_byte, uint8_t hi_byte)
@@ -45,1002 +244,2062 @@ uint16_t merge_bytes(uint8_t lo_byte, uint8_t hi_byte)
     return (uint16_t) ((hi_byte << 8) | lo_byte);
 }
 
-static inline void test_pzs(uint8_t res)
+/* Sign, zero, parity and aux carry are either kept as bools and updated by
+ * every ALU instruction, or, with lazy flags, worked out from the last
+ * result only when something reads them. cpu->regs.zsp holds that result in
+ * its low byte; POP PSW can set combinations no single byte produces, so
+ * bit 8 inverts parity and bit 15 sets sign. Aux carry is bit 4 of aux.
+ * With packed flags all of them live in cpu->regs.f, laid out as PUSH PSW
+ * stores them, and the tables in alu.h give the flags of a result. */
+#if defined(EMU8080_PACKED_FLAGS) && defined(EMU8080_LAZY_FLAGS)
+#error "EMU8080_PACKED_FLAGS and EMU8080_LAZY_FLAGS are exclusive"
+#endif
+
+#define PSW_C  0x01
+#define PSW_P  0x04
+#define PSW_AC 0x10
+#define PSW_Z  0x40
+#define PSW_S  0x80
+
+#if defined(EMU8080_PACKED_FLAGS)
+#define FLAG_CY() (cpu->regs.f & PSW_C)
+#define FLAG_Z() ((cpu->regs.f & PSW_Z) != 0)
+#define FLAG_S() ((cpu->regs.f & PSW_S) != 0)
+#define FLAG_P() ((cpu->regs.f & PSW_P) != 0)
+#define FLAG_AC() ((cpu->regs.f & PSW_AC) != 0)
+#define SET_CY(v) (cpu->regs.f = (cpu->regs.f & ~PSW_C) | ((v) ? PSW_C : 0))
+#define SET_ZSP(res) (cpu->regs.f = (cpu->regs.f & ~(PSW_S | PSW_Z | PSW_P)) | szpc_table[(uint8_t) (res)])
+#define SET_AC(bits) (cpu->regs.f = (cpu->regs.f & ~PSW_AC) | ((bits) & PSW_AC))
+#elif defined(EMU8080_LAZY_FLAGS)
+#define FLAG_CY() cpu->regs.cf
+#define FLAG_Z() ((uint8_t) cpu->regs.zsp == 0)
+#define FLAG_S() ((cpu->regs.zsp & 0x8080) != 0)
+#define FLAG_P() (parity_table[cpu->regs.zsp & 0xFF] ^ ((cpu->regs.zsp >> 8) & 1))
+#define FLAG_AC() ((cpu->regs.aux & 0x10) != 0)
+#define SET_CY(v) (cpu->regs.cf = (v))
+#define SET_ZSP(res) (cpu->regs.zsp = (uint8_t) (res))
+#define SET_AC(bits) (cpu->regs.aux = (uint8_t) (bits))
+#else
+#define FLAG_CY() cpu->regs.cf
+#define FLAG_Z() cpu->regs.zf
+#define FLAG_S() cpu->regs.sf
+#define FLAG_P() cpu->regs.pf
+#define FLAG_AC() cpu->regs.acf
+#define SET_CY(v) (cpu->regs.cf = (v))
+#define SET_ZSP(res) test_pzs(cpu, (res))
+#define SET_AC(bits) (cpu->regs.acf = (bits) & 0x10)
+
+static inline void test_pzs(struct CPU *cpu, uint8_t res)
 {
-    regs.pf = parity_table[res];
-    regs.zf = (res == 0);
-    regs.sf = (res & (0x80));
+    cpu->regs.pf = parity_table[res];
+    cpu->regs.zf = (res == 0);
+    cpu->regs.sf = (res & (0x80));
 }
+#endif
+
+/* The carry out of bit 3, from the result and both operands */
+#define TEST_AC(res, op1, op2) SET_AC((res) ^ (op1) ^ (op2))
 
-static inline void test_ac(uint8_t res, uint8_t op1, uint8_t op2)
+/* The flag byte as PUSH PSW stores it */
+static inline uint8_t get_psw(struct CPU *cpu)
 {
-    regs.acf = (res ^ op1 ^ op2) & 0x10;
+#ifdef EMU8080_PACKED_FLAGS
+    return cpu->regs.f | 0x02;
+#else
+    return 0x02 | FLAG_CY() | FLAG_P() << 2 | FLAG_AC() << 4 |
+           FLAG_Z() << 6 | FLAG_S() << 7;
+#endif
 }
 
-#define R16() do {                              \
-    lo_byte = read_next_byte();                 \
-    hi_byte = read_next_byte();                 \
-    address = merge_bytes(lo_byte, hi_byte);    \
-} while(0)
+static inline void set_psw(struct CPU *cpu, uint8_t psw)
+{
+#if defined(EMU8080_PACKED_FLAGS)
+    cpu->regs.f = psw & (PSW_S | PSW_Z | PSW_AC | PSW_P | PSW_C);
+#elif defined(EMU8080_LAZY_FLAGS)
+    cpu->regs.cf = psw & PSW_C;
+    uint16_t zsp = (psw & PSW_Z) ? (psw & PSW_S) << 8 : (psw & PSW_S) | 1;
+    if (parity_table[zsp & 0xFF] != !!(psw & PSW_P))
+        zsp |= 0x100;
+    cpu->regs.zsp = zsp;
+    cpu->regs.aux = psw & PSW_AC;
+#else
+    cpu->regs.cf = psw & PSW_C;
+    cpu->regs.pf = psw & PSW_P;
+    cpu->regs.acf = psw & PSW_AC;
+    cpu->regs.zf = psw & PSW_Z;
+    cpu->regs.sf = psw & PSW_S;
+#endif
+}
 
-#define EM_INR(rg) do {                         \
-    ++(rg);                                     \
-    test_pzs((rg));                             \
-    test_ac((rg), (rg) - 1, 0x01);              \
-} while(0)
+uint8_t cpu_get_psw(struct CPU *cpu)
+{
+    return get_psw(cpu);
+}
 
-#define EM_DCR(rg) do {                         \
-    tmp = (rg) - 1;                             \
-    test_pzs(tmp);                              \
-    test_ac(tmp, (rg), ~0x01);                  \
-    (rg) = tmp;                                 \
+void cpu_set_psw(struct CPU *cpu, uint8_t psw)
+{
+    set_psw(cpu, psw);
+}
+
+/* Operands come straight from the instruction stream */
+#define IMM8() read_next_byte(cpu)
+#define R16() do {                              \
+    lo_byte = read_next_byte(cpu);              \
+    hi_byte = read_next_byte(cpu);              \
+    address = merge_bytes(lo_byte, hi_byte);    \
 } while(0)
 
 #define EM_DAD(rg) do {                         \
-    uint32_t tmp32 = regs.hl + (rg);            \
-    regs.hl = (uint16_t) tmp32;                 \
-    regs.cf = tmp32 & 0x10000;                  \
+    uint32_t tmp32 = cpu->regs.hl + (rg);       \
+    cpu->regs.hl = (uint16_t) tmp32;            \
+    SET_CY(tmp32 & 0x10000);                    \
 } while(0)
 
-#define EM_POP(regl, regh) do {                 \
-    regl = read_byte(regs.sp);                  \
-    regh = read_byte(regs.sp + 1);              \
-    regs.sp += 2;                               \
+#define EM_POP(reg) do {                        \
+    lo_byte = read_byte(cpu, cpu->regs.sp);     \
+    hi_byte = read_byte(cpu, cpu->regs.sp + 1); \
+    cpu->regs.sp += 2;                          \
+    reg = merge_bytes(lo_byte, hi_byte);        \
 } while(0)
 
-#define EM_PUSH(regl, regh) do { \
-    write_byte(regs.sp - 1, regh);              \
-    write_byte(regs.sp - 2, regl);              \
-    regs.sp -= 2;                               \
+#define EM_PUSH(regl, regh) do {                \
+    write_byte(cpu, cpu->regs.sp - 1, regh);    \
+    write_byte(cpu, cpu->regs.sp - 2, regl);    \
+    cpu->regs.sp -= 2;                          \
 } while(0)
 
 #define EM_RET(bl) do {                         \
-    if (bl) EM_POP(regs.pcl, regs.pch);         \
+    if (bl) {                                   \
+        EM_POP(cpu->regs.pc);   \
+        cpu->cycles += COND_TAKEN_CYCLES;       \
+    }                                           \
 } while(0)
 
 #define EM_JUMP(bl) do {                        \
     R16();                                      \
     if (bl) {                                   \
-        regs.pc = address;                      \
+        cpu->regs.pc = address;                 \
     }                                           \
 } while (0)
 
 #define EM_CALL(bl) do {                        \
     R16();                                      \
     if (bl) {                                   \
-        EM_PUSH(regs.pcl, regs.pch);            \
-        regs.pc = address;                      \
+        EM_PUSH(cpu->regs.pcl, cpu->regs.pch);  \
+        cpu->regs.pc = address;                 \
+        cpu->cycles += COND_TAKEN_CYCLES;       \
     }                                           \
 } while(0)
 
 #define EM_RST(val) do {                        \
-    EM_PUSH(regs.pcl, regs.pch);                \
-    regs.pc = 8 * (val);                        \
+    EM_PUSH(cpu->regs.pcl, cpu->regs.pch);      \
+    cpu->regs.pc = 8 * (val);                   \
+} while(0)
+
+#ifdef EMU8080_PACKED_FLAGS
+/* Each of these sets all its flags with one table load. szpc_table is
+ * indexed by the 9-bit result, where a borrow shows up in bit 8 just like
+ * a carry, and aux carry is bit 4 of the result xor both operands. */
+#define EM_INR(rg) do {                         \
+    ++(rg);                                     \
+    cpu->regs.f = (cpu->regs.f & PSW_C) | inr_table[(uint8_t) (rg)]; \
+} while(0)
+
+#define EM_DCR(rg) do {                         \
+    tmp = (uint8_t) ((rg) - 1);                 \
+    cpu->regs.f = (cpu->regs.f & PSW_C) | dcr_table[tmp]; \
+    (rg) = tmp;                                 \
+} while(0)
+
+#define EM_ADD(val, cy) do {                    \
+    tmp = cpu->regs.a + (val) + (cy);           \
+    cpu->regs.f = szpc_table[tmp] | ((cpu->regs.a ^ (val) ^ tmp) & PSW_AC); \
+    cpu->regs.a = (uint8_t) tmp;                \
+} while(0)
+
+#define EM_SUB(val, cy) do {                    \
+    tmp = cpu->regs.a - (val) - (cy);           \
+    cpu->regs.f = szpc_table[tmp & 0x1FF] | (~(cpu->regs.a ^ (val) ^ tmp) & PSW_AC); \
+    cpu->regs.a = (uint8_t) tmp;                \
+} while(0)
+
+#define EM_CMP(val) do {                        \
+    tmp = cpu->regs.a - (val);                  \
+    cpu->regs.f = szpc_table[tmp & 0x1FF] | (~(cpu->regs.a ^ (val) ^ tmp) & PSW_AC); \
+} while(0)
+
+#define EM_ANA(val) do {                        \
+    uint8_t aux = ((cpu->regs.a | (val)) & 0x08) << 1; \
+    cpu->regs.a &= (val);                       \
+    cpu->regs.f = szpc_table[cpu->regs.a] | aux; \
+} while(0)
+
+#define EM_XRA(val) do {                        \
+    cpu->regs.a ^= (val);                       \
+    cpu->regs.f = szpc_table[cpu->regs.a];      \
+} while(0)
+
+#define EM_ORA(val) do {                        \
+    cpu->regs.a |= (val);                       \
+    cpu->regs.f = szpc_table[cpu->regs.a];      \
+} while(0)
+#else
+#define EM_INR(rg) do {                         \
+    ++(rg);                                     \
+    SET_ZSP(rg);                                \
+    TEST_AC((rg), (rg) - 1, 0x01);              \
+} while(0)
+
+#define EM_DCR(rg) do {                         \
+    tmp = (rg) - 1;                             \
+    SET_ZSP(tmp);                               \
+    TEST_AC(tmp, (rg), ~0x01);                  \
+    (rg) = tmp;                                 \
 } while(0)
 
 #define EM_ADD(val, cy) do {                    \
-    tmp = regs.a + (val) + (cy);                \
-    test_pzs(tmp);                              \
-    test_ac(tmp, regs.a, (val));                \
-    regs.cf = tmp & 0x100;                      \
-    regs.a = (uint8_t) tmp;                     \
+    tmp = cpu->regs.a + (val) + (cy);           \
+    SET_ZSP(tmp);                               \
+    TEST_AC(tmp, cpu->regs.a, (val));           \
+    SET_CY(tmp & 0x100);                        \
+    cpu->regs.a = (uint8_t) tmp;                \
 } while(0)
 
 /* This is just two's complement:
  * val is complemented, cy is the add bit */
 #define EM_SUB(val, cy) do {                    \
     EM_ADD(~(val) & 0xFF, !(cy));               \
-    regs.cf = !regs.cf;                         \
+    SET_CY(!FLAG_CY());                         \
 } while(0)
 
 #define EM_CMP(val) do {                        \
-    tmp = regs.a - (val);                       \
-    test_pzs(tmp);                              \
-    test_ac(tmp, regs.a, ~(val));               \
-    regs.cf = tmp & 0x100;                      \
+    tmp = cpu->regs.a - (val);                  \
+    SET_ZSP(tmp);                               \
+    TEST_AC(tmp, cpu->regs.a, ~(val));          \
+    SET_CY(tmp & 0x100);                        \
 } while(0)
 
-#define EM_ANA(val) do { \
-    regs.cf = 0;                                \
-    regs.acf = ((regs.a | (val)) & 0x08);       \
-    regs.a &= (val);                            \
-    test_pzs(regs.a);                           \
+#define EM_ANA(val) do {                        \
+    SET_CY(0);                                  \
+    SET_AC(((cpu->regs.a | (val)) & 0x08) << 1); \
+    cpu->regs.a &= (val);                       \
+    SET_ZSP(cpu->regs.a);                       \
 } while(0)
 
 #define EM_XRA(val) do {                        \
-    regs.a ^= (val);                            \
-    regs.cf = 0;                                \
-    regs.acf = 0;                               \
-    test_pzs(regs.a);                           \
+    cpu->regs.a ^= (val);                       \
+    SET_CY(0);                                  \
+    SET_AC(0);                                  \
+    SET_ZSP(cpu->regs.a);                       \
 } while(0)
 
 #define EM_ORA(val) do {                        \
-    regs.a |= (val);                            \
-    regs.cf = 0;                                \
-    regs.acf = 0;                               \
-    test_pzs(regs.a);                           \
+    cpu->regs.a |= (val);                       \
+    SET_CY(0);                                  \
+    SET_AC(0);                                  \
+    SET_ZSP(cpu->regs.a);                       \
+} while(0)
+#endif
+
+/* IN through the bus; false if no device reads port */
+static inline bool port_in(struct CPU *cpu, uint8_t port)
+{
+    struct Port *p = &cpu->bus->ports[port];
+    if (!p->read)
+        return false;
+    if (cpu->bus->npending)
+        cpu_flush_ports(cpu);
+    cpu->regs.a = p->read(p->device, port);
+    return true;
+}
+
+/* OUT through the bus; false if no device takes port */
+static inline bool port_out(struct CPU *cpu, uint8_t port, uint8_t value)
+{
+    struct Bus *bus = cpu->bus;
+    struct Port *p = &bus->ports[port];
+    if (p->buffer) {
+        if (!p->len)
+            bus->pending[bus->npending++] = port;
+        p->buffer[p->len++] = value;
+        if (p->len == PORT_BUFFER)
+            cpu_flush_ports(cpu);
+        return true;
+    }
+    if (!p->write)
+        return false;
+    if (bus->npending)
+        cpu_flush_ports(cpu);
+    p->write(p->device, port, value);
+    return true;
+}
+
+static inline bool at_breakpoint(struct CPU *cpu)
+{
+    return cpu->breakpoints[cpu->regs.pc >> 3] & (1 << (cpu->regs.pc & 7));
+}
+
+static inline bool interrupt_ready(const struct CPU *cpu)
+{
+    return cpu->interrupt_pending && cpu->interrupt_enabled;
+}
+
+/* A device handler may have raised an interrupt; end the slice early so
+ * run() takes it before the next instruction */
+#define POLL_INTERRUPT() do {                   \
+    if (interrupt_ready(cpu))                   \
+        end = cpu->cycles;                      \
 } while(0)
 
+#ifdef EMU8080_LOCKSTEP
+/* A machine run in lockstep notes the state a device is handed and the
+ * state it leaves, so the reference core can take over what it did */
+static __attribute__((noinline)) void lockstep_note_io(struct CPU *cpu, bool done)
+{
+    struct LockstepState state;
+    lockstep_save(cpu, get_psw(cpu), &state);
+    lockstep_io(cpu->lockstep, &state, done);
+}
+
+#define LOCKSTEP_IO(done) do {                  \
+    if (cpu->lockstep)                          \
+        lockstep_note_io(cpu, (done));          \
+} while(0)
+#else
+#define LOCKSTEP_IO(done) do { } while(0)
+#endif
+
+#ifdef EMU8080_TRACE
+#define TRACED(cpu) ((cpu)->trace != NULL)
+#else
+#define TRACED(cpu) false
+#endif
+#ifdef EMU8080_PROFILE
+#define PROFILED(cpu) ((cpu)->profile != NULL)
+#else
+#define PROFILED(cpu) false
+#endif
+
+#if defined(EMU8080_TRACE) || defined(EMU8080_PROFILE)
+/* Kept out of line so that handlers stay small while nothing is watched */
+static __attribute__((noinline)) void observe(struct CPU *cpu, uint16_t pc, uint8_t opcode)
+{
+#ifdef EMU8080_TRACE
+    if (cpu->trace)
+        trace_step(cpu->trace, pc, opcode, 1 + operand_bytes[opcode], get_psw(cpu));
+#endif
+#ifdef EMU8080_PROFILE
+    if (cpu->profile)
+        profile_step(cpu->profile, pc, opcode);
+#endif
+}
+
+/* Called before each instruction runs */
+#define OBSERVE(pc, op) do {                    \
+    if (TRACED(cpu) || PROFILED(cpu))           \
+        observe(cpu, (pc), (op));               \
+} while(0)
+#else
+#define OBSERVE(pc, op) do { } while(0)
+#endif
+
+/* Stop if the last instruction ended the slice, otherwise fetch the next one */
+#define FETCH() do {                            \
+    if (cpu->regs.pc == 0)                      \
+        return EXIT_RST;                        \
+    if (cpu->cycles >= end)                     \
+        return EXIT_BUDGET;                     \
+    if (cpu->breakpoints && at_breakpoint(cpu)) \
+        return EXIT_BREAK;                      \
+    OBSERVE(cpu->regs.pc, cpu->memory[cpu->regs.pc]); \
+    opcode = read_next_byte(cpu);               \
+    cpu->cycles += cycle_table[opcode];         \
+    ++cpu->instructions;                        \
+} while(0)
+
+/* With labels as values every handler ends in its own indirect jump, which
+ * the branch predictor can track per opcode. The switch is the portable
+ * fallback, where all opcodes share the one jump. */
+#if defined(EMU8080_THREADED) && defined(__GNUC__)
+#define DISPATCH(op) goto *dispatch_table[op];
+#define CASE(op) op_##op
+#define NEXT do {                               \
+    FETCH();                                    \
+    goto *dispatch_table[opcode];               \
+} while(0)
+#else
+#define DISPATCH(op) switch (op)
+#define CASE(op) case op
+#define NEXT break
+#endif
+
+/* Traced and profiled machines are only interpreted, so every instruction
+ * is seen */
+#define JIT_ON(cpu) ((cpu)->jit && !TRACED(cpu) && !PROFILED(cpu))
+
+/* Control transfers end the interpreter's turn when the JIT is on, so it
+ * can look for compiled code at the new pc */
+#ifdef EMU8080_JIT
+#define NEXT_BRANCH                             \
+    if (JIT_ON(cpu) && jit_wants(cpu->jit, cpu->regs.pc)) \
+        return cpu->regs.pc ? EXIT_BRANCH : EXIT_RST; \
+    else                                        \
+        NEXT
+#else
+#define NEXT_BRANCH NEXT
+#endif
 
-int instruction(enum OpCode opcode)
+/* The interpreter loop. Executes opcode, which has already been fetched,
+ * and then keeps fetching and executing until the machine stops or
+ * cpu->cycles reaches end. Breakpoints are only checked after the first
+ * instruction, so resuming from a breakpoint makes progress. */
+static int execute(struct CPU *cpu, enum OpCode opcode, uint64_t end)
 {
     uint8_t lo_byte, hi_byte, res;
     uint16_t address, tmp;
+    OBSERVE((uint16_t) (cpu->regs.pc - 1), opcode);
+#if defined(EMU8080_THREADED) && defined(__GNUC__)
+    static const void *const dispatch_table[256] = {
+        [NOP     ] = &&op_NOP,
+        [LXI_B   ] = &&op_LXI_B,
+        [STAX_B  ] = &&op_STAX_B,
+        [INX_B   ] = &&op_INX_B,
+        [INR_B   ] = &&op_INR_B,
+        [DCR_B   ] = &&op_DCR_B,
+        [MVI_B   ] = &&op_MVI_B,
+        [RLC     ] = &&op_RLC,
+        [DSUB    ] = &&op_DSUB,
+        [DAD_B   ] = &&op_DAD_B,
+        [LDAX_B  ] = &&op_LDAX_B,
+        [DCX_B   ] = &&op_DCX_B,
+        [INR_C   ] = &&op_INR_C,
+        [DCR_C   ] = &&op_DCR_C,
+        [MVI_C   ] = &&op_MVI_C,
+        [RRC     ] = &&op_RRC,
+        [AHRL    ] = &&op_AHRL,
+        [LXI_D   ] = &&op_LXI_D,
+        [STAX_D  ] = &&op_STAX_D,
+        [INX_D   ] = &&op_INX_D,
+        [INR_D   ] = &&op_INR_D,
+        [DCR_D   ] = &&op_DCR_D,
+        [MVI_D   ] = &&op_MVI_D,
+        [RAL     ] = &&op_RAL,
+        [RDEL    ] = &&op_RDEL,
+        [DAD_D   ] = &&op_DAD_D,
+        [LDAX_D  ] = &&op_LDAX_D,
+        [DCX_D   ] = &&op_DCX_D,
+        [INR_E   ] = &&op_INR_E,
+        [DCR_E   ] = &&op_DCR_E,
+        [MVI_E   ] = &&op_MVI_E,
+        [RAR     ] = &&op_RAR,
+        [RIM     ] = &&op_RIM,
+        [LXI_H   ] = &&op_LXI_H,
+        [SHLD    ] = &&op_SHLD,
+        [INX_H   ] = &&op_INX_H,
+        [INR_H   ] = &&op_INR_H,
+        [DCR_H   ] = &&op_DCR_H,
+        [MVI_H   ] = &&op_MVI_H,
+        [DAA     ] = &&op_DAA,
+        [LDHI    ] = &&op_LDHI,
+        [DAD_H   ] = &&op_DAD_H,
+        [LHLD    ] = &&op_LHLD,
+        [DCX_H   ] = &&op_DCX_H,
+        [INR_L   ] = &&op_INR_L,
+        [DCR_L   ] = &&op_DCR_L,
+        [MVI_L   ] = &&op_MVI_L,
+        [CMA     ] = &&op_CMA,
+        [SIM     ] = &&op_SIM,
+        [LXI_SP  ] = &&op_LXI_SP,
+        [STA     ] = &&op_STA,
+        [INX_SP  ] = &&op_INX_SP,
+        [INR_M   ] = &&op_INR_M,
+        [DCR_M   ] = &&op_DCR_M,
+        [MVI_M   ] = &&op_MVI_M,
+        [STC     ] = &&op_STC,
+        [LDSI    ] = &&op_LDSI,
+        [DAD_SP  ] = &&op_DAD_SP,
+        [LDA     ] = &&op_LDA,
+        [DCX_SP  ] = &&op_DCX_SP,
+        [INR_A   ] = &&op_INR_A,
+        [DCR_A   ] = &&op_DCR_A,
+        [MVI_A   ] = &&op_MVI_A,
+        [CMC     ] = &&op_CMC,
+        [MOV_B_B ] = &&op_MOV_B_B,
+        [MOV_B_C ] = &&op_MOV_B_C,
+        [MOV_B_D ] = &&op_MOV_B_D,
+        [MOV_B_E ] = &&op_MOV_B_E,
+        [MOV_B_H ] = &&op_MOV_B_H,
+        [MOV_B_L ] = &&op_MOV_B_L,
+        [MOV_B_M ] = &&op_MOV_B_M,
+        [MOV_B_A ] = &&op_MOV_B_A,
+        [MOV_C_B ] = &&op_MOV_C_B,
+        [MOV_C_C ] = &&op_MOV_C_C,
+        [MOV_C_D ] = &&op_MOV_C_D,
+        [MOV_C_E ] = &&op_MOV_C_E,
+        [MOV_C_H ] = &&op_MOV_C_H,
+        [MOV_C_L ] = &&op_MOV_C_L,
+        [MOV_C_M ] = &&op_MOV_C_M,
+        [MOV_C_A ] = &&op_MOV_C_A,
+        [MOV_D_B ] = &&op_MOV_D_B,
+        [MOV_D_C ] = &&op_MOV_D_C,
+        [MOV_D_D ] = &&op_MOV_D_D,
+        [MOV_D_E ] = &&op_MOV_D_E,
+        [MOV_D_H ] = &&op_MOV_D_H,
+        [MOV_D_L ] = &&op_MOV_D_L,
+        [MOV_D_M ] = &&op_MOV_D_M,
+        [MOV_D_A ] = &&op_MOV_D_A,
+        [MOV_E_B ] = &&op_MOV_E_B,
+        [MOV_E_C ] = &&op_MOV_E_C,
+        [MOV_E_D ] = &&op_MOV_E_D,
+        [MOV_E_E ] = &&op_MOV_E_E,
+        [MOV_E_H ] = &&op_MOV_E_H,
+        [MOV_E_L ] = &&op_MOV_E_L,
+        [MOV_E_M ] = &&op_MOV_E_M,
+        [MOV_E_A ] = &&op_MOV_E_A,
+        [MOV_H_B ] = &&op_MOV_H_B,
+        [MOV_H_C ] = &&op_MOV_H_C,
+        [MOV_H_D ] = &&op_MOV_H_D,
+        [MOV_H_E ] = &&op_MOV_H_E,
+        [MOV_H_H ] = &&op_MOV_H_H,
+        [MOV_H_L ] = &&op_MOV_H_L,
+        [MOV_H_M ] = &&op_MOV_H_M,
+        [MOV_H_A ] = &&op_MOV_H_A,
+        [MOV_L_B ] = &&op_MOV_L_B,
+        [MOV_L_C ] = &&op_MOV_L_C,
+        [MOV_L_D ] = &&op_MOV_L_D,
+        [MOV_L_E ] = &&op_MOV_L_E,
+        [MOV_L_H ] = &&op_MOV_L_H,
+        [MOV_L_L ] = &&op_MOV_L_L,
+        [MOV_L_M ] = &&op_MOV_L_M,
+        [MOV_L_A ] = &&op_MOV_L_A,
+        [MOV_M_B ] = &&op_MOV_M_B,
+        [MOV_M_C ] = &&op_MOV_M_C,
+        [MOV_M_D ] = &&op_MOV_M_D,
+        [MOV_M_E ] = &&op_MOV_M_E,
+        [MOV_M_H ] = &&op_MOV_M_H,
+        [MOV_M_L ] = &&op_MOV_M_L,
+        [HLT     ] = &&op_HLT,
+        [MOV_M_A ] = &&op_MOV_M_A,
+        [MOV_A_B ] = &&op_MOV_A_B,
+        [MOV_A_C ] = &&op_MOV_A_C,
+        [MOV_A_D ] = &&op_MOV_A_D,
+        [MOV_A_E ] = &&op_MOV_A_E,
+        [MOV_A_H ] = &&op_MOV_A_H,
+        [MOV_A_L ] = &&op_MOV_A_L,
+        [MOV_A_M ] = &&op_MOV_A_M,
+        [MOV_A_A ] = &&op_MOV_A_A,
+        [ADD_B   ] = &&op_ADD_B,
+        [ADD_C   ] = &&op_ADD_C,
+        [ADD_D   ] = &&op_ADD_D,
+        [ADD_E   ] = &&op_ADD_E,
+        [ADD_H   ] = &&op_ADD_H,
+        [ADD_L   ] = &&op_ADD_L,
+        [ADD_M   ] = &&op_ADD_M,
+        [ADD_A   ] = &&op_ADD_A,
+        [ADC_B   ] = &&op_ADC_B,
+        [ADC_C   ] = &&op_ADC_C,
+        [ADC_D   ] = &&op_ADC_D,
+        [ADC_E   ] = &&op_ADC_E,
+        [ADC_H   ] = &&op_ADC_H,
+        [ADC_L   ] = &&op_ADC_L,
+        [ADC_M   ] = &&op_ADC_M,
+        [ADC_A   ] = &&op_ADC_A,
+        [SUB_B   ] = &&op_SUB_B,
+        [SUB_C   ] = &&op_SUB_C,
+        [SUB_D   ] = &&op_SUB_D,
+        [SUB_E   ] = &&op_SUB_E,
+        [SUB_H   ] = &&op_SUB_H,
+        [SUB_L   ] = &&op_SUB_L,
+        [SUB_M   ] = &&op_SUB_M,
+        [SUB_A   ] = &&op_SUB_A,
+        [SBB_B   ] = &&op_SBB_B,
+        [SBB_C   ] = &&op_SBB_C,
+        [SBB_D   ] = &&op_SBB_D,
+        [SBB_E   ] = &&op_SBB_E,
+        [SBB_H   ] = &&op_SBB_H,
+        [SBB_L   ] = &&op_SBB_L,
+        [SBB_M   ] = &&op_SBB_M,
+        [SBB_A   ] = &&op_SBB_A,
+        [ANA_B   ] = &&op_ANA_B,
+        [ANA_C   ] = &&op_ANA_C,
+        [ANA_D   ] = &&op_ANA_D,
+        [ANA_E   ] = &&op_ANA_E,
+        [ANA_H   ] = &&op_ANA_H,
+        [ANA_L   ] = &&op_ANA_L,
+        [ANA_M   ] = &&op_ANA_M,
+        [ANA_A   ] = &&op_ANA_A,
+        [XRA_B   ] = &&op_XRA_B,
+        [XRA_C   ] = &&op_XRA_C,
+        [XRA_D   ] = &&op_XRA_D,
+        [XRA_E   ] = &&op_XRA_E,
+        [XRA_H   ] = &&op_XRA_H,
+        [XRA_L   ] = &&op_XRA_L,
+        [XRA_M   ] = &&op_XRA_M,
+        [XRA_A   ] = &&op_XRA_A,
+        [ORA_B   ] = &&op_ORA_B,
+        [ORA_C   ] = &&op_ORA_C,
+        [ORA_D   ] = &&op_ORA_D,
+        [ORA_E   ] = &&op_ORA_E,
+        [ORA_H   ] = &&op_ORA_H,
+        [ORA_L   ] = &&op_ORA_L,
+        [ORA_M   ] = &&op_ORA_M,
+        [ORA_A   ] = &&op_ORA_A,
+        [CMP_B   ] = &&op_CMP_B,
+        [CMP_C   ] = &&op_CMP_C,
+        [CMP_D   ] = &&op_CMP_D,
+        [CMP_E   ] = &&op_CMP_E,
+        [CMP_H   ] = &&op_CMP_H,
+        [CMP_L   ] = &&op_CMP_L,
+        [CMP_M   ] = &&op_CMP_M,
+        [CMP_A   ] = &&op_CMP_A,
+        [RNZ     ] = &&op_RNZ,
+        [POP_B   ] = &&op_POP_B,
+        [JNZ     ] = &&op_JNZ,
+        [JMP     ] = &&op_JMP,
+        [CNZ     ] = &&op_CNZ,
+        [PUSH_B  ] = &&op_PUSH_B,
+        [ADI     ] = &&op_ADI,
+        [RST_0   ] = &&op_RST_0,
+        [RZ      ] = &&op_RZ,
+        [RET     ] = &&op_RET,
+        [JZ      ] = &&op_JZ,
+        [RSTV    ] = &&op_RSTV,
+        [CZ      ] = &&op_CZ,
+        [CALL    ] = &&op_CALL,
+        [ACI     ] = &&op_ACI,
+        [RST_1   ] = &&op_RST_1,
+        [RNC     ] = &&op_RNC,
+        [POP_D   ] = &&op_POP_D,
+        [JNC     ] = &&op_JNC,
+        [OUT     ] = &&op_OUT,
+        [CNC     ] = &&op_CNC,
+        [PUSH_D  ] = &&op_PUSH_D,
+        [SUI     ] = &&op_SUI,
+        [RST_2   ] = &&op_RST_2,
+        [RC      ] = &&op_RC,
+        [SHLX    ] = &&op_SHLX,
+        [JC      ] = &&op_JC,
+        [IN      ] = &&op_IN,
+        [CC      ] = &&op_CC,
+        [JNUI    ] = &&op_JNUI,
+        [SBI     ] = &&op_SBI,
+        [RST_3   ] = &&op_RST_3,
+        [RPO     ] = &&op_RPO,
+        [POP_H   ] = &&op_POP_H,
+        [JPO     ] = &&op_JPO,
+        [XTHL    ] = &&op_XTHL,
+        [CPO     ] = &&op_CPO,
+        [PUSH_H  ] = &&op_PUSH_H,
+        [ANI     ] = &&op_ANI,
+        [RST_4   ] = &&op_RST_4,
+        [RPE     ] = &&op_RPE,
+        [PCHL    ] = &&op_PCHL,
+        [JPE     ] = &&op_JPE,
+        [XCHG    ] = &&op_XCHG,
+        [CPE     ] = &&op_CPE,
+        [LHLX    ] = &&op_LHLX,
+        [XRI     ] = &&op_XRI,
+        [RST_5   ] = &&op_RST_5,
+        [RP      ] = &&op_RP,
+        [POP_PSW ] = &&op_POP_PSW,
+        [JP      ] = &&op_JP,
+        [DI      ] = &&op_DI,
+        [CP      ] = &&op_CP,
+        [PUSH_PSW] = &&op_PUSH_PSW,
+        [ORI     ] = &&op_ORI,
+        [RST_6   ] = &&op_RST_6,
+        [RM      ] = &&op_RM,
+        [SPHL    ] = &&op_SPHL,
+        [JM      ] = &&op_JM,
+        [EI      ] = &&op_EI,
+        [CM      ] = &&op_CM,
+        [JUI     ] = &&op_JUI,
+        [CPI     ] = &&op_CPI,
+        [RST_7   ] = &&op_RST_7,
+    };
+#endif
 
-    switch (opcode) {
-        case NOP:
+    cpu->cycles += cycle_table[opcode];
+    ++cpu->instructions;
+dispatch:
+    DISPATCH(opcode) {
+        CASE(NOP):
             /* do nothing */
-            break;
-        case LXI_B:
-            regs.c = read_next_byte();
-            regs.b = read_next_byte();
-            break;
-        case STAX_B:
-            write_byte(regs.bc, regs.a);
-            break;
-        case INX_B:
-            ++regs.bc;
-            break;
-        case INR_B:
-            EM_INR(regs.b);
-            break;
-        case DCR_B:
-            EM_DCR(regs.b);
-            break;
-        case MVI_B:
-            regs.b = read_next_byte();
-            break;
-        case RLC:
-            regs.a = (regs.a << 1) | (regs.a >> 7);
-            regs.cf = regs.a & 0x01; /* the rotated out bit, now the LSB, is copied into the carry */
-            break;
-        case DSUB:
+            NEXT;
+        CASE(LXI_B):
+            R16();
+            cpu->regs.bc = address;
+            NEXT;
+        CASE(STAX_B):
+            write_byte(cpu, cpu->regs.bc, cpu->regs.a);
+            NEXT;
+        CASE(INX_B):
+            ++cpu->regs.bc;
+            NEXT;
+        CASE(INR_B):
+            EM_INR(cpu->regs.b);
+            NEXT;
+        CASE(DCR_B):
+            EM_DCR(cpu->regs.b);
+            NEXT;
+        CASE(MVI_B):
+            cpu->regs.b = IMM8();
+            NEXT;
+        CASE(RLC):
+            cpu->regs.a = (cpu->regs.a << 1) | (cpu->regs.a >> 7);
+            SET_CY(cpu->regs.a & 0x01); /* the rotated out bit, now the LSB, is copied into the carry */
+            NEXT;
+        CASE(DSUB):
             /* not implemented in 8080 */
-            break;
-        case DAD_B:
-            EM_DAD(regs.bc);
-            break;
-        case LDAX_B:
-            regs.a = read_byte(regs.bc);
-            break;
-        case DCX_B:
-            --regs.bc;
-            break;
-        case INR_C:
-            EM_INR(regs.c);
-            break;
-        case DCR_C:
-            EM_DCR(regs.c);
-            break;
-        case MVI_C:
-            regs.c = read_next_byte();
-            break;
+            NEXT;
+        CASE(DAD_B):
+            EM_DAD(cpu->regs.bc);
+            NEXT;
+        CASE(LDAX_B):
+            cpu->regs.a = read_byte(cpu, cpu->regs.bc);
+            NEXT;
+        CASE(DCX_B):
+            --cpu->regs.bc;
+            NEXT;
+        CASE(INR_C):
+            EM_INR(cpu->regs.c);
+            NEXT;
+        CASE(DCR_C):
+            EM_DCR(cpu->regs.c);
+            NEXT;
+        CASE(MVI_C):
+            cpu->regs.c = IMM8();
+            NEXT;
 
-        case RRC:
-            regs.a = (regs.a >> 1) | (regs.a << 7);
-            regs.cf = regs.a & 0x80; /* the rotated out bit, now the MSB, is copied into the carry */
-            break;
-        case AHRL:
+        CASE(RRC):
+            cpu->regs.a = (cpu->regs.a >> 1) | (cpu->regs.a << 7);
+            SET_CY(cpu->regs.a & 0x80); /* the rotated out bit, now the MSB, is copied into the carry */
+            NEXT;
+        CASE(AHRL):
             /* not implemented in 8080 */
-            break;
-        case LXI_D:
-            regs.e = read_next_byte();
-            regs.d = read_next_byte();
-            break;
-        case STAX_D:
-            write_byte(regs.de, regs.a);
-            break;
-        case INX_D:
-            ++regs.de;
-            break;
-        case INR_D:
-            EM_INR(regs.d);
-            break;
-        case DCR_D:
-            EM_DCR(regs.d);
-            break;
-        case MVI_D:
-            regs.d = read_next_byte();
-            break;
-        case RAL: {
+            NEXT;
+        CASE(LXI_D):
+            R16();
+            cpu->regs.de = address;
+            NEXT;
+        CASE(STAX_D):
+            write_byte(cpu, cpu->regs.de, cpu->regs.a);
+            NEXT;
+        CASE(INX_D):
+            ++cpu->regs.de;
+            NEXT;
+        CASE(INR_D):
+            EM_INR(cpu->regs.d);
+            NEXT;
+        CASE(DCR_D):
+            EM_DCR(cpu->regs.d);
+            NEXT;
+        CASE(MVI_D):
+            cpu->regs.d = IMM8();
+            NEXT;
+        CASE(RAL): {
             /* we rotate left through the carry */
-            res = (regs.a << 1) | regs.cf;
-            regs.cf = regs.a & 0x80;
-            regs.a = res;
-            break;
+            res = (cpu->regs.a << 1) | FLAG_CY();
+            SET_CY(cpu->regs.a & 0x80);
+            cpu->regs.a = res;
+            NEXT;
         }
-        case RDEL:
+        CASE(RDEL):
             /* not implemented in 8080 */
-            break;
-        case DAD_D:
-            EM_DAD(regs.de);
-            break;
-        case LDAX_D:
-            regs.a = read_byte(regs.de);
-            break;
-        case DCX_D:
-            --regs.de;
-            break;
-        case INR_E:
-            EM_INR(regs.e);
-            break;
-        case DCR_E:
-            EM_DCR(regs.e);
-            break;
-        case MVI_E:
-            regs.e = read_next_byte();
-            break;
+            NEXT;
+        CASE(DAD_D):
+            EM_DAD(cpu->regs.de);
+            NEXT;
+        CASE(LDAX_D):
+            cpu->regs.a = read_byte(cpu, cpu->regs.de);
+            NEXT;
+        CASE(DCX_D):
+            --cpu->regs.de;
+            NEXT;
+        CASE(INR_E):
+            EM_INR(cpu->regs.e);
+            NEXT;
+        CASE(DCR_E):
+            EM_DCR(cpu->regs.e);
+            NEXT;
+        CASE(MVI_E):
+            cpu->regs.e = IMM8();
+            NEXT;
 
-        case RAR:
+        CASE(RAR):
             /* we rotate right through the carry */
-            res = (regs.a >> 1) | (regs.cf << 7);
-            regs.cf = (regs.a & 0x1);
-            regs.a = res;
-            break;
-        case RIM:
+            res = (cpu->regs.a >> 1) | (FLAG_CY() << 7);
+            SET_CY(cpu->regs.a & 0x1);
+            cpu->regs.a = res;
+            NEXT;
+        CASE(RIM):
             /* not implemented in 8080 */
-            break;
-        case LXI_H:
-            regs.l = read_next_byte();
-            regs.h = read_next_byte();
-            break;
-        case SHLD: {
+            NEXT;
+        CASE(LXI_H):
             R16();
-            write_byte(address, regs.l);
-            write_byte(address + 1, regs.h);
-            break;
+            cpu->regs.hl = address;
+            NEXT;
+        CASE(SHLD): {
+            R16();
+            write_byte(cpu, address, cpu->regs.l);
+            write_byte(cpu, address + 1, cpu->regs.h);
+            NEXT;
         }
-        case INX_H:
-            ++regs.hl;
-            break;
-        case INR_H:
-            EM_INR(regs.h);
-            break;
-        case DCR_H:
-            EM_DCR(regs.h);
-            break;
-        case MVI_H:
-            regs.h = read_next_byte();
-            break;
-        case DAA: {
-            uint8_t old_cf = regs.cf;
-            uint8_t hi_nib = regs.a >> 4;
-            uint8_t lo_nib = regs.a & 0x0F;
-            uint8_t add = 0;
-
-            if (lo_nib > 9 || regs.acf) {
-                add += 0x06;
-            }
-
-            if (hi_nib > 9 || old_cf || ((hi_nib >= 9) && lo_nib > 9)) {
-                add += 0x60;
-                old_cf = 1;
-            }
-            EM_ADD(add, 0);
-            regs.cf = old_cf;
-            break;
+        CASE(INX_H):
+            ++cpu->regs.hl;
+            NEXT;
+        CASE(INR_H):
+            EM_INR(cpu->regs.h);
+            NEXT;
+        CASE(DCR_H):
+            EM_DCR(cpu->regs.h);
+            NEXT;
+        CASE(MVI_H):
+            cpu->regs.h = IMM8();
+            NEXT;
+        CASE(DAA): {
+            uint16_t daa = daa_table[FLAG_CY() << 9 | FLAG_AC() << 8 | cpu->regs.a];
+            cpu->regs.a = (uint8_t) daa;
+            set_psw(cpu, daa >> 8);
+            NEXT;
         }
-        case LDHI:
+        CASE(LDHI):
             /* not implemented in 8080 */
-            break;
-        case DAD_H:
-            EM_DAD(regs.hl);
-            break;
-        case LHLD: {
+            NEXT;
+        CASE(DAD_H):
+            EM_DAD(cpu->regs.hl);
+            NEXT;
+        CASE(LHLD): {
             R16();
-            regs.l = read_byte(address);
-            regs.h = read_byte(address + 1);
-            break;
+            cpu->regs.l = read_byte(cpu, address);
+            cpu->regs.h = read_byte(cpu, address + 1);
+            NEXT;
         }
-        case DCX_H:
-            --regs.hl;
-            break;
-        case INR_L:
-            EM_INR(regs.l);
-            break;
-        case DCR_L:
-            EM_DCR(regs.l);
-            break;
-        case MVI_L:
-            regs.l = read_next_byte();
-            break;
-        case CMA:
-            regs.a = ~regs.a;
-            break;
-        case SIM:
+        CASE(DCX_H):
+            --cpu->regs.hl;
+            NEXT;
+        CASE(INR_L):
+            EM_INR(cpu->regs.l);
+            NEXT;
+        CASE(DCR_L):
+            EM_DCR(cpu->regs.l);
+            NEXT;
+        CASE(MVI_L):
+            cpu->regs.l = IMM8();
+            NEXT;
+        CASE(CMA):
+            cpu->regs.a = ~cpu->regs.a;
+            NEXT;
+        CASE(SIM):
             /* not implemented in 8080 */
-            break;
-        case LXI_SP:
-            regs.spl = read_next_byte();
-            regs.sph = read_next_byte();
-            break;
-        case STA:
+            NEXT;
+        CASE(LXI_SP):
             R16();
-            write_byte(address, regs.a);
-            break;
-        case INX_SP:
-            ++regs.sp;
-            break;
-        case INR_M:
-            res = read_byte(regs.hl) + 1;
-            write_byte(regs.hl, res);
-            test_pzs(res);
-            test_ac(res, res - 1, 0x1);
-            break;
-        case DCR_M:
-            res = read_byte(regs.hl) - 1;
-            write_byte(regs.hl, res);
-            test_pzs(res);
-            test_ac(res, res + 1, ~0x1);
-            break;
-        case MVI_M:
-            res = read_next_byte();
-            write_byte(regs.hl, res);
-            break;
-        case STC:
-            regs.cf = 1;
-            break;
-        case LDSI:
+            cpu->regs.sp = address;
+            NEXT;
+        CASE(STA):
+            R16();
+            write_byte(cpu, address, cpu->regs.a);
+            NEXT;
+        CASE(INX_SP):
+            ++cpu->regs.sp;
+            NEXT;
+        CASE(INR_M):
+            res = read_byte(cpu, cpu->regs.hl);
+            EM_INR(res);
+            write_byte(cpu, cpu->regs.hl, res);
+            NEXT;
+        CASE(DCR_M):
+            res = read_byte(cpu, cpu->regs.hl);
+            EM_DCR(res);
+            write_byte(cpu, cpu->regs.hl, res);
+            NEXT;
+        CASE(MVI_M):
+            res = IMM8();
+            write_byte(cpu, cpu->regs.hl, res);
+            NEXT;
+        CASE(STC):
+            SET_CY(1);
+            NEXT;
+        CASE(LDSI):
             /* not implemented in 8080 */
-            break;
-        case DAD_SP:
-            EM_DAD(regs.sp);
-            break;
-        case LDA:
+            NEXT;
+        CASE(DAD_SP):
+            EM_DAD(cpu->regs.sp);
+            NEXT;
+        CASE(LDA):
             R16();
-            regs.a = read_byte(address);
-            break;
-        case DCX_SP:
-            --regs.sp;
-            break;
-        case INR_A:
-            EM_INR(regs.a);
-            break;
-        case DCR_A:
-            EM_DCR(regs.a);
-            break;
-        case MVI_A:
-            regs.a = read_next_byte();
-            break;
+            cpu->regs.a = read_byte(cpu, address);
+            NEXT;
+        CASE(DCX_SP):
+            --cpu->regs.sp;
+            NEXT;
+        CASE(INR_A):
+            EM_INR(cpu->regs.a);
+            NEXT;
+        CASE(DCR_A):
+            EM_DCR(cpu->regs.a);
+            NEXT;
+        CASE(MVI_A):
+            cpu->regs.a = IMM8();
+            NEXT;
 
-        case CMC:
-            regs.cf = !regs.cf;
-            break;
-        case MOV_B_B:
-            regs.b = regs.b;
-            break;
-        case MOV_B_C:
-            regs.b = regs.c;
-            break;
-        case MOV_B_D:
-            regs.b = regs.d;
-            break;
-        case MOV_B_E:
-            regs.b = regs.e;
-            break;
-        case MOV_B_H:
-            regs.b = regs.h;
-            break;
-        case MOV_B_L:
-            regs.b = regs.l;
-            break;
-        case MOV_B_M:
-            address = merge_bytes(regs.l, regs.h);
-            regs.b = read_byte(address);
-            break;
-        case MOV_B_A:
-            regs.b = regs.a;
-            break;
-        case MOV_C_B:
-            regs.c = regs.b;
-            break;
-        case MOV_C_C:
-            regs.c = regs.c;
-            break;
-        case MOV_C_D:
-            regs.c = regs.d;
-            break;
-        case MOV_C_E:
-            regs.c = regs.e;
-            break;
-        case MOV_C_H:
-            regs.c = regs.h;
-            break;
-        case MOV_C_L:
-            regs.c = regs.l;
-            break;
-        case MOV_C_M:
-            regs.c = read_byte(regs.hl);
-            break;
+        CASE(CMC):
+            SET_CY(!FLAG_CY());
+            NEXT;
+        CASE(MOV_B_B):
+            cpu->regs.b = cpu->regs.b;
+            NEXT;
+        CASE(MOV_B_C):
+            cpu->regs.b = cpu->regs.c;
+            NEXT;
+        CASE(MOV_B_D):
+            cpu->regs.b = cpu->regs.d;
+            NEXT;
+        CASE(MOV_B_E):
+            cpu->regs.b = cpu->regs.e;
+            NEXT;
+        CASE(MOV_B_H):
+            cpu->regs.b = cpu->regs.h;
+            NEXT;
+        CASE(MOV_B_L):
+            cpu->regs.b = cpu->regs.l;
+            NEXT;
+        CASE(MOV_B_M):
+            address = merge_bytes(cpu->regs.l, cpu->regs.h);
+            cpu->regs.b = read_byte(cpu, address);
+            NEXT;
+        CASE(MOV_B_A):
+            cpu->regs.b = cpu->regs.a;
+            NEXT;
+        CASE(MOV_C_B):
+            cpu->regs.c = cpu->regs.b;
+            NEXT;
+        CASE(MOV_C_C):
+            cpu->regs.c = cpu->regs.c;
+            NEXT;
+        CASE(MOV_C_D):
+            cpu->regs.c = cpu->regs.d;
+            NEXT;
+        CASE(MOV_C_E):
+            cpu->regs.c = cpu->regs.e;
+            NEXT;
+        CASE(MOV_C_H):
+            cpu->regs.c = cpu->regs.h;
+            NEXT;
+        CASE(MOV_C_L):
+            cpu->regs.c = cpu->regs.l;
+            NEXT;
+        CASE(MOV_C_M):
+            cpu->regs.c = read_byte(cpu, cpu->regs.hl);
+            NEXT;
 
 
-        case MOV_C_A:
-            regs.c = regs.a;
-            break;
-        case MOV_D_B:
-            regs.d = regs.b;
-            break;
-        case MOV_D_C:
-            regs.d = regs.c;
-            break;
-        case MOV_D_D:
-            regs.d = regs.d;
-            break;
-        case MOV_D_E:
-            regs.d = regs.e;
-            break;
-        case MOV_D_H:
-            regs.d = regs.h;
-            break;
-        case MOV_D_L:
-            regs.d = regs.l;
-            break;
-        case MOV_D_M:
-            regs.d = read_byte(regs.hl);
-            break;
-        case MOV_D_A:
-            regs.d = regs.a;
-            break;
-        case MOV_E_B:
-            regs.e = regs.b;
-            break;
-        case MOV_E_C:
-            regs.e = regs.c;
-            break;
-        case MOV_E_D:
-            regs.e = regs.d;
-            break;
-        case MOV_E_E:
-            regs.e = regs.e;
-            break;
-        case MOV_E_H:
-            regs.e = regs.h;
-            break;
-        case MOV_E_L:
-            regs.e = regs.l;
-            break;
-        case MOV_E_M:
-            regs.e = read_byte(regs.hl);
-            break;
+        CASE(MOV_C_A):
+            cpu->regs.c = cpu->regs.a;
+            NEXT;
+        CASE(MOV_D_B):
+            cpu->regs.d = cpu->regs.b;
+            NEXT;
+        CASE(MOV_D_C):
+            cpu->regs.d = cpu->regs.c;
+            NEXT;
+        CASE(MOV_D_D):
+            cpu->regs.d = cpu->regs.d;
+            NEXT;
+        CASE(MOV_D_E):
+            cpu->regs.d = cpu->regs.e;
+            NEXT;
+        CASE(MOV_D_H):
+            cpu->regs.d = cpu->regs.h;
+            NEXT;
+        CASE(MOV_D_L):
+            cpu->regs.d = cpu->regs.l;
+            NEXT;
+        CASE(MOV_D_M):
+            cpu->regs.d = read_byte(cpu, cpu->regs.hl);
+            NEXT;
+        CASE(MOV_D_A):
+            cpu->regs.d = cpu->regs.a;
+            NEXT;
+        CASE(MOV_E_B):
+            cpu->regs.e = cpu->regs.b;
+            NEXT;
+        CASE(MOV_E_C):
+            cpu->regs.e = cpu->regs.c;
+            NEXT;
+        CASE(MOV_E_D):
+            cpu->regs.e = cpu->regs.d;
+            NEXT;
+        CASE(MOV_E_E):
+            cpu->regs.e = cpu->regs.e;
+            NEXT;
+        CASE(MOV_E_H):
+            cpu->regs.e = cpu->regs.h;
+            NEXT;
+        CASE(MOV_E_L):
+            cpu->regs.e = cpu->regs.l;
+            NEXT;
+        CASE(MOV_E_M):
+            cpu->regs.e = read_byte(cpu, cpu->regs.hl);
+            NEXT;
 
-        case MOV_E_A:
-            regs.e = regs.a;
-            break;
-        case MOV_H_B:
-            regs.h = regs.b;
-            break;
-        case MOV_H_C:
-            regs.h = regs.c;
-            break;
-        case MOV_H_D:
-            regs.h = regs.d;
-            break;
-        case MOV_H_E:
-            regs.h = regs.e;
-            break;
-        case MOV_H_H:
-            regs.h = regs.h;
-            break;
-        case MOV_H_L:
-            regs.h = regs.l;
-            break;
-        case MOV_H_M:
-            regs.h = read_byte(regs.hl);
-            break;
-        case MOV_H_A:
-            regs.h = regs.a;
-            break;
-        case MOV_L_B:
-            regs.l = regs.b;
-            break;
-        case MOV_L_C:
-            regs.l = regs.c;
-            break;
-        case MOV_L_D:
-            regs.l = regs.d;
-            break;
-        case MOV_L_E:
-            regs.l = regs.e;
-            break;
-        case MOV_L_H:
-            regs.l = regs.h;
-            break;
-        case MOV_L_L:
-            regs.l = regs.l;
-            break;
-        case MOV_L_M:
-            regs.l = read_byte(regs.hl);
-            break;
+        CASE(MOV_E_A):
+            cpu->regs.e = cpu->regs.a;
+            NEXT;
+        CASE(MOV_H_B):
+            cpu->regs.h = cpu->regs.b;
+            NEXT;
+        CASE(MOV_H_C):
+            cpu->regs.h = cpu->regs.c;
+            NEXT;
+        CASE(MOV_H_D):
+            cpu->regs.h = cpu->regs.d;
+            NEXT;
+        CASE(MOV_H_E):
+            cpu->regs.h = cpu->regs.e;
+            NEXT;
+        CASE(MOV_H_H):
+            cpu->regs.h = cpu->regs.h;
+            NEXT;
+        CASE(MOV_H_L):
+            cpu->regs.h = cpu->regs.l;
+            NEXT;
+        CASE(MOV_H_M):
+            cpu->regs.h = read_byte(cpu, cpu->regs.hl);
+            NEXT;
+        CASE(MOV_H_A):
+            cpu->regs.h = cpu->regs.a;
+            NEXT;
+        CASE(MOV_L_B):
+            cpu->regs.l = cpu->regs.b;
+            NEXT;
+        CASE(MOV_L_C):
+            cpu->regs.l = cpu->regs.c;
+            NEXT;
+        CASE(MOV_L_D):
+            cpu->regs.l = cpu->regs.d;
+            NEXT;
+        CASE(MOV_L_E):
+            cpu->regs.l = cpu->regs.e;
+            NEXT;
+        CASE(MOV_L_H):
+            cpu->regs.l = cpu->regs.h;
+            NEXT;
+        CASE(MOV_L_L):
+            cpu->regs.l = cpu->regs.l;
+            NEXT;
+        CASE(MOV_L_M):
+            cpu->regs.l = read_byte(cpu, cpu->regs.hl);
+            NEXT;
 
-        case MOV_L_A:
-            regs.l = regs.a;
-            break;
-        case MOV_M_B:
-            write_byte(regs.hl, regs.b);
-            break;
-        case MOV_M_C:
-            write_byte(regs.hl, regs.c);
-            break;
-        case MOV_M_D:
-            write_byte(regs.hl, regs.d);
-            break;
-        case MOV_M_E:
-            write_byte(regs.hl, regs.e);
-            break;
-        case MOV_M_H:
-            write_byte(regs.hl, regs.h);
-            break;
-        case MOV_M_L:
-            write_byte(regs.hl, regs.l);
-            break;
-        case HLT:
+        CASE(MOV_L_A):
+            cpu->regs.l = cpu->regs.a;
+            NEXT;
+        CASE(MOV_M_B):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.b);
+            NEXT;
+        CASE(MOV_M_C):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.c);
+            NEXT;
+        CASE(MOV_M_D):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.d);
+            NEXT;
+        CASE(MOV_M_E):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.e);
+            NEXT;
+        CASE(MOV_M_H):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.h);
+            NEXT;
+        CASE(MOV_M_L):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.l);
+            NEXT;
+        CASE(HLT):
+            cpu->halted = true;
             return EXIT_HLT;
-        case MOV_M_A:
-            write_byte(regs.hl, regs.a);
-            break;
-        case MOV_A_B:
-            regs.a = regs.b;
-            break;
-        case MOV_A_C:
-            regs.a = regs.c;
-            break;
-        case MOV_A_D:
-            regs.a = regs.d;
-            break;
-        case MOV_A_E:
-            regs.a = regs.e;
-            break;
-        case MOV_A_H:
-            regs.a = regs.h;
-            break;
-        case MOV_A_L:
-            regs.a = regs.l;
-            break;
-        case MOV_A_M:
-            regs.a = read_byte(regs.hl);
-            break;
+        CASE(MOV_M_A):
+            write_byte(cpu, cpu->regs.hl, cpu->regs.a);
+            NEXT;
+        CASE(MOV_A_B):
+            cpu->regs.a = cpu->regs.b;
+            NEXT;
+        CASE(MOV_A_C):
+            cpu->regs.a = cpu->regs.c;
+            NEXT;
+        CASE(MOV_A_D):
+            cpu->regs.a = cpu->regs.d;
+            NEXT;
+        CASE(MOV_A_E):
+            cpu->regs.a = cpu->regs.e;
+            NEXT;
+        CASE(MOV_A_H):
+            cpu->regs.a = cpu->regs.h;
+            NEXT;
+        CASE(MOV_A_L):
+            cpu->regs.a = cpu->regs.l;
+            NEXT;
+        CASE(MOV_A_M):
+            cpu->regs.a = read_byte(cpu, cpu->regs.hl);
+            NEXT;
 
-        case MOV_A_A:
-            regs.a = regs.a;
-            break;
-        case ADD_B:
-            EM_ADD(regs.b, 0);
-            break;
-        case ADD_C:
-            EM_ADD(regs.c, 0);
-            break;
-        case ADD_D:
-            EM_ADD(regs.d, 0);
-            break;
-        case ADD_E:
-            EM_ADD(regs.e, 0);
-            break;
-        case ADD_H:
-            EM_ADD(regs.h, 0);
-            break;
-        case ADD_L:
-            EM_ADD(regs.l, 0);
-            break;
-        case ADD_M:
-            res = read_byte(regs.hl);
+        CASE(MOV_A_A):
+            cpu->regs.a = cpu->regs.a;
+            NEXT;
+        CASE(ADD_B):
+            EM_ADD(cpu->regs.b, 0);
+            NEXT;
+        CASE(ADD_C):
+            EM_ADD(cpu->regs.c, 0);
+            NEXT;
+        CASE(ADD_D):
+            EM_ADD(cpu->regs.d, 0);
+            NEXT;
+        CASE(ADD_E):
+            EM_ADD(cpu->regs.e, 0);
+            NEXT;
+        CASE(ADD_H):
+            EM_ADD(cpu->regs.h, 0);
+            NEXT;
+        CASE(ADD_L):
+            EM_ADD(cpu->regs.l, 0);
+            NEXT;
+        CASE(ADD_M):
+            res = read_byte(cpu, cpu->regs.hl);
             EM_ADD(res, 0);
-            break;
-        case ADD_A:
-            EM_ADD(regs.a, 0);
-            break;
-        case ADC_B:
-            EM_ADD(regs.b, regs.cf);
-            break;
-        case ADC_C:
-            EM_ADD(regs.c, regs.cf);
-            break;
-        case ADC_D:
-            EM_ADD(regs.d, regs.cf);
-            break;
-        case ADC_E:
-            EM_ADD(regs.e, regs.cf);
-            break;
-        case ADC_H:
-            EM_ADD(regs.h, regs.cf);
-            break;
-        case ADC_L:
-            EM_ADD(regs.l, regs.cf);
-            break;
-        case ADC_M:
-            res = read_byte(regs.hl);
-            EM_ADD(res, regs.cf);
-            break;
+            NEXT;
+        CASE(ADD_A):
+            EM_ADD(cpu->regs.a, 0);
+            NEXT;
+        CASE(ADC_B):
+            EM_ADD(cpu->regs.b, FLAG_CY());
+            NEXT;
+        CASE(ADC_C):
+            EM_ADD(cpu->regs.c, FLAG_CY());
+            NEXT;
+        CASE(ADC_D):
+            EM_ADD(cpu->regs.d, FLAG_CY());
+            NEXT;
+        CASE(ADC_E):
+            EM_ADD(cpu->regs.e, FLAG_CY());
+            NEXT;
+        CASE(ADC_H):
+            EM_ADD(cpu->regs.h, FLAG_CY());
+            NEXT;
+        CASE(ADC_L):
+            EM_ADD(cpu->regs.l, FLAG_CY());
+            NEXT;
+        CASE(ADC_M):
+            res = read_byte(cpu, cpu->regs.hl);
+            EM_ADD(res, FLAG_CY());
+            NEXT;
 
-        case ADC_A:
-            EM_ADD(regs.a, regs.cf);
-            break;
-        case SUB_B:
-            EM_SUB(regs.b, 0);
-            break;
-        case SUB_C:
-            EM_SUB(regs.c, 0);
-            break;
-        case SUB_D:
-            EM_SUB(regs.d, 0);
-            break;
-        case SUB_E:
-            EM_SUB(regs.e, 0);
-            break;
-        case SUB_H:
-            EM_SUB(regs.h, 0);
-            break;
-        case SUB_L:
-            EM_SUB(regs.l, 0);
-            break;
-        case SUB_M:
-            res = read_byte(regs.hl);
+        CASE(ADC_A):
+            EM_ADD(cpu->regs.a, FLAG_CY());
+            NEXT;
+        CASE(SUB_B):
+            EM_SUB(cpu->regs.b, 0);
+            NEXT;
+        CASE(SUB_C):
+            EM_SUB(cpu->regs.c, 0);
+            NEXT;
+        CASE(SUB_D):
+            EM_SUB(cpu->regs.d, 0);
+            NEXT;
+        CASE(SUB_E):
+            EM_SUB(cpu->regs.e, 0);
+            NEXT;
+        CASE(SUB_H):
+            EM_SUB(cpu->regs.h, 0);
+            NEXT;
+        CASE(SUB_L):
+            EM_SUB(cpu->regs.l, 0);
+            NEXT;
+        CASE(SUB_M):
+            res = read_byte(cpu, cpu->regs.hl);
             EM_SUB(res, 0);
-            break;
-        case SUB_A:
-            EM_SUB(regs.a, 0);
-            break;
-        case SBB_B:
-            EM_SUB(regs.b, regs.cf);
-            break;
-        case SBB_C:
-            EM_SUB(regs.c, regs.cf);
-            break;
-        case SBB_D:
-            EM_SUB(regs.d, regs.cf);
-            break;
-        case SBB_E:
-            EM_SUB(regs.e, regs.cf);
-            break;
-        case SBB_H:
-            EM_SUB(regs.h, regs.cf);
-            break;
-        case SBB_L:
-            EM_SUB(regs.l, regs.cf);
-            break;
-        case SBB_M:
-            res = read_byte(regs.hl);
-            EM_SUB(res, regs.cf);
-            break;
+            NEXT;
+        CASE(SUB_A):
+            EM_SUB(cpu->regs.a, 0);
+            NEXT;
+        CASE(SBB_B):
+            EM_SUB(cpu->regs.b, FLAG_CY());
+            NEXT;
+        CASE(SBB_C):
+            EM_SUB(cpu->regs.c, FLAG_CY());
+            NEXT;
+        CASE(SBB_D):
+            EM_SUB(cpu->regs.d, FLAG_CY());
+            NEXT;
+        CASE(SBB_E):
+            EM_SUB(cpu->regs.e, FLAG_CY());
+            NEXT;
+        CASE(SBB_H):
+            EM_SUB(cpu->regs.h, FLAG_CY());
+            NEXT;
+        CASE(SBB_L):
+            EM_SUB(cpu->regs.l, FLAG_CY());
+            NEXT;
+        CASE(SBB_M):
+            res = read_byte(cpu, cpu->regs.hl);
+            EM_SUB(res, FLAG_CY());
+            NEXT;
 
-        case SBB_A:
-            EM_SUB(regs.a, regs.cf);
-            break;
-        case ANA_B:
-            EM_ANA(regs.b);
-            break;
-        case ANA_C:
-            EM_ANA(regs.c);
-            break;
-        case ANA_D:
-            EM_ANA(regs.d);
-            break;
-        case ANA_E:
-            EM_ANA(regs.e);
-            break;
-        case ANA_H:
-            EM_ANA(regs.h);
-            break;
-        case ANA_L:
-            EM_ANA(regs.l);
-            break;
-        case ANA_M:
-            res = read_byte(regs.hl);
+        CASE(SBB_A):
+            EM_SUB(cpu->regs.a, FLAG_CY());
+            NEXT;
+        CASE(ANA_B):
+            EM_ANA(cpu->regs.b);
+            NEXT;
+        CASE(ANA_C):
+            EM_ANA(cpu->regs.c);
+            NEXT;
+        CASE(ANA_D):
+            EM_ANA(cpu->regs.d);
+            NEXT;
+        CASE(ANA_E):
+            EM_ANA(cpu->regs.e);
+            NEXT;
+        CASE(ANA_H):
+            EM_ANA(cpu->regs.h);
+            NEXT;
+        CASE(ANA_L):
+            EM_ANA(cpu->regs.l);
+            NEXT;
+        CASE(ANA_M):
+            res = read_byte(cpu, cpu->regs.hl);
             EM_ANA(res);
-            break;
-        case ANA_A:
-            EM_ANA(regs.a);
-            break;
-        case XRA_B:
-            EM_XRA(regs.b);
-            break;
-        case XRA_C:
-            EM_XRA(regs.c);
-            break;
-        case XRA_D:
-            EM_XRA(regs.d);
-            break;
-        case XRA_E:
-            EM_XRA(regs.e);
-            break;
-        case XRA_H:
-            EM_XRA(regs.h);
-            break;
-        case XRA_L:
-            EM_XRA(regs.l);
-            break;
-        case XRA_M:
-            res = read_byte(regs.hl);
+            NEXT;
+        CASE(ANA_A):
+            EM_ANA(cpu->regs.a);
+            NEXT;
+        CASE(XRA_B):
+            EM_XRA(cpu->regs.b);
+            NEXT;
+        CASE(XRA_C):
+            EM_XRA(cpu->regs.c);
+            NEXT;
+        CASE(XRA_D):
+            EM_XRA(cpu->regs.d);
+            NEXT;
+        CASE(XRA_E):
+            EM_XRA(cpu->regs.e);
+            NEXT;
+        CASE(XRA_H):
+            EM_XRA(cpu->regs.h);
+            NEXT;
+        CASE(XRA_L):
+            EM_XRA(cpu->regs.l);
+            NEXT;
+        CASE(XRA_M):
+            res = read_byte(cpu, cpu->regs.hl);
             EM_XRA(res);
-            break;
+            NEXT;
 
-        case XRA_A:
-            EM_XRA(regs.a);
-            break;
-        case ORA_B:
-            EM_ORA(regs.b);
-            break;
-        case ORA_C:
-            EM_ORA(regs.c);
-            break;
-        case ORA_D:
-            EM_ORA(regs.d);
-            break;
-        case ORA_E:
-            EM_ORA(regs.e);
-            break;
-        case ORA_H:
-            EM_ORA(regs.h);
-            break;
-        case ORA_L:
-            EM_ORA(regs.l);
-            break;
-        case ORA_M:
-            res = read_byte(regs.hl);
+        CASE(XRA_A):
+            EM_XRA(cpu->regs.a);
+            NEXT;
+        CASE(ORA_B):
+            EM_ORA(cpu->regs.b);
+            NEXT;
+        CASE(ORA_C):
+            EM_ORA(cpu->regs.c);
+            NEXT;
+        CASE(ORA_D):
+            EM_ORA(cpu->regs.d);
+            NEXT;
+        CASE(ORA_E):
+            EM_ORA(cpu->regs.e);
+            NEXT;
+        CASE(ORA_H):
+            EM_ORA(cpu->regs.h);
+            NEXT;
+        CASE(ORA_L):
+            EM_ORA(cpu->regs.l);
+            NEXT;
+        CASE(ORA_M):
+            res = read_byte(cpu, cpu->regs.hl);
             EM_ORA(res);
-            break;
-        case ORA_A:
-            EM_ORA(regs.a);
-            break;
-        case CMP_B:
-            EM_CMP(regs.b);
-            break;
-        case CMP_C:
-            EM_CMP(regs.c);
-            break;
-        case CMP_D:
-            EM_CMP(regs.d);
-            break;
-        case CMP_E:
-            EM_CMP(regs.e);
-            break;
-        case CMP_H:
-            EM_CMP(regs.h);
-            break;
-        case CMP_L:
-            EM_CMP(regs.l);
-            break;
-        case CMP_M:
-            lo_byte = read_byte(regs.hl);
+            NEXT;
+        CASE(ORA_A):
+            EM_ORA(cpu->regs.a);
+            NEXT;
+        CASE(CMP_B):
+            EM_CMP(cpu->regs.b);
+            NEXT;
+        CASE(CMP_C):
+            EM_CMP(cpu->regs.c);
+            NEXT;
+        CASE(CMP_D):
+            EM_CMP(cpu->regs.d);
+            NEXT;
+        CASE(CMP_E):
+            EM_CMP(cpu->regs.e);
+            NEXT;
+        CASE(CMP_H):
+            EM_CMP(cpu->regs.h);
+            NEXT;
+        CASE(CMP_L):
+            EM_CMP(cpu->regs.l);
+            NEXT;
+        CASE(CMP_M):
+            lo_byte = read_byte(cpu, cpu->regs.hl);
             EM_CMP(lo_byte);
-            break;
+            NEXT;
 
-        case CMP_A:
-            EM_CMP(regs.a);
-            break;
-        case RNZ:
-            EM_RET(!regs.zf);
-            break;
-        case POP_B:
-            EM_POP(regs.c, regs.b);
-            break;
-        case JNZ:
-            EM_JUMP(!regs.zf);
-            break;
-        case JMP:
+        CASE(CMP_A):
+            EM_CMP(cpu->regs.a);
+            NEXT;
+        CASE(RNZ):
+            EM_RET(!FLAG_Z());
+            NEXT_BRANCH;
+        CASE(POP_B):
+            EM_POP(cpu->regs.bc);
+            NEXT;
+        CASE(JNZ):
+            EM_JUMP(!FLAG_Z());
+            NEXT_BRANCH;
+        CASE(JMP):
             EM_JUMP(1);
-            break;
-        case CNZ:
-            EM_CALL(!regs.zf);
-            break;
-        case PUSH_B:
-            EM_PUSH(regs.c, regs.b);
-            break;
-        case ADI:
-            lo_byte = read_next_byte();
+            NEXT_BRANCH;
+        CASE(CNZ):
+            EM_CALL(!FLAG_Z());
+            NEXT_BRANCH;
+        CASE(PUSH_B):
+            EM_PUSH(cpu->regs.c, cpu->regs.b);
+            NEXT;
+        CASE(ADI):
+            lo_byte = IMM8();
             EM_ADD(lo_byte, 0);
-            break;
-        case RST_0:
-            break;
-        case RZ:
-            EM_RET(regs.zf);
-            break;
-        case RET:
-            EM_RET(1);
-            break;
-        case JZ:
-            EM_JUMP(regs.zf);
-            break;
-        case RSTV:
+            NEXT;
+        CASE(RST_0):
+            EM_RST(0);
+            NEXT_BRANCH;
+        CASE(RZ):
+            EM_RET(FLAG_Z());
+            NEXT_BRANCH;
+        CASE(RET):
+            EM_POP(cpu->regs.pc);
+            NEXT_BRANCH;
+        CASE(JZ):
+            EM_JUMP(FLAG_Z());
+            NEXT_BRANCH;
+        CASE(RSTV):
             /* not implemented in 8080 */
-            break;
-        case CZ:
-            EM_CALL(regs.zf);
-            break;
-        case CALL:
-            EM_CALL(1);
-            break;
-        case ACI:
-            lo_byte = read_next_byte();
-            EM_ADD(lo_byte, regs.cf);
-            break;
+            NEXT;
+        CASE(CZ):
+            EM_CALL(FLAG_Z());
+            NEXT_BRANCH;
+        CASE(CALL):
+            R16();
+            EM_PUSH(cpu->regs.pcl, cpu->regs.pch);
+            cpu->regs.pc = address;
+            NEXT_BRANCH;
+        CASE(ACI):
+            lo_byte = IMM8();
+            EM_ADD(lo_byte, FLAG_CY());
+            NEXT;
 
-        case RST_1:
+        CASE(RST_1):
             EM_RST(1);
-            break;
-        case RNC:
-            EM_RET(!regs.cf);
-            break;
-        case POP_D:
-            EM_POP(regs.e, regs.d);
-            break;
-        case JNC:
-            EM_JUMP(!regs.cf);
-            break;
-        case OUT:
-            read_next_byte();
-            break;
-        case CNC:
-            EM_CALL(!regs.cf);
-            break;
-        case PUSH_D:
-            EM_PUSH(regs.e, regs.d);
-            break;
-        case SUI:
-            lo_byte = read_next_byte();
+            NEXT_BRANCH;
+        CASE(RNC):
+            EM_RET(!FLAG_CY());
+            NEXT_BRANCH;
+        CASE(POP_D):
+            EM_POP(cpu->regs.de);
+            NEXT;
+        CASE(JNC):
+            EM_JUMP(!FLAG_CY());
+            NEXT_BRANCH;
+        CASE(OUT):
+            cpu->port = IMM8();
+            LOCKSTEP_IO(false);
+            if (!(cpu->bus && port_out(cpu, cpu->port, cpu->regs.a)) && cpu->io_trap)
+                return EXIT_IO;
+            LOCKSTEP_IO(true);
+            POLL_INTERRUPT();
+            NEXT;
+        CASE(CNC):
+            EM_CALL(!FLAG_CY());
+            NEXT_BRANCH;
+        CASE(PUSH_D):
+            EM_PUSH(cpu->regs.e, cpu->regs.d);
+            NEXT;
+        CASE(SUI):
+            lo_byte = IMM8();
             EM_SUB(lo_byte, 0);
-            break;
-        case RST_2:
+            NEXT;
+        CASE(RST_2):
             EM_RST(2);
-            break;
-        case RC:
-            EM_RET(regs.cf);
-            break;
-        case SHLX:
+            NEXT_BRANCH;
+        CASE(RC):
+            EM_RET(FLAG_CY());
+            NEXT_BRANCH;
+        CASE(SHLX):
             /* not implemented in 8080 */
-            break;
-        case JC:
-            EM_JUMP(regs.cf);
-            break;
-        case IN:
-            read_next_byte();
-            break;
-        case CC:
-            EM_CALL(regs.cf);
-            break;
-        case JNUI:
-            break;
-        case SBI:
-            lo_byte = read_next_byte();
-            EM_SUB(lo_byte, regs.cf);
-            break;
+            NEXT;
+        CASE(JC):
+            EM_JUMP(FLAG_CY());
+            NEXT_BRANCH;
+        CASE(IN):
+            cpu->port = IMM8();
+            LOCKSTEP_IO(false);
+            if (!(cpu->bus && port_in(cpu, cpu->port)) && cpu->io_trap)
+                return EXIT_IO;
+            LOCKSTEP_IO(true);
+            POLL_INTERRUPT();
+            NEXT;
+        CASE(CC):
+            EM_CALL(FLAG_CY());
+            NEXT_BRANCH;
+        CASE(JNUI):
+            NEXT;
+        CASE(SBI):
+            lo_byte = IMM8();
+            EM_SUB(lo_byte, FLAG_CY());
+            NEXT;
 
-        case RST_3:
+        CASE(RST_3):
             EM_RST(3);
-            break;
-        case RPO:
-            EM_RET(!regs.pf);
-            break;
-        case POP_H:
-            EM_POP(regs.l, regs.h);
-            break;
-        case JPO:
-            EM_JUMP(!regs.pf);
-            break;
-        case XTHL:
-            lo_byte = regs.l;
-            hi_byte = regs.h;
-            regs.l = read_byte(regs.sp);
-            regs.h = read_byte(regs.sp + 1);
-            write_byte(regs.sp, lo_byte);
-            write_byte(regs.sp + 1, hi_byte);
-            break;
-        case CPO:
-            EM_CALL(!regs.pf);
-            break;
-        case PUSH_H:
-            EM_PUSH(regs.l, regs.h);
-            break;
-        case ANI:
-            lo_byte = read_next_byte();
+            NEXT_BRANCH;
+        CASE(RPO):
+            EM_RET(!FLAG_P());
+            NEXT_BRANCH;
+        CASE(POP_H):
+            EM_POP(cpu->regs.hl);
+            NEXT;
+        CASE(JPO):
+            EM_JUMP(!FLAG_P());
+            NEXT_BRANCH;
+        CASE(XTHL):
+            lo_byte = cpu->regs.l;
+            hi_byte = cpu->regs.h;
+            cpu->regs.l = read_byte(cpu, cpu->regs.sp);
+            cpu->regs.h = read_byte(cpu, cpu->regs.sp + 1);
+            write_byte(cpu, cpu->regs.sp, lo_byte);
+            write_byte(cpu, cpu->regs.sp + 1, hi_byte);
+            NEXT;
+        CASE(CPO):
+            EM_CALL(!FLAG_P());
+            NEXT_BRANCH;
+        CASE(PUSH_H):
+            EM_PUSH(cpu->regs.l, cpu->regs.h);
+            NEXT;
+        CASE(ANI):
+            lo_byte = IMM8();
             EM_ANA(lo_byte);
-            break;
-        case RST_4:
+            NEXT;
+        CASE(RST_4):
             EM_RST(4);
-            break;
-        case RPE:
-            EM_RET(regs.pf);
-            break;
-        case PCHL:
-            regs.pcl = regs.l;
-            regs.pch = regs.h;
-            break;
-        case JPE:
-            EM_JUMP(regs.pf);
-            break;
-        case XCHG:
-            lo_byte = regs.l;
-            hi_byte = regs.h;
-            regs.l = regs.e;
-            regs.h = regs.d;
-            regs.e = lo_byte;
-            regs.d = hi_byte;
-            break;
-        case CPE:
-            EM_CALL(regs.pf);
-            break;
-        case LHLX:
+            NEXT_BRANCH;
+        CASE(RPE):
+            EM_RET(FLAG_P());
+            NEXT_BRANCH;
+        CASE(PCHL):
+            cpu->regs.pcl = cpu->regs.l;
+            cpu->regs.pch = cpu->regs.h;
+            NEXT_BRANCH;
+        CASE(JPE):
+            EM_JUMP(FLAG_P());
+            NEXT_BRANCH;
+        CASE(XCHG):
+            lo_byte = cpu->regs.l;
+            hi_byte = cpu->regs.h;
+            cpu->regs.l = cpu->regs.e;
+            cpu->regs.h = cpu->regs.d;
+            cpu->regs.e = lo_byte;
+            cpu->regs.d = hi_byte;
+            NEXT;
+        CASE(CPE):
+            EM_CALL(FLAG_P());
+            NEXT_BRANCH;
+        CASE(LHLX):
             /* not implemented in 8080 */
-            break;
-        case XRI:
-            lo_byte = read_next_byte();
+            NEXT;
+        CASE(XRI):
+            lo_byte = IMM8();
             EM_XRA(lo_byte);
-            break;
+            NEXT;
 
-        case RST_5:
+        CASE(RST_5):
             EM_RST(5);
-            break;
-        case RP:
-            EM_RET(!regs.sf);
-            break;
-        case POP_PSW:
-            lo_byte = read_byte(regs.sp);
-            hi_byte = read_byte(regs.sp + 1);
-            regs.cf  = 0x01 & lo_byte;
-            regs.pf  = 0x04 & lo_byte;
-            regs.acf = 0x10 & lo_byte;
-            regs.zf  = 0x40 & lo_byte;
-            regs.sf  = 0x80 & lo_byte;
-
-            regs.a = hi_byte;
-            regs.sp += 2;
-            break;
-        case JP:
-            EM_JUMP(!regs.sf);
-            break;
-        case DI:
-            interrupt_enabled = 0;
-            break;
-        case CP:
-            EM_CALL(!regs.sf);
-            break;
-        case PUSH_PSW:
-            lo_byte = 0x02;
-            lo_byte |= regs.cf;
-            lo_byte |= regs.pf << 2;
-            lo_byte |= regs.acf << 4;
-            lo_byte |= regs.zf << 6;
-            lo_byte |= regs.sf << 7;
-            write_byte(regs.sp - 1, regs.a);
-            write_byte(regs.sp - 2, lo_byte);
-            regs.sp -= 2;
-            break;
-        case ORI:
-            lo_byte = read_next_byte();
+            NEXT_BRANCH;
+        CASE(RP):
+            EM_RET(!FLAG_S());
+            NEXT_BRANCH;
+        CASE(POP_PSW):
+            set_psw(cpu, read_byte(cpu, cpu->regs.sp));
+            cpu->regs.a = read_byte(cpu, cpu->regs.sp + 1);
+            cpu->regs.sp += 2;
+            NEXT;
+        CASE(JP):
+            EM_JUMP(!FLAG_S());
+            NEXT_BRANCH;
+        CASE(DI):
+            cpu->interrupt_enabled = 0;
+            NEXT;
+        CASE(CP):
+            EM_CALL(!FLAG_S());
+            NEXT_BRANCH;
+        CASE(PUSH_PSW):
+            write_byte(cpu, cpu->regs.sp - 1, cpu->regs.a);
+            write_byte(cpu, cpu->regs.sp - 2, get_psw(cpu));
+            cpu->regs.sp -= 2;
+            NEXT;
+        CASE(ORI):
+            lo_byte = IMM8();
             EM_ORA(lo_byte);
-            break;
-        case RST_6:
+            NEXT;
+        CASE(RST_6):
             EM_RST(6);
-            break;
-        case RM:
-            EM_RET(regs.sf);
-            break;
-        case SPHL:
-            regs.sp = regs.hl;
-            break;
-        case JM:
-            EM_JUMP(regs.sf);
-            break;
-        case EI:
-            interrupt_enabled = 1;
-            break;
-        case CM:
-            EM_CALL(regs.sf);
-            break;
-        case JUI:
+            NEXT_BRANCH;
+        CASE(RM):
+            EM_RET(FLAG_S());
+            NEXT_BRANCH;
+        CASE(SPHL):
+            cpu->regs.sp = cpu->regs.hl;
+            NEXT;
+        CASE(JM):
+            EM_JUMP(FLAG_S());
+            NEXT_BRANCH;
+        CASE(EI):
+            cpu->interrupt_enabled = 1;
+            /* a pending interrupt is taken after one more instruction */
+            if (cpu->interrupt_pending && end > cpu->cycles + 1)
+                end = cpu->cycles + 1;
+            NEXT;
+        CASE(CM):
+            EM_CALL(FLAG_S());
+            NEXT_BRANCH;
+        CASE(JUI):
             /* not implemented in 8080 */
-            break;
-        case CPI:
-            lo_byte = read_next_byte();
+            NEXT;
+        CASE(CPI):
+            lo_byte = IMM8();
             EM_CMP(lo_byte);
-            break;
+            NEXT;
 
-        case RST_7:
+        CASE(RST_7):
             EM_RST(7);
+            NEXT_BRANCH;
+    }
+    FETCH();
+    goto dispatch;
+}
+
+int instruction(struct CPU *cpu, enum OpCode opcode)
+{
+    int ret = execute(cpu, opcode, 0);
+    if (cpu->bus && cpu->bus->npending)
+        cpu_flush_ports(cpu);
+    return ret == EXIT_BUDGET || ret == EXIT_BRANCH ? EXIT_OK : ret;
+}
+
+#ifdef EMU8080_JIT
+/* Alternate between compiled blocks and the interpreter, which hands back
+ * control after every branch so hot targets can be found and compiled */
+static int run_jit(struct CPU *cpu, uint64_t end)
+{
+    cpu->jit->end = end;
+    for (bool first = true;; first = false) {
+        if (!first) {
+            if (cpu->regs.pc == 0)
+                return EXIT_RST;
+            if (cpu->cycles >= end)
+                return EXIT_BUDGET;
+            if (cpu->breakpoints && at_breakpoint(cpu))
+                return EXIT_BREAK;
+            if (interrupt_ready(cpu))
+                return EXIT_BUDGET;
+        }
+        jit_block block = jit_find(cpu->jit, cpu->regs.pc, end - cpu->cycles);
+        if (!block)
+            block = jit_lookup(cpu->jit, cpu->regs.pc, end - cpu->cycles);
+        if (block) {
+            block(cpu);
+            continue;
+        }
+        int ret = execute(cpu, read_next_byte(cpu), end);
+        if (ret != EXIT_BRANCH)
+            return ret;
+    }
+}
+#endif
+
+/* Act on an interrupt request as if the device had put RST vector on the
+ * bus: interrupts are disabled again and HLT is left */
+static void take_interrupt(struct CPU *cpu)
+{
+    cpu->interrupt_pending = false;
+    cpu->interrupt_enabled = false;
+    cpu->halted = false;
+    OBSERVE(cpu->regs.pc, RST_0 | cpu->interrupt_vector << 3);
+    EM_RST(cpu->interrupt_vector);
+    cpu->cycles += cycle_table[RST_0];
+    ++cpu->instructions;
+}
+
+int run(struct CPU *cpu, uint64_t budget)
+{
+    uint64_t end = cpu->cycles + budget;
+    if (end < cpu->cycles)
+        end = UINT64_MAX;
+    int ret;
+    /* EI, device handlers and the JIT end the slice early when an
+     * interrupt becomes ready, so it is only looked at here */
+    for (;;) {
+        if (interrupt_ready(cpu))
+            take_interrupt(cpu);
+        if (cpu->halted) {
+            if (!cpu->interrupt_enabled) {
+                ret = EXIT_HLT;
+                break;
+            }
+            /* Idle until an interrupt, which the host can only raise once
+             * this slice is over: skip straight to its end */
+            if (cpu->cycles < end)
+                cpu->cycles = end;
+            ret = EXIT_BUDGET;
             break;
+        }
+#ifdef EMU8080_JIT
+        if (JIT_ON(cpu))
+            ret = run_jit(cpu, end);
+        else
+#endif
+            ret = execute(cpu, read_next_byte(cpu), end);
+        if (ret == EXIT_HLT)
+            continue;
+        if (ret != EXIT_BUDGET || !interrupt_ready(cpu) || cpu->cycles >= end)
+            break;
+    }
+    if (cpu->bus && cpu->bus->npending)
+        cpu_flush_ports(cpu);
+    return ret;
+}
+
+#ifdef EMU8080_JIT
+/* Flag-setting operations called from compiled code */
+void alu_add(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_ADD(val, 0);
+}
+
+void alu_adc(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_ADD(val, FLAG_CY());
+}
+
+void alu_sub(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_SUB(val, 0);
+}
+
+void alu_sbb(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_SUB(val, FLAG_CY());
+}
+
+void alu_ana(struct CPU *cpu, uint8_t val)
+{
+    EM_ANA(val);
+}
+
+void alu_xra(struct CPU *cpu, uint8_t val)
+{
+    EM_XRA(val);
+}
+
+void alu_ora(struct CPU *cpu, uint8_t val)
+{
+    EM_ORA(val);
+}
+
+void alu_cmp(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_CMP(val);
+}
+
+uint8_t alu_inr(struct CPU *cpu, uint8_t val)
+{
+    EM_INR(val);
+    return val;
+}
+
+uint8_t alu_dcr(struct CPU *cpu, uint8_t val)
+{
+    uint16_t tmp;
+    EM_DCR(val);
+    return val;
+}
+
+void alu_dad(struct CPU *cpu, uint16_t val)
+{
+    EM_DAD(val);
+}
+
+/* Stack accesses compiled code cannot make itself */
+void stack_push(struct CPU *cpu, uint16_t value)
+{
+    EM_PUSH(value & 0xFF, value >> 8);
+}
+
+uint16_t stack_pop(struct CPU *cpu)
+{
+    uint8_t lo_byte, hi_byte;
+    uint16_t value;
+    EM_POP(value);
+    return value;
+}
+
+/* Where compiled code finds the flag tested by condition cc (NZ, Z, NC, C,
+ * PO, PE, P, M): the condition holds when the masked byte is non-zero for
+ * odd cc and zero for even cc. False if the flag is not kept in a byte of
+ * its own, in which case cpu_condition() has to be called. */
+bool cpu_condition_flag(unsigned cc, size_t *offset, uint8_t *mask)
+{
+#if defined(EMU8080_PACKED_FLAGS)
+    static const uint8_t flag[4] = {PSW_Z, PSW_C, PSW_P, PSW_S};
+    *offset = offsetof(struct CPU, regs.f);
+    *mask = flag[cc >> 1];
+#elif defined(EMU8080_LAZY_FLAGS)
+    if (cc >> 1 != 1)
+        return false;
+    *offset = offsetof(struct CPU, regs.cf);
+    *mask = 1;
+#else
+    static const size_t flag[4] = {
+            offsetof(struct CPU, regs.zf), offsetof(struct CPU, regs.cf),
+            offsetof(struct CPU, regs.pf), offsetof(struct CPU, regs.sf),
+    };
+    *offset = flag[cc >> 1];
+    *mask = 1;
+#endif
+    return true;
+}
+
+bool cpu_condition(struct CPU *cpu, unsigned cc)
+{
+    bool flag;
+    switch (cc >> 1) {
+        case 0: flag = FLAG_Z(); break;
+        case 1: flag = FLAG_CY(); break;
+        case 2: flag = FLAG_P(); break;
+        default: flag = FLAG_S(); break;
     }
-    if (regs.pc == 0) {
-        return EXIT_RST;
+    return flag == (cc & 1);
+}
+#endif
+
+int cpu_set_breakpoint(struct CPU *cpu, uint16_t addr)
+{
+    if (!cpu->breakpoints) {
+        cpu->breakpoints = calloc(MEM_SIZE / 8, 1);
+        if (!cpu->breakpoints)
+            return -1;
     }
-    return EXIT_OK;
+    cpu->breakpoints[addr >> 3] |= 1 << (addr & 7);
+    /* compiled blocks do not stop at breakpoints they were built across */
+    if (cpu->jit)
+        jit_flush(cpu->jit);
+    return 0;
 }
 
+void cpu_clear_breakpoint(struct CPU *cpu, uint16_t addr)
+{
+    if (cpu->breakpoints)
+        cpu->breakpoints[addr >> 3] &= ~(1 << (addr & 7));
+}
+
+int cpu_trace(struct CPU *cpu, size_t size)
+{
+#ifdef EMU8080_TRACE
+    trace_destroy(cpu->trace);
+    cpu->trace = NULL;
+    if (size && !(cpu->trace = trace_create(cpu, size)))
+        return -1;
+    return 0;
+#else
+    (void) cpu;
+    (void) size;
+    return -1;
+#endif
+}
+
+int cpu_profile(struct CPU *cpu, bool on)
+{
+#ifdef EMU8080_PROFILE
+    profile_destroy(cpu->profile);
+    cpu->profile = NULL;
+    if (on && !(cpu->profile = profile_create(cpu)))
+        return -1;
+    return 0;
+#else
+    (void) cpu;
+    return on ? -1 : 0;
+#endif
+}
+
+static struct Port *attach(struct CPU *cpu, uint8_t port)
+{
+    if (!cpu->bus && !(cpu->bus = calloc(1, sizeof(*cpu->bus))))
+        return NULL;
+    /* whatever was queued still goes to the old handler */
+    cpu_flush_ports(cpu);
+    return &cpu->bus->ports[port];
+}
+
+int cpu_attach_port(struct CPU *cpu, uint8_t port, port_read read,
+                    port_write write, void *device)
+{
+    struct Port *p = attach(cpu, port);
+    if (!p)
+        return -1;
+    free(p->buffer);
+    *p = (struct Port) {.read = read, .write = write, .device = device};
+    return 0;
+}
+
+int cpu_buffer_port(struct CPU *cpu, uint8_t port, port_flush flush, void *device)
+{
+    struct Port *p = attach(cpu, port);
+    if (!p)
+        return -1;
+    if (!flush) {
+        free(p->buffer);
+        p->buffer = NULL;
+        return 0;
+    }
+    if (!p->buffer && !(p->buffer = malloc(PORT_BUFFER)))
+        return -1;
+    p->flush = flush;
+    p->device = device;
+    return 0;
+}
+
+void cpu_flush_ports(struct CPU *cpu)
+{
+    struct Bus *bus = cpu->bus;
+    if (!bus)
+        return;
+    for (unsigned i = 0; i < bus->npending; ++i) {
+        struct Port *p = &bus->ports[bus->pending[i]];
+        p->flush(p->device, bus->pending[i], p->buffer, p->len);
+        p->len = 0;
+    }
+    bus->npending = 0;
+}
+
+void cpu_interrupt(struct CPU *cpu, uint8_t vector)
+{
+    cpu->interrupt_vector = vector & 7;
+    cpu->interrupt_pending = true;
+}
+
+/* Give a bank back what was written to it while mapped; ROM and device
+ * pages have nothing to give back */
+static void save_page(struct CPU *cpu, unsigned page)
+{
+    if (cpu->map->host[page] && !(cpu->page_flags[page] & (PAGE_ROM | PAGE_IO)))
+        memcpy(cpu->map->host[page], cpu->memory + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+}
+
+/* Show a bank or ROM by copying it in. Device pages read as 0xFF when
+ * fetched from, which is RST 7. */
+static void load_page(struct CPU *cpu, unsigned page)
+{
+    uint8_t *memory = cpu->memory + page * MEM_PAGE_SIZE;
+    if (cpu->page_flags[page] & PAGE_SHARED)
+        return;
+    if (cpu->map->host[page])
+        memcpy(memory, cpu->map->host[page], MEM_PAGE_SIZE);
+    else if (cpu->page_flags[page] & PAGE_IO)
+        memset(memory, 0xFF, MEM_PAGE_SIZE);
+}
+
+/* Forget anything compiled from what page held */
+static void drop_page(struct CPU *cpu, unsigned page)
+{
+    if (cpu->jit)
+        jit_drop_page(cpu->jit, page);
+}
+
+/* Swap what page shows */
+static void map_page(struct CPU *cpu, unsigned page, uint8_t flags, uint8_t *host,
+                     mem_read read, mem_write write, void *device)
+{
+    struct MemMap *map = cpu->map;
+    save_page(cpu, page);
+    /* whatever the page shows now, it is not the last snapshot's */
+    cpu->page_flags[page] = flags;
+    map->host[page] = host;
+    map->read[page] = read;
+    map->write[page] = write;
+    map->device[page] = device;
+    load_page(cpu, page);
+    drop_page(cpu, page);
+}
+
+/* Give the host pages of [addr, addr + len) private memory again, keeping
+ * what shared ROM outside the range shows as copies */
+static int unshare(struct CPU *cpu, uint16_t addr, size_t len)
+{
+    size_t per_host_page = host_page() / MEM_PAGE_SIZE;
+    for (size_t page = addr >> MEM_PAGE_SHIFT; page < (addr + len) >> MEM_PAGE_SHIFT; ++page) {
+        if (!(cpu->page_flags[page] & PAGE_SHARED))
+            continue;
+        size_t first = page - page % per_host_page;
+        if (mmap(cpu->memory + first * MEM_PAGE_SIZE, host_page(), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            return -1;
+        for (size_t i = first; i < first + per_host_page; ++i) {
+            cpu->page_flags[i] &= ~PAGE_SHARED;
+            load_page(cpu, i);
+        }
+    }
+    return 0;
+}
+
+static int map_range(struct CPU *cpu, uint16_t addr, size_t len, uint8_t flags, uint8_t *host,
+                     mem_read read, mem_write write, void *device)
+{
+    if (addr % MEM_PAGE_SIZE || len % MEM_PAGE_SIZE || addr + len > MEM_SIZE)
+        return -1;
+    if (!cpu->map && !(cpu->map = calloc(1, sizeof(*cpu->map))))
+        return -1;
+    if (unshare(cpu, addr, len))
+        return -1;
+    for (size_t off = 0; off < len; off += MEM_PAGE_SIZE)
+        map_page(cpu, (addr + off) >> MEM_PAGE_SHIFT, flags, host ? host + off : NULL,
+                 read, write, device);
+    return 0;
+}
+
+int cpu_map_ram(struct CPU *cpu, uint16_t addr, size_t len, uint8_t *bank)
+{
+    return map_range(cpu, addr, len, 0, bank, NULL, NULL, NULL);
+}
+
+int cpu_map_rom(struct CPU *cpu, uint16_t addr, size_t len, const uint8_t *data)
+{
+    if (!data)
+        return -1;
+    /* never written to, since writes to ROM pages are dropped */
+    return map_range(cpu, addr, len, PAGE_ROM, (uint8_t *) data, NULL, NULL, NULL);
+}
+
+int cpu_share_rom(struct CPU *cpu, uint16_t addr, size_t len, const uint8_t *data,
+                  int fd, off_t offset)
+{
+    if (addr % host_page() || len % host_page() || offset % host_page())
+        return -1;
+    if (cpu_map_rom(cpu, addr, len, data))
+        return -1;
+    /* the copy cpu_map_rom() made is dropped for the page cache's */
+    if (len && mmap(cpu->memory + addr, len, PROT_READ, MAP_SHARED | MAP_FIXED, fd,
+                    offset) == MAP_FAILED) {
+        cpu_map_rom(cpu, addr, len, data);
+        return -1;
+    }
+    for (size_t off = 0; off < len; off += MEM_PAGE_SIZE)
+        cpu->page_flags[(addr + off) >> MEM_PAGE_SHIFT] |= PAGE_SHARED;
+    return 0;
+}
+
+int cpu_map_io(struct CPU *cpu, uint16_t addr, size_t len, mem_read read,
+               mem_write write, void *device)
+{
+    return map_range(cpu, addr, len, PAGE_IO, NULL, read, write, device);
+}
+
+static void put_page(struct Page *page)
+{
+    if (page && atomic_fetch_sub(&page->refs, 1) == 1)
+        free(page);
+}
+
+/* Mark the RAM that matches snapshot as clean, so the next snapshot can
+ * share it and restoring snapshot again can skip it */
+static void rebase(struct CPU *cpu, struct Snapshot *snapshot)
+{
+    atomic_fetch_add(&snapshot->refs, 1);
+    cpu_free_snapshot(cpu->base);
+    cpu->base = snapshot;
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        if (!(cpu->page_flags[page] & (PAGE_ROM | PAGE_IO)))
+            cpu->page_flags[page] = snapshot->pages[page] ? PAGE_CLEAN : 0;
+}
+
+struct Snapshot *cpu_snapshot(struct CPU *cpu)
+{
+    struct Snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot)
+        return NULL;
+    atomic_init(&snapshot->refs, 1);
+    snapshot->regs = cpu->regs;
+    snapshot->interrupt_enabled = cpu->interrupt_enabled;
+    snapshot->interrupt_pending = cpu->interrupt_pending;
+    snapshot->interrupt_vector = cpu->interrupt_vector;
+    snapshot->halted = cpu->halted;
+    snapshot->port = cpu->port;
+    snapshot->cycles = cpu->cycles;
+    snapshot->instructions = cpu->instructions;
+    for (unsigned page = 0; page < MEM_PAGES; ++page) {
+        if (cpu->page_flags[page] & (PAGE_ROM | PAGE_IO))
+            continue;
+        struct Page *p;
+        if (cpu->page_flags[page] & PAGE_CLEAN) {
+            p = cpu->base->pages[page];
+            atomic_fetch_add(&p->refs, 1);
+        } else {
+            if (!(p = malloc(sizeof(*p)))) {
+                cpu_free_snapshot(snapshot);
+                return NULL;
+            }
+            atomic_init(&p->refs, 1);
+            memcpy(p->data, cpu->memory + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+        }
+        snapshot->pages[page] = p;
+    }
+    rebase(cpu, snapshot);
+    return snapshot;
+}
+
+/* Pages that are clean and the same in both snapshots are left alone;
+ * pages that are ROM or a device now, or were then, are not touched */
+void cpu_restore(struct CPU *cpu, struct Snapshot *snapshot)
+{
+    cpu->regs = snapshot->regs;
+    cpu->interrupt_enabled = snapshot->interrupt_enabled;
+    cpu->interrupt_pending = snapshot->interrupt_pending;
+    cpu->interrupt_vector = snapshot->interrupt_vector;
+    cpu->halted = snapshot->halted;
+    cpu->port = snapshot->port;
+    cpu->cycles = snapshot->cycles;
+    cpu->instructions = snapshot->instructions;
+    for (unsigned page = 0; page < MEM_PAGES; ++page) {
+        const struct Page *p = snapshot->pages[page];
+        uint8_t flags = cpu->page_flags[page];
+        if (!p || flags & (PAGE_ROM | PAGE_IO))
+            continue;
+        if (flags & PAGE_CLEAN && cpu->base->pages[page] == p)
+            continue;
+        memcpy(cpu->memory + page * MEM_PAGE_SIZE, p->data, MEM_PAGE_SIZE);
+        drop_page(cpu, page);
+    }
+    rebase(cpu, snapshot);
+}
+
+void cpu_free_snapshot(struct Snapshot *snapshot)
+{
+    if (!snapshot || atomic_fetch_sub(&snapshot->refs, 1) != 1)
+        return;
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        put_page(snapshot->pages[page]);
+    free(snapshot);
+}
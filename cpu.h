@@ -1,12 +1,17 @@
 #ifndef EMU8080_CPUH
 #define EMU8080_CPUH
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include "opcodes.h"
 
 #define EXIT_OK  (0)
 #define EXIT_HLT (-1)
 #define EXIT_RST (1)
+#define EXIT_BUDGET (2) /* the cycle budget given to run() is used up */
+#define EXIT_BREAK  (3) /* pc reached a breakpoint */
+#define EXIT_IO     (4) /* IN or OUT executed with io_trap set; see cpu->port */
 
 /* Define the registers */
 struct Registers {
@@ -40,22 +45,144 @@ struct Registers {
         };
         uint16_t sp;
     };
+#if defined(EMU8080_PACKED_FLAGS)
+    /* flags and accumulator as PUSH PSW stores them */
+    union {
+        struct {
+            uint8_t f, a;
+        };
+        uint16_t psw;
+    };
+#else
     bool cf;
+#ifdef EMU8080_LAZY_FLAGS
+    uint16_t zsp;   /* last result; the other flags follow from it */
+    uint8_t aux;    /* aux carry in bit 4 */
+#else
     bool pf;
     bool acf;
     bool zf;
     bool sf;
+#endif
     uint8_t a;
+#endif
 };
 #define MEM_SIZE 0x10000
-extern uint8_t memory[MEM_SIZE];
-extern struct Registers regs;
-extern bool interrupt_enabled;
+#define MEM_PAGE_SHIFT 8
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGES (MEM_SIZE / MEM_PAGE_SIZE)
+#define PAGE_ROM 0x01   /* writes are dropped */
+#define PAGE_IO 0x02    /* reads and writes go to a device */
+#define PAGE_CLEAN 0x04 /* RAM unchanged since cpu->base was taken or restored */
+#define PAGE_SHARED 0x08 /* ROM mapped from a file, read-only in cpu->memory */
+
+struct Jit;
+struct Bus;
+struct MemMap;
+struct Snapshot;
+struct Trace;
+struct Profile;
+struct LockstepLog;
+
+/* Device callbacks for I/O ports. A flush handler receives, in order, the
+ * bytes written to a buffered port since it was last called. */
+typedef uint8_t (*port_read)(void *device, uint8_t port);
+typedef void (*port_write)(void *device, uint8_t port, uint8_t value);
+typedef void (*port_flush)(void *device, uint8_t port, const uint8_t *data, size_t len);
+/* Device callbacks for memory-mapped pages */
+typedef uint8_t (*mem_read)(void *device, uint16_t addr);
+typedef void (*mem_write)(void *device, uint16_t addr, uint8_t value);
+
+/* All state of one machine; any number of them may run side by side */
+struct CPU {
+    struct Registers regs;
+    bool interrupt_enabled;
+    bool interrupt_pending; /* a device asked for RST interrupt_vector */
+    uint8_t interrupt_vector;
+    bool halted;        /* stopped by HLT until an interrupt is taken */
+    bool io_trap;       /* stop on IN and OUT so the host can service them */
+    uint8_t port;       /* port of the last IN or OUT */
+    uint64_t cycles;    /* T-states executed since reset */
+    uint64_t instructions;
+    uint8_t *breakpoints; /* one bit per address, allocated on first use */
+    struct Jit *jit;    /* compiled code, if built with the JIT */
+    struct Bus *bus;    /* port handlers, allocated on first use */
+    struct MemMap *map; /* banks, ROMs and devices, allocated on first use */
+    struct Snapshot *base; /* last snapshot taken or restored */
+    struct Trace *trace; /* instruction trace, if built with one and started */
+    struct Profile *profile; /* execution profile, likewise */
+    struct LockstepLog *lockstep; /* writes and I/O, while run in lockstep */
+    uint8_t page_flags[MEM_PAGES]; /* PAGE_* bits, 0 for RAM */
+    uint8_t memory[MEM_SIZE];
+};
+
+extern struct CPU *cpu_create(void);
+extern void cpu_destroy(struct CPU *cpu);
+extern void cpu_reset(struct CPU *cpu);
+extern void cpu_invalidate(struct CPU *cpu);
 
-extern void write_byte(uint16_t addr, uint8_t value);
-extern uint8_t read_byte(uint16_t addr);
-extern uint8_t read_next_byte();
+extern void write_byte(struct CPU *cpu, uint16_t addr, uint8_t value);
+extern uint8_t read_byte(struct CPU *cpu, uint16_t addr);
+extern uint8_t read_next_byte(struct CPU *cpu);
 extern uint16_t merge_bytes(uint8_t lo_byte, uint8_t hi_byte);
-extern int instruction(enum OpCode opcode);
+/* The flag byte as PUSH PSW stores it, whichever way flags are kept */
+extern uint8_t cpu_get_psw(struct CPU *cpu);
+extern void cpu_set_psw(struct CPU *cpu, uint8_t psw);
+extern int instruction(struct CPU *cpu, enum OpCode opcode);
+/* Execute instructions until budget T-states are used up (EXIT_BUDGET) or
+ * the machine stops first on HLT, a jump to 0, a breakpoint or an I/O trap.
+ * HLT with interrupts enabled is not a stop: the rest of the budget passes
+ * in one step, with cpu->halted set until an interrupt is taken. */
+extern int run(struct CPU *cpu, uint64_t budget);
+extern int cpu_set_breakpoint(struct CPU *cpu, uint16_t addr);
+extern void cpu_clear_breakpoint(struct CPU *cpu, uint16_t addr);
+/* Hand IN and OUT on port to a device. Ports without a handler for the
+ * access stop run() with EXIT_IO if io_trap is set and are ignored if not. */
+extern int cpu_attach_port(struct CPU *cpu, uint8_t port, port_read read,
+                           port_write write, void *device);
+/* Queue OUT on port and deliver the bytes to flush in batches: when the
+ * queue is full, before any unbuffered port is accessed and before run()
+ * returns */
+extern int cpu_buffer_port(struct CPU *cpu, uint8_t port, port_flush flush, void *device);
+extern void cpu_flush_ports(struct CPU *cpu);
+/* Change what [addr, addr + len) shows, both multiples of MEM_PAGE_SIZE.
+ * Banks and ROMs are copied into cpu->memory, so switching banks is
+ * remapping; a bank gets back what was written to it when it is mapped out
+ * again, and a NULL bank is plain RAM holding whatever was there last.
+ * Banks and ROMs must stay allocated while mapped. */
+extern int cpu_map_ram(struct CPU *cpu, uint16_t addr, size_t len, uint8_t *bank);
+extern int cpu_map_rom(struct CPU *cpu, uint16_t addr, size_t len, const uint8_t *data);
+extern int cpu_map_io(struct CPU *cpu, uint16_t addr, size_t len, mem_read read,
+                      mem_write write, void *device);
+/* Map ROM from a file straight into cpu->memory, so that every machine
+ * mapping the same file shares one copy of it in the page cache. data is
+ * the same bytes, mapped by the host; addr, len and offset must be
+ * multiples of the host page size. Mapping anything else over part of it
+ * turns the rest of its host page back into a copy. */
+extern int cpu_share_rom(struct CPU *cpu, uint16_t addr, size_t len, const uint8_t *data,
+                         int fd, off_t offset);
+/* Save registers and RAM, sharing every page still unchanged since the
+ * last snapshot. Restoring copies back only the pages written since, so
+ * forking many runs from one state is cheap. The memory map, devices and
+ * breakpoints belong to the host and are not saved. A snapshot can be
+ * restored into any number of machines, in any thread, until it is freed;
+ * machines keep what they need of it. */
+extern struct Snapshot *cpu_snapshot(struct CPU *cpu);
+extern void cpu_restore(struct CPU *cpu, struct Snapshot *snapshot);
+extern void cpu_free_snapshot(struct Snapshot *snapshot);
+/* Ask for RST vector (0-7) to be executed as soon as interrupts are enabled,
+ * waking the processor from HLT. Call it between run()s or from a device
+ * handler; a later request replaces one not yet taken. */
+extern void cpu_interrupt(struct CPU *cpu, uint8_t vector);
+/* Record every instruction with the registers before it and the writes it
+ * makes, in a ring of size bytes that keeps the most recent; a size of 0
+ * stops recording. Traced machines are never compiled by the JIT. Builds
+ * without TRACE=1 return -1. */
+extern int cpu_trace(struct CPU *cpu, size_t size);
+/* Start counting executions and T-states per opcode, per pc and per call
+ * stack in cpu->profile, discarding any earlier counts, or stop and free
+ * them. Profiled machines are never compiled by the JIT. Builds without
+ * PROFILE=1 return -1. */
+extern int cpu_profile(struct CPU *cpu, bool on);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#ifndef EMU8080_CYCLESH
+#define EMU8080_CYCLESH
+#include <stdint.h>
+#include "opcodes.h"
+
+/* Taken conditional CALLs and RETs cost this many states on top of the table */
+#define COND_TAKEN_CYCLES 6
+
+/* T-states per opcode; built with scripts/build_cycles */
+static const uint8_t cycle_table[256] = {
+  [NOP     ] =  4,
+  [LXI_B   ] = 10,
+  [STAX_B  ] =  7,
+  [INX_B   ] =  5,
+  [INR_B   ] =  5,
+  [DCR_B   ] =  5,
+  [MVI_B   ] =  7,
+  [RLC     ] =  4,
+  [DSUB    ] =  4,
+  [DAD_B   ] = 10,
+  [LDAX_B  ] =  7,
+  [DCX_B   ] =  5,
+  [INR_C   ] =  5,
+  [DCR_C   ] =  5,
+  [MVI_C   ] =  7,
+  [RRC     ] =  4,
+  [AHRL    ] =  4,
+  [LXI_D   ] = 10,
+  [STAX_D  ] =  7,
+  [INX_D   ] =  5,
+  [INR_D   ] =  5,
+  [DCR_D   ] =  5,
+  [MVI_D   ] =  7,
+  [RAL     ] =  4,
+  [RDEL    ] =  4,
+  [DAD_D   ] = 10,
+  [LDAX_D  ] =  7,
+  [DCX_D   ] =  5,
+  [INR_E   ] =  5,
+  [DCR_E   ] =  5,
+  [MVI_E   ] =  7,
+  [RAR     ] =  4,
+  [RIM     ] =  4,
+  [LXI_H   ] = 10,
+  [SHLD    ] = 16,
+  [INX_H   ] =  5,
+  [INR_H   ] =  5,
+  [DCR_H   ] =  5,
+  [MVI_H   ] =  7,
+  [DAA     ] =  4,
+  [LDHI    ] =  4,
+  [DAD_H   ] = 10,
+  [LHLD    ] = 16,
+  [DCX_H   ] =  5,
+  [INR_L   ] =  5,
+  [DCR_L   ] =  5,
+  [MVI_L   ] =  7,
+  [CMA     ] =  4,
+  [SIM     ] =  4,
+  [LXI_SP  ] = 10,
+  [STA     ] = 13,
+  [INX_SP  ] =  5,
+  [INR_M   ] = 10,
+  [DCR_M   ] = 10,
+  [MVI_M   ] = 10,
+  [STC     ] =  4,
+  [LDSI    ] =  4,
+  [DAD_SP  ] = 10,
+  [LDA     ] = 13,
+  [DCX_SP  ] =  5,
+  [INR_A   ] =  5,
+  [DCR_A   ] =  5,
+  [MVI_A   ] =  7,
+  [CMC     ] =  4,
+  [MOV_B_B ] =  5,
+  [MOV_B_C ] =  5,
+  [MOV_B_D ] =  5,
+  [MOV_B_E ] =  5,
+  [MOV_B_H ] =  5,
+  [MOV_B_L ] =  5,
+  [MOV_B_M ] =  7,
+  [MOV_B_A ] =  5,
+  [MOV_C_B ] =  5,
+  [MOV_C_C ] =  5,
+  [MOV_C_D ] =  5,
+  [MOV_C_E ] =  5,
+  [MOV_C_H ] =  5,
+  [MOV_C_L ] =  5,
+  [MOV_C_M ] =  7,
+  [MOV_C_A ] =  5,
+  [MOV_D_B ] =  5,
+  [MOV_D_C ] =  5,
+  [MOV_D_D ] =  5,
+  [MOV_D_E ] =  5,
+  [MOV_D_H ] =  5,
+  [MOV_D_L ] =  5,
+  [MOV_D_M ] =  7,
+  [MOV_D_A ] =  5,
+  [MOV_E_B ] =  5,
+  [MOV_E_C ] =  5,
+  [MOV_E_D ] =  5,
+  [MOV_E_E ] =  5,
+  [MOV_E_H ] =  5,
+  [MOV_E_L ] =  5,
+  [MOV_E_M ] =  7,
+  [MOV_E_A ] =  5,
+  [MOV_H_B ] =  5,
+  [MOV_H_C ] =  5,
+  [MOV_H_D ] =  5,
+  [MOV_H_E ] =  5,
+  [MOV_H_H ] =  5,
+  [MOV_H_L ] =  5,
+  [MOV_H_M ] =  7,
+  [MOV_H_A ] =  5,
+  [MOV_L_B ] =  5,
+  [MOV_L_C ] =  5,
+  [MOV_L_D ] =  5,
+  [MOV_L_E ] =  5,
+  [MOV_L_H ] =  5,
+  [MOV_L_L ] =  5,
+  [MOV_L_M ] =  7,
+  [MOV_L_A ] =  5,
+  [MOV_M_B ] =  7,
+  [MOV_M_C ] =  7,
+  [MOV_M_D ] =  7,
+  [MOV_M_E ] =  7,
+  [MOV_M_H ] =  7,
+  [MOV_M_L ] =  7,
+  [HLT     ] =  7,
+  [MOV_M_A ] =  7,
+  [MOV_A_B ] =  5,
+  [MOV_A_C ] =  5,
+  [MOV_A_D ] =  5,
+  [MOV_A_E ] =  5,
+  [MOV_A_H ] =  5,
+  [MOV_A_L ] =  5,
+  [MOV_A_M ] =  7,
+  [MOV_A_A ] =  5,
+  [ADD_B   ] =  4,
+  [ADD_C   ] =  4,
+  [ADD_D   ] =  4,
+  [ADD_E   ] =  4,
+  [ADD_H   ] =  4,
+  [ADD_L   ] =  4,
+  [ADD_M   ] =  7,
+  [ADD_A   ] =  4,
+  [ADC_B   ] =  4,
+  [ADC_C   ] =  4,
+  [ADC_D   ] =  4,
+  [ADC_E   ] =  4,
+  [ADC_H   ] =  4,
+  [ADC_L   ] =  4,
+  [ADC_M   ] =  7,
+  [ADC_A   ] =  4,
+  [SUB_B   ] =  4,
+  [SUB_C   ] =  4,
+  [SUB_D   ] =  4,
+  [SUB_E   ] =  4,
+  [SUB_H   ] =  4,
+  [SUB_L   ] =  4,
+  [SUB_M   ] =  7,
+  [SUB_A   ] =  4,
+  [SBB_B   ] =  4,
+  [SBB_C   ] =  4,
+  [SBB_D   ] =  4,
+  [SBB_E   ] =  4,
+  [SBB_H   ] =  4,
+  [SBB_L   ] =  4,
+  [SBB_M   ] =  7,
+  [SBB_A   ] =  4,
+  [ANA_B   ] =  4,
+  [ANA_C   ] =  4,
+  [ANA_D   ] =  4,
+  [ANA_E   ] =  4,
+  [ANA_H   ] =  4,
+  [ANA_L   ] =  4,
+  [ANA_M   ] =  7,
+  [ANA_A   ] =  4,
+  [XRA_B   ] =  4,
+  [XRA_C   ] =  4,
+  [XRA_D   ] =  4,
+  [XRA_E   ] =  4,
+  [XRA_H   ] =  4,
+  [XRA_L   ] =  4,
+  [XRA_M   ] =  7,
+  [XRA_A   ] =  4,
+  [ORA_B   ] =  4,
+  [ORA_C   ] =  4,
+  [ORA_D   ] =  4,
+  [ORA_E   ] =  4,
+  [ORA_H   ] =  4,
+  [ORA_L   ] =  4,
+  [ORA_M   ] =  7,
+  [ORA_A   ] =  4,
+  [CMP_B   ] =  4,
+  [CMP_C   ] =  4,
+  [CMP_D   ] =  4,
+  [CMP_E   ] =  4,
+  [CMP_H   ] =  4,
+  [CMP_L   ] =  4,
+  [CMP_M   ] =  7,
+  [CMP_A   ] =  4,
+  [RNZ     ] =  5,
+  [POP_B   ] = 10,
+  [JNZ     ] = 10,
+  [JMP     ] = 10,
+  [CNZ     ] = 11,
+  [PUSH_B  ] = 11,
+  [ADI     ] =  7,
+  [RST_0   ] = 11,
+  [RZ      ] =  5,
+  [RET     ] = 10,
+  [JZ      ] = 10,
+  [RSTV    ] =  4,
+  [CZ      ] = 11,
+  [CALL    ] = 17,
+  [ACI     ] =  7,
+  [RST_1   ] = 11,
+  [RNC     ] =  5,
+  [POP_D   ] = 10,
+  [JNC     ] = 10,
+  [OUT     ] = 10,
+  [CNC     ] = 11,
+  [PUSH_D  ] = 11,
+  [SUI     ] =  7,
+  [RST_2   ] = 11,
+  [RC      ] =  5,
+  [SHLX    ] =  4,
+  [JC      ] = 10,
+  [IN      ] = 10,
+  [CC      ] = 11,
+  [JNUI    ] =  4,
+  [SBI     ] =  7,
+  [RST_3   ] = 11,
+  [RPO     ] =  5,
+  [POP_H   ] = 10,
+  [JPO     ] = 10,
+  [XTHL    ] = 18,
+  [CPO     ] = 11,
+  [PUSH_H  ] = 11,
+  [ANI     ] =  7,
+  [RST_4   ] = 11,
+  [RPE     ] =  5,
+  [PCHL    ] =  5,
+  [JPE     ] = 10,
+  [XCHG    ] =  4,
+  [CPE     ] = 11,
+  [LHLX    ] =  4,
+  [XRI     ] =  7,
+  [RST_5   ] = 11,
+  [RP      ] =  5,
+  [POP_PSW ] = 10,
+  [JP      ] = 10,
+  [DI      ] =  4,
+  [CP      ] = 11,
+  [PUSH_PSW] = 11,
+  [ORI     ] =  7,
+  [RST_6   ] = 11,
+  [RM      ] =  5,
+  [SPHL    ] =  5,
+  [JM      ] = 10,
+  [EI      ] =  4,
+  [CM      ] = 11,
+  [JUI     ] =  4,
+  [CPI     ] =  7,
+  [RST_7   ] = 11,
+};
+
+/* Operand bytes following each opcode */
+static const uint8_t operand_bytes[256] = {
+        [LXI_B] = 2, [LXI_D] = 2, [LXI_H] = 2, [LXI_SP] = 2,
+        [SHLD] = 2, [LHLD] = 2, [STA] = 2, [LDA] = 2,
+        [JNZ] = 2, [JZ] = 2, [JNC] = 2, [JC] = 2, [JPO] = 2, [JPE] = 2, [JP] = 2, [JM] = 2, [JMP] = 2,
+        [CNZ] = 2, [CZ] = 2, [CNC] = 2, [CC] = 2, [CPO] = 2, [CPE] = 2, [CP] = 2, [CM] = 2, [CALL] = 2,
+        [MVI_B] = 1, [MVI_C] = 1, [MVI_D] = 1, [MVI_E] = 1,
+        [MVI_H] = 1, [MVI_L] = 1, [MVI_M] = 1, [MVI_A] = 1,
+        [ADI] = 1, [ACI] = 1, [SUI] = 1, [SBI] = 1, [ANI] = 1, [XRI] = 1, [ORI] = 1, [CPI] = 1,
+        [IN] = 1, [OUT] = 1,
+};
+#endif
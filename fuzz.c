@@ -0,0 +1,457 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+
+/* An input is the registers, then a program to run from FUZZ_PC */
+#define FUZZ_HEADER 10          /* B C D E H L A PSW SPL SPH */
+#define FUZZ_PC 0x0100
+#define FUZZ_MAX_INPUT 512
+#define FUZZ_STEPS 256          /* instructions per input at most */
+#define FUZZ_BINS (256 * 32)    /* opcode by the S Z AC P CY it leaves */
+#define FUZZ_CORPUS 4096        /* inputs kept by the driver */
+#define FUZZ_SEED_INPUTS 16
+
+#define F_S 0x80
+#define F_Z 0x40
+#define F_AC 0x10
+#define F_P 0x04
+#define F_CY 0x01
+#define F_ONE 0x02              /* always set in the flag byte */
+
+#define REG_M 6
+#define REG_A 7
+
+/* Under libFuzzer these count as coverage on top of the code's own edges */
+#ifdef EMU8080_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+static uint8_t coverage[FUZZ_BINS];
+static size_t covered;          /* bins hit at least once */
+
+static struct CPU *cpu;
+static struct Snapshot *base;
+
+/* B C D E H L M A as opcodes number them, and the flags */
+struct Regs {
+    uint8_t r[8];
+    uint8_t psw;
+    uint16_t hl, sp;
+};
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+/* One machine for every input: memory is filled with noise once, so jumps
+ * land on code and M reads something, and each input starts from a
+ * snapshot of it. Restoring copies back only the pages the last input
+ * wrote. */
+static int setup(void)
+{
+    if (!(cpu = cpu_create()))
+        return -1;
+    uint64_t state = 0x8080;
+    for (size_t i = 0; i < MEM_SIZE; i += 8) {
+        uint64_t bits = next_random(&state);
+        memcpy(cpu->memory + i, &bits, 8);
+    }
+    cpu_invalidate(cpu);
+    return (base = cpu_snapshot(cpu)) ? 0 : -1;
+}
+
+static void capture(struct Regs *regs)
+{
+    regs->r[0] = cpu->regs.b;
+    regs->r[1] = cpu->regs.c;
+    regs->r[2] = cpu->regs.d;
+    regs->r[3] = cpu->regs.e;
+    regs->r[4] = cpu->regs.h;
+    regs->r[5] = cpu->regs.l;
+    regs->r[REG_M] = cpu->memory[cpu->regs.hl];
+    regs->r[REG_A] = cpu->regs.a;
+    regs->psw = cpu_get_psw(cpu);
+    regs->hl = cpu->regs.hl;
+    regs->sp = cpu->regs.sp;
+}
+
+/* Sign, zero and even parity of a result, bit by bit */
+static uint8_t szp(uint8_t result)
+{
+    bool even = true;
+    for (unsigned bit = 0; bit < 8; ++bit)
+        even ^= result >> bit & 1;
+    return (result & 0x80 ? F_S : 0) | (result ? 0 : F_Z) | (even ? F_P : 0) | F_ONE;
+}
+
+/* What op does to the registers and flags, worked out from the 8080
+ * manual one flag at a time rather than from the tables the core uses.
+ * Returns a mask of the r[] it predicts, always with the flags, or -1
+ * when the flags come from memory. */
+static int reference(uint8_t op, uint8_t imm, const struct Regs *in, struct Regs *out)
+{
+    *out = *in;
+    bool cy = in->psw & F_CY, ac = in->psw & F_AC;
+    uint8_t a = in->r[REG_A];
+    const int all = 0xFF & ~(1 << REG_M);
+    if ((op >= ADD_B && op <= CMP_A) || (op & 0xC7) == ADI) {
+        uint8_t v = op >= ADI ? imm : in->r[op & 7];
+        unsigned kind = op >> 3 & 7, result;
+        switch (kind) {
+            case 0:             /* ADD, ADI */
+            case 1:             /* ADC, ACI */
+                cy = kind == 1 && cy;
+                result = a + v + cy;
+                ac = (a & 0x0F) + (v & 0x0F) + cy > 0x0F;
+                cy = result > 0xFF;
+                break;
+            case 4:             /* ANA, ANI: aux carry is bit 3 of either */
+                result = a & v;
+                ac = (a | v) & 0x08;
+                cy = false;
+                break;
+            case 5:             /* XRA, XRI */
+                result = a ^ v;
+                ac = cy = false;
+                break;
+            case 6:             /* ORA, ORI */
+                result = a | v;
+                ac = cy = false;
+                break;
+            default:            /* SUB, SBB, CMP and their immediates */
+                cy = kind == 3 && cy;
+                result = a - v - cy;
+                /* the carry adding the complement gives, as the chip does it */
+                ac = (a & 0x0F) + (~v & 0x0F) + !cy > 0x0F;
+                cy = a < v + cy;
+                break;
+        }
+        if (kind != 7)
+            out->r[REG_A] = result;
+        out->psw = szp(result) | (ac ? F_AC : 0) | (cy ? F_CY : 0);
+        return all;
+    }
+    if ((op & 0xC7) == INR_B || (op & 0xC7) == DCR_B) {
+        unsigned reg = op >> 3 & 7;
+        bool inr = (op & 0xC7) == INR_B;
+        uint8_t result = in->r[reg] + (inr ? 1 : -1);
+        out->r[reg] = result;
+        ac = inr ? (result & 0x0F) == 0 : (result & 0x0F) != 0x0F;
+        out->psw = szp(result) | (ac ? F_AC : 0) | (cy ? F_CY : 0);
+        return reg == REG_M ? all | 1 << REG_M : all;
+    }
+    switch (op) {
+        case DAA: {
+            /* low digit first, then the high digit of what that gave */
+            unsigned low = (a & 0x0F) > 9 || ac ? 0x06 : 0;
+            unsigned result = a + low;
+            ac = (a & 0x0F) + low > 0x0F;
+            if (result >> 4 > 9 || cy) {
+                result += 0x60;
+                cy = true;
+            }
+            out->r[REG_A] = result;
+            out->psw = szp(result) | (ac ? F_AC : 0) | (cy ? F_CY : 0);
+            return all;
+        }
+        case RLC:
+            cy = a & 0x80;
+            out->r[REG_A] = a << 1 | cy;
+            break;
+        case RRC:
+            cy = a & 0x01;
+            out->r[REG_A] = a >> 1 | cy << 7;
+            break;
+        case RAL:
+            out->r[REG_A] = a << 1 | cy;
+            cy = a & 0x80;
+            break;
+        case RAR:
+            out->r[REG_A] = a >> 1 | cy << 7;
+            cy = a & 0x01;
+            break;
+        case STC:
+            cy = true;
+            break;
+        case CMC:
+            cy = !cy;
+            break;
+        case CMA:
+            out->r[REG_A] = ~a;
+            return all;
+        case DAD_B:
+        case DAD_D:
+        case DAD_H:
+        case DAD_SP: {
+            unsigned rp = op == DAD_B ? in->r[0] << 8 | in->r[1] :
+                          op == DAD_D ? in->r[2] << 8 | in->r[3] :
+                          op == DAD_H ? in->hl : in->sp;
+            unsigned result = in->hl + rp;
+            out->r[4] = result >> 8;
+            out->r[5] = (uint8_t) result;
+            out->psw = (in->psw & ~F_CY) | (result > 0xFFFF ? F_CY : 0);
+            return all;
+        }
+        case POP_PSW:
+            return -1;
+        default:
+            /* nothing else touches the flags */
+            return 0;
+    }
+    out->psw = (in->psw & ~F_CY) | (cy ? F_CY : 0);
+    return all;
+}
+
+static void print_regs(FILE *out, const char *label, const struct Regs *regs)
+{
+    fprintf(out, "  %-9s a %02x psw %02x b %02x c %02x d %02x e %02x h %02x l %02x m %02x\n",
+            label, regs->r[REG_A], regs->psw, regs->r[0], regs->r[1], regs->r[2], regs->r[3],
+            regs->r[4], regs->r[5], regs->r[REG_M]);
+}
+
+/* Run one input, telling out about the first instruction the core and the
+ * reference disagree on. Returns whether they agreed throughout. */
+static bool fuzz_one(const uint8_t *data, size_t size, FILE *out)
+{
+    uint8_t header[FUZZ_HEADER] = {0};
+    memcpy(header, data, size < FUZZ_HEADER ? size : FUZZ_HEADER);
+    cpu_restore(cpu, base);
+    cpu->regs.b = header[0];
+    cpu->regs.c = header[1];
+    cpu->regs.d = header[2];
+    cpu->regs.e = header[3];
+    cpu->regs.h = header[4];
+    cpu->regs.l = header[5];
+    cpu->regs.a = header[6];
+    cpu_set_psw(cpu, header[7]);
+    cpu->regs.sp = header[8] | header[9] << 8;
+    cpu->regs.pc = FUZZ_PC;
+    for (size_t i = FUZZ_HEADER; i < size && i < FUZZ_MAX_INPUT; ++i)
+        write_byte(cpu, FUZZ_PC + i - FUZZ_HEADER, data[i]);
+
+    for (unsigned step = 0; step < FUZZ_STEPS; ++step) {
+        struct Regs before, after, want;
+        uint16_t pc = cpu->regs.pc;
+        uint8_t op = cpu->memory[pc], imm = cpu->memory[(uint16_t) (pc + 1)];
+        capture(&before);
+        int ret = instruction(cpu, read_next_byte(cpu));
+        capture(&after);
+        unsigned flags = (after.psw >> 3 & 0x18) | (after.psw >> 2 & 0x04) |
+                         (after.psw & F_P) >> 1 | (after.psw & F_CY);
+        uint8_t *bin = &coverage[op * 32 + flags];
+        if (!*bin)
+            ++covered;
+        if (*bin != 0xFF)
+            ++*bin;
+        int mask = reference(op, imm, &before, &want);
+        bool same = mask < 0 || want.psw == after.psw;
+        for (unsigned reg = 0; reg < 8; ++reg)
+            if (mask > 0 && mask >> reg & 1 && want.r[reg] != after.r[reg])
+                same = false;
+        if (!same) {
+            fprintf(out, "mismatch at step %u, pc %04x, opcode %02x %02x\n", step, pc, op, imm);
+            print_regs(out, "before", &before);
+            print_regs(out, "expected", &want);
+            print_regs(out, "got", &after);
+            return false;
+        }
+        if (ret == EXIT_HLT)
+            break;
+    }
+    return true;
+}
+
+#ifdef EMU8080_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (!cpu && setup()) {
+        perror("setup");
+        abort();
+    }
+    /* libFuzzer keeps the input that crashed */
+    if (!fuzz_one(data, size, stderr))
+        abort();
+    return 0;
+}
+#else
+struct Input {
+    size_t size;
+    uint8_t data[FUZZ_MAX_INPUT];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_input(struct Input *input, uint64_t *state)
+{
+    input->size = FUZZ_HEADER + next_random(state) % 64;
+    for (size_t i = 0; i < input->size; ++i)
+        input->data[i] = next_random(state);
+}
+
+/* A few byte-level changes, or a splice with another input */
+static void mutate(struct Input *input, const struct Input *other, uint64_t *state)
+{
+    unsigned changes = 1 + next_random(state) % 4;
+    for (unsigned i = 0; i < changes; ++i) {
+        size_t at = next_random(state) % input->size;
+        switch (next_random(state) % 6) {
+            case 0:
+                input->data[at] ^= 1 << next_random(state) % 8;
+                break;
+            case 1:
+            case 2:
+                input->data[at] = next_random(state);
+                break;
+            case 3:
+                if (input->size < FUZZ_MAX_INPUT) {
+                    memmove(input->data + at + 1, input->data + at, input->size++ - at);
+                    input->data[at] = next_random(state);
+                }
+                break;
+            case 4:
+                if (input->size > FUZZ_HEADER + 1) {
+                    memmove(input->data + at, input->data + at + 1, input->size - at - 1);
+                    --input->size;
+                }
+                break;
+            default: {
+                size_t len = other->size - at % other->size;
+                if (at + len > FUZZ_MAX_INPUT)
+                    len = FUZZ_MAX_INPUT - at;
+                memcpy(input->data + at, other->data + at % other->size, len);
+                if (at + len > input->size)
+                    input->size = at + len;
+                break;
+            }
+        }
+    }
+}
+
+static int save_crash(const struct Input *input, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(input->data, 1, input->size, file) != input->size ||
+        fclose(file) == EOF) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_coverage(FILE *out, uint64_t execs, double seconds, size_t ncorpus)
+{
+    fprintf(out, "%llu execs, %.0f/s, %zu of %d opcode and flag bins, %zu inputs kept\n",
+            (unsigned long long) execs, execs / seconds, covered, FUZZ_BINS, ncorpus);
+}
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-n runs] [-s seed] [-o crash] [input...]\n"
+                    "  with inputs, run each of them once\n", program_name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program_name = argv[0], *crash = "fuzz-crash";
+    double seconds = 10.0;
+    uint64_t runs = 0, seed = 1;
+    int c;
+    while ((c = getopt(argc, argv, "ht:n:s:o:")) != -1) {
+        switch (c) {
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'n':
+                runs = strtoull(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'o':
+                crash = optarg;
+                break;
+            default:
+                usage(program_name);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (setup()) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+
+    /* inputs saved from an earlier run, or by libFuzzer */
+    if (optind < argc) {
+        int status = EXIT_SUCCESS;
+        for (int argind = optind; argind < argc; ++argind) {
+            struct Input input;
+            FILE *file = fopen(argv[argind], "rb");
+            if (!file) {
+                perror(argv[argind]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            input.size = fread(input.data, 1, sizeof(input.data), file);
+            fclose(file);
+            printf("%s\n", argv[argind]);
+            if (!fuzz_one(input.data, input.size, stdout))
+                status = EXIT_FAILURE;
+        }
+        return status;
+    }
+
+    /* keep whatever reaches a bin nothing reached before, and mutate that */
+    struct Input *corpus = malloc(FUZZ_CORPUS * sizeof(*corpus));
+    if (!corpus) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    uint64_t state = seed ? seed : 1, execs = 0;
+    size_t ncorpus = 0;
+    for (; ncorpus < FUZZ_SEED_INPUTS; ++ncorpus)
+        random_input(&corpus[ncorpus], &state);
+    double start = now(), last = start, elapsed = 0;
+    int status = EXIT_SUCCESS;
+    while (runs ? execs < runs : elapsed < seconds) {
+        struct Input input = corpus[next_random(&state) % ncorpus];
+        mutate(&input, &corpus[next_random(&state) % ncorpus], &state);
+        size_t before = covered;
+        ++execs;
+        if (!fuzz_one(input.data, input.size, stdout)) {
+            if (!save_crash(&input, crash))
+                printf("input written to %s\n", crash);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (covered > before)
+            corpus[ncorpus < FUZZ_CORPUS ? ncorpus++ : next_random(&state) % FUZZ_CORPUS] = input;
+        /* the clock is not read every time */
+        if (!(execs & 0xFFF)) {
+            double t = now();
+            elapsed = t - start;
+            if (t - last >= 1.0) {
+                last = t;
+                print_coverage(stdout, execs, elapsed, ncorpus);
+            }
+        }
+    }
+    print_coverage(stdout, execs, now() - start, ncorpus);
+    free(corpus);
+    cpu_free_snapshot(base);
+    cpu_destroy(cpu);
+    return status;
+}
+#endif
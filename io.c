@@ -1,38 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "io.h"
 
-extern size_t load_rom(unsigned char *bufptr, size_t buflen, const char *filename)
+#define ROM_DIR "roms/"
+
+static size_t page_round(size_t size)
 {
-    /* get true path */
-    const char *base = "./roms/";
-    const size_t len = snprintf(NULL, 0, "%s%s", base, filename) + 1;
-    char *path = malloc(len);
-    snprintf(path, len, "%s%s", base, filename);
+    return (size + MEM_PAGE_SIZE - 1) & ~(size_t) (MEM_PAGE_SIZE - 1);
+}
 
-    FILE *file = fopen(path, "r");
+/* Open path, or roms/path for a bare name that is not found */
+static int open_image(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd != -1 || errno != ENOENT || strchr(path, '/'))
+        return fd;
+    char fallback[sizeof(ROM_DIR) + strlen(path)];
+    snprintf(fallback, sizeof(fallback), "%s%s", ROM_DIR, path);
+    fd = open(fallback, O_RDONLY);
+    if (fd == -1)
+        errno = ENOENT;
+    return fd;
+}
 
-    free(path);
-    if (!file) {
-        perror("fopen");
-        return 0;
+static bool is_hex(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot && (!strcasecmp(dot, ".hex") || !strcasecmp(dot, ".ihx"));
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_byte(const char *p)
+{
+    int hi = hex_digit(p[0]), lo = hi < 0 ? -1 : hex_digit(p[1]);
+    return lo < 0 ? -1 : hi << 4 | lo;
+}
+
+static bool is_defined(const struct Image *image, unsigned addr)
+{
+    return image->defined[addr >> 3] & 1 << (addr & 7);
+}
+
+/* Whether any record gives a byte of page */
+static bool page_defined(const struct Image *image, unsigned page)
+{
+    const uint8_t *bits = image->defined + page * (MEM_PAGE_SIZE / 8);
+    for (unsigned i = 0; i < MEM_PAGE_SIZE / 8; ++i)
+        if (bits[i])
+            return true;
+    return false;
+}
+
+/* Decode the records of text into a zeroed 64 KiB buffer, noting each
+ * address written and the lowest and highest */
+static bool decode_hex(struct Image *image, const char *text, size_t len, const char *path)
+{
+    uint8_t *buffer = calloc(MEM_SIZE + MEM_PAGE_SIZE, 1);
+    if (!buffer || !(image->defined = calloc(MEM_SIZE / 8, 1))) {
+        perror("calloc");
+        free(buffer);
+        return false;
     }
+    size_t lo = MEM_SIZE, hi = 0;
+    unsigned lineno = 0;
+    const char *end = text + len;
+    for (const char *p = text; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        ++lineno;
+        size_t n = eol - p;
+        while (n && (p[n - 1] == '\r' || p[n - 1] == ' '))
+            --n;
+        if (!n) {
+            p = eol + 1;
+            continue;
+        }
+        uint8_t record[5 + 255];
+        size_t nbytes = (n - 1) / 2;
+        bool ok = p[0] == ':' && n % 2 && nbytes >= 5;
+        uint8_t sum = 0;
+        for (size_t i = 0; ok && i < nbytes; ++i) {
+            int b = hex_byte(p + 1 + 2 * i);
+            ok = b >= 0 && i < sizeof(record);
+            if (ok)
+                sum += record[i] = b;
+        }
+        if (!ok || nbytes != 5u + record[0] || sum) {
+            fprintf(stderr, "%s:%u: bad HEX record\n", path, lineno);
+            free(buffer);
+            return false;
+        }
+        unsigned count = record[0], addr = record[1] << 8 | record[2], type = record[3];
+        if (type == 0x01)
+            break;
+        if (type == 0x00) {
+            if (addr + count > MEM_SIZE) {
+                fprintf(stderr, "%s:%u: record runs past 0xFFFF\n", path, lineno);
+                free(buffer);
+                return false;
+            }
+            memcpy(buffer + addr, record + 4, count);
+            for (unsigned i = addr; i < addr + count; ++i)
+                image->defined[i >> 3] |= 1 << (i & 7);
+            if (count && addr < lo)
+                lo = addr;
+            if (addr + count > hi)
+                hi = addr + count;
+        } else if ((type == 0x02 || type == 0x04) && (record[4] || record[5])) {
+            /* segments and linear bases only matter beyond 64 KiB */
+            fprintf(stderr, "%s:%u: address beyond 64 KiB\n", path, lineno);
+            free(buffer);
+            return false;
+        }
+        p = eol + 1;
+    }
+    if (lo >= hi)
+        lo = hi = 0;
+    image->data = buffer + lo;
+    image->size = hi - lo;
+    image->addr = lo;
+    image->hex = true;
+    return true;
+}
 
-    if (fseek(file, 0L, SEEK_END) == EOF) {
-        perror("fseek");
-        fclose(file);
-        return 0;
+struct Image *image_open(const char *path)
+{
+    int fd = open_image(path);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    struct Image *image = calloc(1, sizeof(*image));
+    if (!image) {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    image->map_size = st.st_size;
+    /* the mapping is zero-filled to the end of the last host page, which
+     * covers the rounding to MEM_PAGE_SIZE */
+    image->map = image->map_size ? mmap(NULL, image->map_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    image->fd = -1;
+    if (image->map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        free(image);
+        return NULL;
+    }
+    if (is_hex(path)) {
+        bool ok = decode_hex(image, image->map, image->map_size, path);
+        if (image->map)
+            munmap(image->map, image->map_size);
+        image->map = NULL;
+        close(fd);
+        if (!ok) {
+            free(image->defined);
+            free(image);
+            return NULL;
+        }
+    } else {
+        image->data = image->map;
+        image->size = image->map_size;
+        image->fd = fd;
+    }
+    return image;
+}
+
+void image_close(struct Image *image)
+{
+    if (!image)
+        return;
+    if (image->fd != -1)
+        close(image->fd);
+    if (image->map)
+        munmap(image->map, image->map_size);
+    else if (image->hex)
+        free((uint8_t *) image->data - image->addr);
+    free(image->defined);
+    free(image);
+}
+
+/* Copy only the bytes records give, so that gaps keep what was there */
+static int load_hex(struct CPU *cpu, const struct Image *image)
+{
+    const uint8_t *data = image->data - image->addr;
+    size_t end = image->addr + image->size;
+    for (size_t page = image->addr >> MEM_PAGE_SHIFT; page < page_round(end) >> MEM_PAGE_SHIFT; ++page) {
+        if ((cpu->page_flags[page] & (PAGE_ROM | PAGE_IO)) && page_defined(image, page)) {
+            fprintf(stderr, "HEX records at 0x%04zx would overwrite ROM or a device\n",
+                    page << MEM_PAGE_SHIFT);
+            return -1;
+        }
+    }
+    for (size_t addr = image->addr; addr < end; ++addr)
+        if (is_defined(image, addr))
+            cpu->memory[addr] = data[addr];
+    cpu_invalidate(cpu);
+    return (int) end;
+}
+
+int image_load(struct CPU *cpu, const struct Image *image, size_t offset)
+{
+    if (image->hex)
+        return load_hex(cpu, image);
+    if (offset > MEM_SIZE || image->size > MEM_SIZE - offset) {
+        fprintf(stderr, "image of %zu bytes does not fit at 0x%04zx\n", image->size, offset);
+        return -1;
+    }
+    for (size_t page = offset >> MEM_PAGE_SHIFT; page < page_round(offset + image->size) >> MEM_PAGE_SHIFT; ++page) {
+        if (cpu->page_flags[page] & (PAGE_ROM | PAGE_IO)) {
+            fprintf(stderr, "image at 0x%04zx would overwrite ROM or a device\n", offset);
+            return -1;
+        }
     }
-    const size_t bytes_read = ftell(file);
-    if (bytes_read >= buflen) {
-        fprintf(stderr, "file size %lu is bigger than the buffer\n", bytes_read);
-        return EXIT_FAILURE;
+    if (image->size) {
+        memcpy(cpu->memory + offset, image->data, image->size);
+        cpu_invalidate(cpu);
     }
-    rewind(file);
+    return (int) (offset + image->size);
+}
 
-    if (!fread(bufptr, bytes_read, 1, file)) {
-        perror("fread");
-        fclose(file);
+int image_map_rom(struct CPU *cpu, const struct Image *image, uint16_t addr)
+{
+    if (image->hex) {
+        /* each run of pages that records give bytes of */
+        const uint8_t *data = image->data - image->addr;
+        size_t end = page_round(image->addr + image->size) >> MEM_PAGE_SHIFT;
+        for (size_t page = image->addr >> MEM_PAGE_SHIFT; page < end; ++page) {
+            size_t first = page;
+            while (page < end && page_defined(image, page))
+                ++page;
+            if (page > first && cpu_map_rom(cpu, first << MEM_PAGE_SHIFT, (page - first) << MEM_PAGE_SHIFT,
+                                            data + (first << MEM_PAGE_SHIFT)))
+                return -1;
+        }
         return 0;
     }
-    fclose(file);
-    return bytes_read;
-}
\ No newline at end of file
+    size_t host_page = sysconf(_SC_PAGESIZE), shared = 0;
+    if (image->fd != -1 && !(addr % host_page) && addr + page_round(image->size) <= MEM_SIZE) {
+        /* the last host page is shared only if the image fills it */
+        shared = image->size - image->size % host_page;
+        if (cpu_share_rom(cpu, addr, shared, image->data, image->fd, 0))
+            shared = 0;
+    }
+    return cpu_map_rom(cpu, addr + shared, page_round(image->size - shared), image->data + shared);
+}
@@ -1,7 +1,39 @@
 #ifndef EMU8080_IOH
 #define EMU8080_IOH
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-extern size_t load_rom(unsigned char *bufptr, size_t buflen, const char *filename);
-#endif
\ No newline at end of file
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* A program image. Raw binaries are mapped from the file and used in place;
+ * Intel HEX is decoded once. Either way data can be read up to size rounded
+ * up to MEM_PAGE_SIZE, zero-padded, so it can be mapped as ROM. A HEX image
+ * spans its lowest to its highest record, and only the bytes records give
+ * are loaded or mapped. */
+struct Image {
+    const uint8_t *data;
+    size_t size;
+    uint16_t addr;      /* where a HEX image starts; raw ones go anywhere */
+    bool hex;
+    uint8_t *defined;   /* one bit per address a HEX record gives */
+    void *map;          /* the mapped file, if raw */
+    size_t map_size;
+    int fd;             /* the file, if raw, so its pages can be shared */
+};
+
+/* Files ending in .hex or .ihx are Intel HEX. A bare name that does not
+ * exist is also looked for under roms/. */
+extern struct Image *image_open(const char *path);
+extern void image_close(struct Image *image);
+/* Copy a raw image to offset, or the records of a HEX image to their own
+ * addresses, leaving the gaps between them alone. Returns the address just
+ * past the last byte, or -1 if it does not fit or would land on ROM or a
+ * device. */
+extern int image_load(struct CPU *cpu, const struct Image *image, size_t offset);
+/* Map an image as ROM at addr, which must fall on a page boundary, or each
+ * page a HEX record gives bytes of at its own address; pages no record
+ * touches are left as they were, and bytes of a mapped page no record gives
+ * read as 0. Whole host pages of a raw image are shared by every machine
+ * that maps it; the rest is copied. The image must stay open while mapped. */
+extern int image_map_rom(struct CPU *cpu, const struct Image *image, uint16_t addr);
+#endif
@@ -0,0 +1,990 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "alu.h"
+#include "cycles.h"
+#include "jit.h"
+
+#if defined(EMU8080_JIT) && defined(__x86_64__)
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (1 << 20)
+#define JIT_BLOCK_BYTES 16384   /* room needed to compile one more block */
+#define JIT_HOT 16              /* branches to an address before it is compiled */
+#define JIT_MAX_INSTRUCTIONS 48
+#define JIT_COLD UINT16_MAX     /* heat of an address that cannot be compiled */
+
+/* x86-64 registers as encoded in ModRM */
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+struct Emitter {
+    uint8_t *p;
+};
+
+/* Offsets into struct CPU of the 8080 registers, in the order they are
+ * encoded in opcodes; M (6) is memory at HL and has no offset */
+static const size_t reg8[8] = {
+        offsetof(struct CPU, regs.b), offsetof(struct CPU, regs.c),
+        offsetof(struct CPU, regs.d), offsetof(struct CPU, regs.e),
+        offsetof(struct CPU, regs.h), offsetof(struct CPU, regs.l),
+        0, offsetof(struct CPU, regs.a),
+};
+static const size_t reg16[4] = {
+        offsetof(struct CPU, regs.bc), offsetof(struct CPU, regs.de),
+        offsetof(struct CPU, regs.hl), offsetof(struct CPU, regs.sp),
+};
+#define OFF_A      offsetof(struct CPU, regs.a)
+#define OFF_L      offsetof(struct CPU, regs.l)
+#define OFF_H      offsetof(struct CPU, regs.h)
+#define OFF_HL     offsetof(struct CPU, regs.hl)
+#define OFF_DE     offsetof(struct CPU, regs.de)
+#define OFF_SP     offsetof(struct CPU, regs.sp)
+#define OFF_PC     offsetof(struct CPU, regs.pc)
+#define OFF_CYCLES offsetof(struct CPU, cycles)
+#define OFF_INSTR  offsetof(struct CPU, instructions)
+#define OFF_PAGE_FLAGS offsetof(struct CPU, page_flags)
+#define OFF_PENDING offsetof(struct CPU, interrupt_pending)
+#define OFF_ENABLED offsetof(struct CPU, interrupt_enabled)
+#define OFF_BREAKPOINTS offsetof(struct CPU, breakpoints)
+#define OFF_LOCKSTEP offsetof(struct CPU, lockstep)
+#define OFF_MEMORY offsetof(struct CPU, memory)
+#define REG_M 6
+
+static void emit8(struct Emitter *e, uint8_t v)
+{
+    *e->p++ = v;
+}
+
+static void emit16(struct Emitter *e, uint16_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+static void emit32(struct Emitter *e, uint32_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+static void emit64(struct Emitter *e, uint64_t v)
+{
+    memcpy(e->p, &v, sizeof(v));
+    e->p += sizeof(v);
+}
+
+/* ModRM for [rbx + disp32] */
+static void at_cpu(struct Emitter *e, unsigned reg, size_t off)
+{
+    emit8(e, 0x83 | reg << 3);
+    emit32(e, (uint32_t) off);
+}
+
+/* ModRM and SIB for [rbx + rcx + disp32] */
+static void at_cpu_rcx(struct Emitter *e, unsigned reg, size_t off)
+{
+    emit8(e, 0x84 | reg << 3);
+    emit8(e, 0x0B);
+    emit32(e, (uint32_t) off);
+}
+
+/* movzx reg, byte [rbx + off] */
+static void load8(struct Emitter *e, unsigned reg, size_t off)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    at_cpu(e, reg, off);
+}
+
+/* movzx reg, word [rbx + off] */
+static void load16(struct Emitter *e, unsigned reg, size_t off)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    at_cpu(e, reg, off);
+}
+
+/* mov byte [rbx + off], al */
+static void store8(struct Emitter *e, size_t off)
+{
+    emit8(e, 0x88);
+    at_cpu(e, EAX, off);
+}
+
+/* mov word [rbx + off], ax */
+static void store16(struct Emitter *e, size_t off)
+{
+    emit8(e, 0x66);
+    emit8(e, 0x89);
+    at_cpu(e, EAX, off);
+}
+
+static void store8_imm(struct Emitter *e, size_t off, uint8_t v)
+{
+    emit8(e, 0xC6);
+    at_cpu(e, 0, off);
+    emit8(e, v);
+}
+
+static void store16_imm(struct Emitter *e, size_t off, uint16_t v)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    at_cpu(e, 0, off);
+    emit16(e, v);
+}
+
+static void mov_imm(struct Emitter *e, unsigned reg, uint32_t v)
+{
+    emit8(e, 0xB8 + reg);
+    emit32(e, v);
+}
+
+/* add qword [rbx + off], imm32 */
+static void add64_imm(struct Emitter *e, size_t off, uint32_t v)
+{
+    if (!v)
+        return;
+    emit8(e, 0x48);
+    emit8(e, 0x81);
+    at_cpu(e, 0, off);
+    emit32(e, v);
+}
+
+/* mov rdi, rbx; mov rax, fn; call rax */
+static void call(struct Emitter *e, void *fn)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0xDF);
+    emit8(e, 0x48);
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t) (uintptr_t) fn);
+    emit8(e, 0xFF);
+    emit8(e, 0xD0);
+}
+
+/* jcc rel32 with the target patched in later; 0x84 is je, 0x85 jne */
+static uint8_t *jump_if(struct Emitter *e, uint8_t cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, cc);
+    emit32(e, 0);
+    return e->p;
+}
+
+/* jmp rel32 with the target patched in later */
+static uint8_t *jump(struct Emitter *e)
+{
+    emit8(e, 0xE9);
+    emit32(e, 0);
+    return e->p;
+}
+
+static void land(struct Emitter *e, uint8_t *from)
+{
+    uint32_t rel = (uint32_t) (e->p - from);
+    memcpy(from - 4, &rel, sizeof(rel));
+}
+
+/* The guest byte at address ecx into reg. Clobbers ecx and edx; device
+ * pages go through read_byte(). */
+static void load_guest(struct Emitter *e, unsigned reg)
+{
+    emit8(e, 0x89);     /* mov edx, ecx */
+    emit8(e, 0xCA);
+    emit8(e, 0xC1);     /* shr edx, 8 */
+    emit8(e, 0xEA);
+    emit8(e, 0x08);
+    emit8(e, 0xF6);     /* test byte [rbx + rdx + page_flags], PAGE_IO */
+    emit8(e, 0x84);
+    emit8(e, 0x13);
+    emit32(e, (uint32_t) OFF_PAGE_FLAGS);
+    emit8(e, PAGE_IO);
+    uint8_t *slow = jump_if(e, 0x85);
+    emit8(e, 0x0F);     /* movzx reg, byte [rbx + rcx + memory] */
+    emit8(e, 0xB6);
+    at_cpu_rcx(e, reg, OFF_MEMORY);
+    uint8_t *done = jump(e);
+    land(e, slow);
+    emit8(e, 0x89);     /* mov esi, ecx */
+    emit8(e, 0xCE);
+    call(e, (void *) read_byte);
+    if (reg != EAX) {
+        emit8(e, 0x89); /* mov reg, eax */
+        emit8(e, 0xC0 | reg);
+    }
+    land(e, done);
+}
+
+/* Jump to slow unless the word at ecx lies in one page whose flags have
+ * none of mask set. Clobbers edx. */
+static uint8_t *plain_word(struct Emitter *e, uint8_t mask, uint8_t **slow)
+{
+    emit8(e, 0x80);     /* cmp cl, 0xFF */
+    emit8(e, 0xF9);
+    emit8(e, 0xFF);
+    *slow = jump_if(e, 0x84);
+    emit8(e, 0x89);     /* mov edx, ecx */
+    emit8(e, 0xCA);
+    emit8(e, 0xC1);     /* shr edx, 8 */
+    emit8(e, 0xEA);
+    emit8(e, 0x08);
+    emit8(e, 0xF6);     /* test byte [rbx + rdx + page_flags], mask */
+    emit8(e, 0x84);
+    emit8(e, 0x13);
+    emit32(e, (uint32_t) OFF_PAGE_FLAGS);
+    emit8(e, mask);
+    return jump_if(e, 0x85);
+}
+
+/* Push si. Straight to cpu->memory when the stack is in plain RAM with no
+ * compiled code and no write log to keep, otherwise via stack_push(). */
+static void emit_push(struct Emitter *e, struct Jit *jit)
+{
+    uint8_t *slow[4];
+    unsigned n = 3;
+    load16(e, ECX, OFF_SP);
+    emit8(e, 0x83);     /* sub ecx, 2 */
+    emit8(e, 0xE9);
+    emit8(e, 0x02);
+    emit8(e, 0x0F);     /* movzx ecx, cx */
+    emit8(e, 0xB7);
+    emit8(e, 0xC9);
+    slow[1] = plain_word(e, 0xFF, &slow[0]);
+    emit8(e, 0x48);     /* mov rax, jit->compiled */
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t) (uintptr_t) jit->compiled);
+    emit8(e, 0x80);     /* cmp byte [rax + rdx], 0 */
+    emit8(e, 0x3C);
+    emit8(e, 0x10);
+    emit8(e, 0x00);
+    slow[2] = jump_if(e, 0x85);
+#ifdef EMU8080_LOCKSTEP
+    emit8(e, 0x48);     /* cmp qword [rbx + lockstep], 0 */
+    emit8(e, 0x83);
+    at_cpu(e, 7, OFF_LOCKSTEP);
+    emit8(e, 0);
+    slow[n++] = jump_if(e, 0x85);
+#endif
+    emit8(e, 0x66);     /* mov word [rbx + rcx + memory], si */
+    emit8(e, 0x89);
+    at_cpu_rcx(e, ESI, OFF_MEMORY);
+    emit8(e, 0x66);     /* mov word [rbx + sp], cx */
+    emit8(e, 0x89);
+    at_cpu(e, ECX, OFF_SP);
+    uint8_t *done = jump(e);
+    while (n)
+        land(e, slow[--n]);
+    call(e, (void *) stack_push);
+    land(e, done);
+}
+
+/* Pop into eax, straight from cpu->memory unless the stack is on a device
+ * page */
+static void emit_pop(struct Emitter *e)
+{
+    uint8_t *slow[2];
+    load16(e, ECX, OFF_SP);
+    slow[1] = plain_word(e, PAGE_IO, &slow[0]);
+    emit8(e, 0x0F);     /* movzx eax, word [rbx + rcx + memory] */
+    emit8(e, 0xB7);
+    at_cpu_rcx(e, EAX, OFF_MEMORY);
+    emit8(e, 0x83);     /* add ecx, 2 */
+    emit8(e, 0xC1);
+    emit8(e, 0x02);
+    emit8(e, 0x66);     /* mov word [rbx + sp], cx */
+    emit8(e, 0x89);
+    at_cpu(e, ECX, OFF_SP);
+    uint8_t *done = jump(e);
+    land(e, slow[0]);
+    land(e, slow[1]);
+    call(e, (void *) stack_pop);
+    land(e, done);
+}
+
+/* Account for the native instructions so far and return to run() */
+static void emit_return(struct Emitter *e, uint32_t cycles, uint32_t count)
+{
+    add64_imm(e, OFF_CYCLES, cycles);
+    add64_imm(e, OFF_INSTR, count);
+    emit8(e, 0x5B);     /* pop rbx */
+    emit8(e, 0xC3);     /* ret */
+}
+
+static bool at_breakpoint(const struct CPU *cpu, uint16_t addr)
+{
+    return cpu->breakpoints && (cpu->breakpoints[addr >> 3] & (1 << (addr & 7)));
+}
+
+/* Account for the block and go straight on to the compiled block at the
+ * new pc when run_jit() would run it next, otherwise return to run_jit().
+ * The new pc is target, or whatever the block left in cpu->regs.pc if
+ * target is -1. An interrupt or breakpoint that came up meanwhile is left
+ * to run_jit(). */
+static void emit_chain(struct Emitter *e, struct Jit *jit, int32_t target,
+                       uint32_t cycles, uint32_t count)
+{
+    uint8_t *out[8];
+    unsigned n = 0;
+    add64_imm(e, OFF_CYCLES, cycles);
+    add64_imm(e, OFF_INSTR, count);
+    if (!target || (target > 0 && at_breakpoint(jit->cpu, target))) {
+        emit_return(e, 0, 0);
+        return;
+    }
+    emit8(e, 0x80);     /* cmp byte [rbx + interrupt_pending], 0 */
+    at_cpu(e, 7, OFF_PENDING);
+    emit8(e, 0);
+    uint8_t *quiet = jump_if(e, 0x84);
+    emit8(e, 0x80);     /* cmp byte [rbx + interrupt_enabled], 0 */
+    at_cpu(e, 7, OFF_ENABLED);
+    emit8(e, 0);
+    out[n++] = jump_if(e, 0x85);
+    land(e, quiet);
+    emit8(e, 0x48);     /* cmp qword [rbx + breakpoints], 0 */
+    emit8(e, 0x83);
+    at_cpu(e, 7, OFF_BREAKPOINTS);
+    emit8(e, 0);
+    out[n++] = jump_if(e, 0x85);
+    if (target > 0) {
+        emit8(e, 0x48); /* mov rax, [&jit->pages[target >> 8]] */
+        emit8(e, 0xB8);
+        emit64(e, (uint64_t) (uintptr_t) &jit->pages[target >> 8]);
+        emit8(e, 0x48);
+        emit8(e, 0x8B);
+        emit8(e, 0x00);
+        mov_imm(e, ESI, target & 0xFF);
+    } else {
+        load16(e, ESI, OFF_PC);
+        emit8(e, 0x85); /* test esi, esi */
+        emit8(e, 0xF6);
+        out[n++] = jump_if(e, 0x84);
+        emit8(e, 0x89); /* mov eax, esi */
+        emit8(e, 0xF0);
+        emit8(e, 0xC1); /* shr eax, 8 */
+        emit8(e, 0xE8);
+        emit8(e, 0x08);
+        emit8(e, 0x81); /* and esi, 0xFF */
+        emit8(e, 0xE6);
+        emit32(e, 0xFF);
+        emit8(e, 0x48); /* mov rdx, jit->pages */
+        emit8(e, 0xBA);
+        emit64(e, (uint64_t) (uintptr_t) jit->pages);
+        emit8(e, 0x48); /* mov rax, [rdx + rax * 8] */
+        emit8(e, 0x8B);
+        emit8(e, 0x04);
+        emit8(e, 0xC2);
+    }
+    emit8(e, 0x48);     /* test rax, rax */
+    emit8(e, 0x85);
+    emit8(e, 0xC0);
+    out[n++] = jump_if(e, 0x84);
+    emit8(e, 0x48);     /* mov rdx, [rax + rsi * 8 + code] */
+    emit8(e, 0x8B);
+    emit8(e, 0x94);
+    emit8(e, 0xF0);
+    emit32(e, (uint32_t) offsetof(struct JitPage, code));
+    emit8(e, 0x48);     /* test rdx, rdx */
+    emit8(e, 0x85);
+    emit8(e, 0xD2);
+    out[n++] = jump_if(e, 0x84);
+    emit8(e, 0x0F);     /* movzx ecx, word [rax + rsi * 2 + budget] */
+    emit8(e, 0xB7);
+    emit8(e, 0x8C);
+    emit8(e, 0x70);
+    emit32(e, (uint32_t) offsetof(struct JitPage, budget));
+    emit8(e, 0x48);     /* mov rax, [&jit->end] */
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t) (uintptr_t) &jit->end);
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit8(e, 0x00);
+    emit8(e, 0x48);     /* sub rax, [rbx + cycles] */
+    emit8(e, 0x2B);
+    at_cpu(e, EAX, OFF_CYCLES);
+    out[n++] = jump_if(e, 0x86);
+    emit8(e, 0x48);     /* cmp rax, rcx */
+    emit8(e, 0x39);
+    emit8(e, 0xC8);
+    out[n++] = jump_if(e, 0x82);
+    emit8(e, 0x48);     /* mov byte [&jit->dirty], 0 */
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t) (uintptr_t) &jit->dirty);
+    emit8(e, 0xC6);
+    emit8(e, 0x00);
+    emit8(e, 0x00);
+    emit8(e, 0x48);     /* mov rdi, rbx */
+    emit8(e, 0x89);
+    emit8(e, 0xDF);
+    emit8(e, 0x5B);     /* pop rbx */
+    emit8(e, 0xFF);     /* jmp rdx */
+    emit8(e, 0xE2);
+    while (n)
+        land(e, out[--n]);
+    emit_return(e, 0, 0);
+}
+
+/* Leave the block if the last write hit compiled code, which may be this block */
+static void emit_check_dirty(struct Emitter *e, struct Jit *jit, uint16_t next,
+                             uint32_t cycles, uint32_t count)
+{
+    emit8(e, 0x48);
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t) (uintptr_t) &jit->dirty);
+    emit8(e, 0x80);     /* cmp byte [rax], 0 */
+    emit8(e, 0x38);
+    emit8(e, 0x00);
+    uint8_t *clean = jump_if(e, 0x84);
+    store16_imm(e, OFF_PC, next);
+    emit_return(e, cycles, count);
+    land(e, clean);
+}
+
+/* Jump over the taken path unless condition cc holds */
+static uint8_t *emit_condition(struct Emitter *e, unsigned cc)
+{
+    size_t off;
+    uint8_t mask;
+    if (!cpu_condition_flag(cc, &off, &mask)) {
+        mov_imm(e, ESI, cc);
+        call(e, (void *) cpu_condition);
+        emit8(e, 0x84);     /* test al, al */
+        emit8(e, 0xC0);
+        return jump_if(e, 0x84);
+    }
+    emit8(e, 0xF6);     /* test byte [rbx + off], mask */
+    at_cpu(e, 0, off);
+    emit8(e, mask);
+    return jump_if(e, (cc & 1) ? 0x84 : 0x85);
+}
+
+/* write_byte(cpu, esi, edx) */
+static void emit_write(struct Emitter *e)
+{
+    call(e, (void *) write_byte);
+}
+
+#ifdef EMU8080_PACKED_FLAGS
+#define OFF_F offsetof(struct CPU, regs.f)
+
+/* mov rdx, table; movzx edx, byte [rdx + rax] */
+static void flags_from(struct Emitter *e, const uint8_t *table)
+{
+    emit8(e, 0x48);
+    emit8(e, 0xBA);
+    emit64(e, (uint64_t) (uintptr_t) table);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, 0x14);
+    emit8(e, 0x02);
+}
+
+/* ALU operation k (ADD to CMP, as encoded in opcodes) on A and esi, with
+ * the flags from szpc_table as the interpreter sets them */
+static void emit_alu(struct Emitter *e, unsigned k)
+{
+    load8(e, EAX, OFF_A);
+    emit8(e, 0x89);     /* mov ecx, eax */
+    emit8(e, 0xC1);
+    switch (k) {
+        case 0: case 1: case 2: case 3: case 7:
+            if (k == 1 || k == 3) {
+                load8(e, EDX, OFF_F);
+                emit8(e, 0x83); /* and edx, PSW_C */
+                emit8(e, 0xE2);
+                emit8(e, 0x01);
+            }
+            emit8(e, k < 2 ? 0x01 : 0x29);  /* add/sub eax, esi */
+            emit8(e, 0xF0);
+            if (k == 1 || k == 3) {
+                emit8(e, k < 2 ? 0x01 : 0x29); /* add/sub eax, edx */
+                emit8(e, 0xD0);
+            }
+            emit8(e, 0x31);     /* xor ecx, esi */
+            emit8(e, 0xF1);
+            emit8(e, 0x31);     /* xor ecx, eax */
+            emit8(e, 0xC1);
+            if (k >= 2) {
+                emit8(e, 0xF7); /* not ecx */
+                emit8(e, 0xD1);
+            }
+            emit8(e, 0x83);     /* and ecx, PSW_AC */
+            emit8(e, 0xE1);
+            emit8(e, 0x10);
+            emit8(e, 0x25);     /* and eax, 0x1FF */
+            emit32(e, 0x1FF);
+            break;
+        case 4:
+            emit8(e, 0x09);     /* or ecx, esi */
+            emit8(e, 0xF1);
+            emit8(e, 0x83);     /* and ecx, 0x08 */
+            emit8(e, 0xE1);
+            emit8(e, 0x08);
+            emit8(e, 0xD1);     /* shl ecx, 1 */
+            emit8(e, 0xE1);
+            emit8(e, 0x21);     /* and eax, esi */
+            emit8(e, 0xF0);
+            break;
+        default:
+            emit8(e, k == 5 ? 0x31 : 0x09); /* xor/or eax, esi */
+            emit8(e, 0xF0);
+            emit8(e, 0x31);     /* xor ecx, ecx */
+            emit8(e, 0xC9);
+            break;
+    }
+    flags_from(e, szpc_table);
+    emit8(e, 0x09);     /* or edx, ecx */
+    emit8(e, 0xCA);
+    emit8(e, 0x88);     /* mov [rbx + f], dl */
+    at_cpu(e, EDX, OFF_F);
+    if (k != 7)
+        store8(e, OFF_A);
+}
+
+/* INR or DCR of esi into eax, keeping carry */
+static void emit_inr_dcr(struct Emitter *e, bool dcr)
+{
+    emit8(e, 0x8D);     /* lea eax, [rsi + 1] or [rsi - 1] */
+    emit8(e, 0x46);
+    emit8(e, dcr ? 0xFF : 0x01);
+    emit8(e, 0x0F);     /* movzx eax, al */
+    emit8(e, 0xB6);
+    emit8(e, 0xC0);
+    flags_from(e, dcr ? dcr_table : inr_table);
+    load8(e, ECX, OFF_F);
+    emit8(e, 0x83);     /* and ecx, PSW_C */
+    emit8(e, 0xE1);
+    emit8(e, 0x01);
+    emit8(e, 0x09);     /* or edx, ecx */
+    emit8(e, 0xCA);
+    emit8(e, 0x88);     /* mov [rbx + f], dl */
+    at_cpu(e, EDX, OFF_F);
+}
+#else
+static void *const alu_ops[8] = {
+        (void *) alu_add, (void *) alu_adc, (void *) alu_sub, (void *) alu_sbb,
+        (void *) alu_ana, (void *) alu_xra, (void *) alu_ora, (void *) alu_cmp,
+};
+
+static void emit_alu(struct Emitter *e, unsigned k)
+{
+    call(e, alu_ops[k]);
+}
+
+static void emit_inr_dcr(struct Emitter *e, bool dcr)
+{
+    call(e, dcr ? (void *) alu_dcr : (void *) alu_inr);
+}
+#endif
+
+/* Load 8080 register r, or the byte at HL for M, into esi */
+static void emit_operand(struct Emitter *e, unsigned r)
+{
+    if (r == REG_M) {
+        load16(e, ECX, OFF_HL);
+        load_guest(e, ESI);
+    } else {
+        load8(e, ESI, reg8[r]);
+    }
+}
+
+/* Translate the straight-line code at start, up to and including the
+ * first control transfer. Instructions that stop run() (HLT, IN, OUT),
+ * touch the interrupt state or sit on a breakpoint end the block before
+ * them. Blocks never leave the page they start in. */
+static jit_block compile(struct Jit *jit, uint16_t start, uint16_t *budget)
+{
+    struct CPU *cpu = jit->cpu;
+    struct Emitter e = {jit->buffer + jit->used};
+    uint8_t *entry = e.p;
+    uint32_t cycles = 0, count = 0, max = 0;
+    uint16_t pc = start;
+    int32_t target = -1;        /* where the block goes, when that is fixed */
+    bool ended = false;
+
+    emit8(&e, 0x53);    /* push rbx */
+    emit8(&e, 0x48);    /* mov rbx, rdi */
+    emit8(&e, 0x89);
+    emit8(&e, 0xFB);
+
+    for (unsigned n = 0; n < JIT_MAX_INSTRUCTIONS && !ended; ++n) {
+        if (n && at_breakpoint(cpu, pc))
+            break;
+        uint8_t op = cpu->memory[pc];
+        uint8_t lo = cpu->memory[(uint16_t) (pc + 1)];
+        uint16_t imm = merge_bytes(lo, cpu->memory[(uint16_t) (pc + 2)]);
+        unsigned len = 1 + operand_bytes[op];
+        bool native = true, writes = false;
+        if ((pc & 0xFF) + len > 0x100)
+            break;
+        uint32_t cost = cycle_table[op];
+
+        switch (op) {
+            case NOP: case DSUB: case AHRL: case RDEL: case RIM: case LDHI:
+            case SIM: case LDSI: case RSTV: case SHLX: case JNUI: case LHLX: case JUI:
+                break;
+            case LXI_B: case LXI_D: case LXI_H: case LXI_SP:
+                store16_imm(&e, reg16[op >> 4], imm);
+                break;
+            case STAX_B: case STAX_D:
+                load16(&e, ESI, reg16[op >> 4]);
+                load8(&e, EDX, OFF_A);
+                emit_write(&e);
+                writes = true;
+                break;
+            case LDAX_B: case LDAX_D:
+                load16(&e, ECX, reg16[op >> 4]);
+                load_guest(&e, EAX);
+                store8(&e, OFF_A);
+                break;
+            case INX_B: case INX_D: case INX_H: case INX_SP:
+            case DCX_B: case DCX_D: case DCX_H: case DCX_SP:
+                emit8(&e, 0x66);    /* inc/dec word [rbx + off] */
+                emit8(&e, 0xFF);
+                at_cpu(&e, (op & 0x08) ? 1 : 0, reg16[op >> 4]);
+                break;
+            case INR_M: case DCR_M:
+                load16(&e, ECX, OFF_HL);
+                load_guest(&e, ESI);
+                emit_inr_dcr(&e, op & 1);
+                emit8(&e, 0x0F);    /* movzx edx, al */
+                emit8(&e, 0xB6);
+                emit8(&e, 0xD0);
+                load16(&e, ESI, OFF_HL);
+                emit_write(&e);
+                writes = true;
+                break;
+            case INR_B: case INR_C: case INR_D: case INR_E: case INR_H: case INR_L: case INR_A:
+            case DCR_B: case DCR_C: case DCR_D: case DCR_E: case DCR_H: case DCR_L: case DCR_A:
+                load8(&e, ESI, reg8[op >> 3]);
+                emit_inr_dcr(&e, op & 1);
+                store8(&e, reg8[op >> 3]);
+                break;
+            case MVI_M:
+                load16(&e, ESI, OFF_HL);
+                mov_imm(&e, EDX, lo);
+                emit_write(&e);
+                writes = true;
+                break;
+            case MVI_B: case MVI_C: case MVI_D: case MVI_E: case MVI_H: case MVI_L: case MVI_A:
+                store8_imm(&e, reg8[op >> 3], lo);
+                break;
+            case DAD_B: case DAD_D: case DAD_H: case DAD_SP:
+                load16(&e, ESI, reg16[op >> 4]);
+                call(&e, (void *) alu_dad);
+                break;
+            case SHLD:
+                mov_imm(&e, ESI, imm);
+                load8(&e, EDX, OFF_L);
+                emit_write(&e);
+                mov_imm(&e, ESI, (uint16_t) (imm + 1));
+                load8(&e, EDX, OFF_H);
+                emit_write(&e);
+                writes = true;
+                break;
+            case LHLD:
+                mov_imm(&e, ECX, imm);
+                load_guest(&e, EAX);
+                store8(&e, OFF_L);
+                mov_imm(&e, ECX, (uint16_t) (imm + 1));
+                load_guest(&e, EAX);
+                store8(&e, OFF_H);
+                break;
+            case STA:
+                mov_imm(&e, ESI, imm);
+                load8(&e, EDX, OFF_A);
+                emit_write(&e);
+                writes = true;
+                break;
+            case LDA:
+                mov_imm(&e, ECX, imm);
+                load_guest(&e, EAX);
+                store8(&e, OFF_A);
+                break;
+            case CMA:
+                emit8(&e, 0xF6);    /* not byte [rbx + off] */
+                at_cpu(&e, 2, OFF_A);
+                break;
+            case XCHG:
+                load16(&e, EAX, OFF_HL);
+                load16(&e, ECX, OFF_DE);
+                emit8(&e, 0x66);    /* mov word [rbx + de], ax */
+                emit8(&e, 0x89);
+                at_cpu(&e, EAX, OFF_DE);
+                emit8(&e, 0x66);    /* mov word [rbx + hl], cx */
+                emit8(&e, 0x89);
+                at_cpu(&e, ECX, OFF_HL);
+                break;
+            case SPHL:
+                load16(&e, EAX, OFF_HL);
+                store16(&e, OFF_SP);
+                break;
+            case PUSH_B: case PUSH_D: case PUSH_H:
+                load16(&e, ESI, reg16[(op >> 4) & 3]);
+                emit_push(&e, jit);
+                writes = true;
+                break;
+            case POP_B: case POP_D: case POP_H:
+                emit_pop(&e);
+                store16(&e, reg16[(op >> 4) & 3]);
+                break;
+            case ADI: case ACI: case SUI: case SBI: case ANI: case XRI: case ORI: case CPI:
+                mov_imm(&e, ESI, lo);
+                emit_alu(&e, (op >> 3) & 7);
+                break;
+
+            case JMP:
+                store16_imm(&e, OFF_PC, imm);
+                ended = true;
+                target = imm;
+                break;
+            case JNZ: case JZ: case JNC: case JC: case JPO: case JPE: case JP: case JM: {
+                store16_imm(&e, OFF_PC, pc + len);
+                uint8_t *skip = emit_condition(&e, (op >> 3) & 7);
+                store16_imm(&e, OFF_PC, imm);
+                land(&e, skip);
+                ended = true;
+                break;
+            }
+            case CALL:
+                mov_imm(&e, ESI, (uint16_t) (pc + len));
+                emit_push(&e, jit);
+                store16_imm(&e, OFF_PC, imm);
+                ended = true;
+                target = imm;
+                break;
+            case CNZ: case CZ: case CNC: case CC: case CPO: case CPE: case CP: case CM: {
+                store16_imm(&e, OFF_PC, pc + len);
+                uint8_t *skip = emit_condition(&e, (op >> 3) & 7);
+                mov_imm(&e, ESI, (uint16_t) (pc + len));
+                emit_push(&e, jit);
+                store16_imm(&e, OFF_PC, imm);
+                add64_imm(&e, OFF_CYCLES, COND_TAKEN_CYCLES);
+                land(&e, skip);
+                max += COND_TAKEN_CYCLES;
+                ended = true;
+                break;
+            }
+            case RET:
+                emit_pop(&e);
+                store16(&e, OFF_PC);
+                ended = true;
+                break;
+            case RNZ: case RZ: case RNC: case RC: case RPO: case RPE: case RP: case RM: {
+                store16_imm(&e, OFF_PC, pc + len);
+                uint8_t *skip = emit_condition(&e, (op >> 3) & 7);
+                emit_pop(&e);
+                store16(&e, OFF_PC);
+                add64_imm(&e, OFF_CYCLES, COND_TAKEN_CYCLES);
+                land(&e, skip);
+                max += COND_TAKEN_CYCLES;
+                ended = true;
+                break;
+            }
+            case RST_0: case RST_1: case RST_2: case RST_3:
+            case RST_4: case RST_5: case RST_6: case RST_7:
+                mov_imm(&e, ESI, (uint16_t) (pc + len));
+                emit_push(&e, jit);
+                store16_imm(&e, OFF_PC, op & 0x38);
+                ended = true;
+                break;
+            case PCHL:
+                load16(&e, EAX, OFF_HL);
+                store16(&e, OFF_PC);
+                ended = true;
+                break;
+
+            /* left to run(), which has to see these */
+            case HLT: case IN: case OUT: case EI: case DI:
+                goto done;
+
+            default:
+                if (op >= MOV_B_B && op <= MOV_A_A) {
+                    unsigned dst = (op >> 3) & 7, src = op & 7;
+                    if (dst == REG_M) {
+                        load16(&e, ESI, OFF_HL);
+                        load8(&e, EDX, reg8[src]);
+                        emit_write(&e);
+                        writes = true;
+                    } else if (src == REG_M) {
+                        load16(&e, ECX, OFF_HL);
+                        load_guest(&e, EAX);
+                        store8(&e, reg8[dst]);
+                    } else if (src != dst) {
+                        load8(&e, EAX, reg8[src]);
+                        store8(&e, reg8[dst]);
+                    }
+                } else if (op >= ADD_B && op <= CMP_A) {
+                    emit_operand(&e, op & 7);
+                    emit_alu(&e, (op >> 3) & 7);
+                } else {
+                    /* everything else is a single byte; the interpreter
+                     * runs it and does its own accounting */
+                    store16_imm(&e, OFF_PC, pc + 1);
+                    mov_imm(&e, ESI, op);
+                    call(&e, (void *) instruction);
+                    native = false;
+                    writes = true;
+                }
+                break;
+        }
+
+        max += cost;
+        if (native) {
+            cycles += cost;
+            ++count;
+        }
+        pc += len;
+        if (writes && !ended)
+            emit_check_dirty(&e, jit, pc, cycles, count);
+        if ((pc & 0xFF) == 0)
+            break;
+    }
+done:
+    if (pc == start)
+        return NULL;
+    if (!ended) {
+        store16_imm(&e, OFF_PC, pc);
+        target = pc;
+    }
+    emit_chain(&e, jit, target, cycles, count);
+
+    for (uint16_t addr = start; addr != pc; ++addr)
+        jit->code_map[addr >> 3] |= 1u << (addr & 7);
+    jit->compiled[start >> 8] = true;
+    jit->used += e.p - entry;
+    *budget = (uint16_t) max;
+    return (jit_block) (void *) entry;
+}
+
+struct Jit *jit_create(struct CPU *cpu)
+{
+    struct Jit *jit = calloc(1, sizeof(*jit));
+    if (!jit)
+        return NULL;
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->size = JIT_BUFFER_SIZE;
+    jit->cpu = cpu;
+    return jit;
+}
+
+void jit_destroy(struct Jit *jit)
+{
+    if (!jit)
+        return;
+    for (unsigned i = 0; i < JIT_PAGES; ++i)
+        free(jit->pages[i]);
+    munmap(jit->buffer, jit->size);
+    free(jit);
+}
+
+void jit_flush(struct Jit *jit)
+{
+    for (unsigned i = 0; i < JIT_PAGES; ++i) {
+        if (jit->pages[i])
+            memset(jit->pages[i], 0, sizeof(struct JitPage));
+    }
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    memset(jit->compiled, 0, sizeof(jit->compiled));
+    memset(jit->rewrites, 0, sizeof(jit->rewrites));
+    jit->used = 0;
+}
+
+/* The block to run at pc, if there is one that fits in budget. Counts the
+ * visit and compiles the block once pc is hot. */
+jit_block jit_lookup(struct Jit *jit, uint16_t pc, uint64_t budget)
+{
+    unsigned p = pc >> 8, i = pc & 0xFF;
+    if (jit->rewrites[p] >= JIT_REWRITE_LIMIT)
+        return NULL;
+    struct JitPage *page = jit->pages[p];
+    if (!page && !(page = jit->pages[p] = calloc(1, sizeof(*page))))
+        return NULL;
+
+    jit->dirty = false;
+    if (page->code[i])
+        return page->budget[i] <= budget ? page->code[i] : NULL;
+    if (page->heat[i] == JIT_COLD || ++page->heat[i] < JIT_HOT)
+        return NULL;
+
+    if (jit->size - jit->used < JIT_BLOCK_BYTES)
+        jit_flush(jit);
+    uint16_t max;
+    jit_block block = compile(jit, pc, &max);
+    if (!block) {
+        page->heat[i] = JIT_COLD;
+        return NULL;
+    }
+    page->code[i] = block;
+    page->budget[i] = max;
+    return max <= budget ? block : NULL;
+}
+
+/* Compiled code in the page holding addr was overwritten: drop all of it.
+ * Blocks never cross a page, so no other page is affected.
+ * Pages that keep being rewritten are left to the interpreter. */
+void jit_invalidate(struct Jit *jit, uint16_t addr)
+{
+    unsigned p = addr >> 8;
+    unsigned rewrites = jit->rewrites[p];
+    jit_drop_page(jit, p);
+    jit->rewrites[p] = rewrites < JIT_REWRITE_LIMIT ? rewrites + 1 : rewrites;
+}
+
+/* Forget the blocks of a page that now shows different memory */
+void jit_drop_page(struct Jit *jit, unsigned page)
+{
+    if (jit->pages[page])
+        memset(jit->pages[page], 0, sizeof(struct JitPage));
+    memset(jit->code_map + page * 32, 0, 32);
+    jit->compiled[page] = false;
+    jit->rewrites[page] = 0;
+    jit->dirty = true;
+}
+
+#else
+
+struct Jit *jit_create(struct CPU *cpu)
+{
+    (void) cpu;
+    return NULL;
+}
+
+void jit_destroy(struct Jit *jit)
+{
+    (void) jit;
+}
+
+void jit_flush(struct Jit *jit)
+{
+    (void) jit;
+}
+
+jit_block jit_lookup(struct Jit *jit, uint16_t pc, uint64_t budget)
+{
+    (void) jit;
+    (void) pc;
+    (void) budget;
+    return NULL;
+}
+
+void jit_invalidate(struct Jit *jit, uint16_t addr)
+{
+    (void) jit;
+    (void) addr;
+}
+
+void jit_drop_page(struct Jit *jit, unsigned page)
+{
+    (void) jit;
+    (void) page;
+}
+
+#endif
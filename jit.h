@@ -0,0 +1,76 @@
+#ifndef EMU8080_JITH
+#define EMU8080_JITH
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JIT_PAGES 256
+#define JIT_REWRITE_LIMIT 8     /* rewrites before a page is left to the interpreter */
+
+struct CPU;
+typedef void (*jit_block)(struct CPU *cpu);
+
+/* Compiled blocks starting in one 256-byte page of guest memory */
+struct JitPage {
+    jit_block code[256];
+    uint16_t budget[256];   /* most T-states the block can take */
+    uint16_t heat[256];     /* times the interpreter branched here */
+};
+
+struct Jit {
+    uint8_t code_map[JIT_PAGES * 32];   /* bit per guest byte in a compiled block */
+    uint8_t rewrites[JIT_PAGES];    /* times compiled code was overwritten */
+    bool compiled[JIT_PAGES];       /* the page has bits set in code_map */
+    bool dirty;                     /* compiled code was overwritten */
+    uint64_t end;                   /* T-state run_jit() stops at, for chained blocks */
+    struct CPU *cpu;
+    struct JitPage *pages[JIT_PAGES];
+    uint8_t *buffer;
+    size_t used, size;
+};
+
+extern struct Jit *jit_create(struct CPU *cpu);
+extern void jit_destroy(struct Jit *jit);
+extern void jit_flush(struct Jit *jit);
+extern jit_block jit_lookup(struct Jit *jit, uint16_t pc, uint64_t budget);
+extern void jit_invalidate(struct Jit *jit, uint16_t addr);
+extern void jit_drop_page(struct Jit *jit, unsigned page);
+
+static inline bool jit_is_code(const struct Jit *jit, uint16_t addr)
+{
+    return jit->code_map[addr >> 3] & (1u << (addr & 7));
+}
+
+/* Compiled block at pc, if any and if it fits in budget */
+static inline jit_block jit_find(struct Jit *jit, uint16_t pc, uint64_t budget)
+{
+    const struct JitPage *page = jit->pages[pc >> 8];
+    if (!page || !page->code[pc & 0xFF] || page->budget[pc & 0xFF] > budget)
+        return NULL;
+    jit->dirty = false;
+    return page->code[pc & 0xFF];
+}
+
+/* False for pages given up on as self-modifying */
+static inline bool jit_wants(const struct Jit *jit, uint16_t addr)
+{
+    return jit->rewrites[addr >> 8] < JIT_REWRITE_LIMIT;
+}
+
+/* Provided by cpu.c for compiled code */
+extern void alu_add(struct CPU *cpu, uint8_t val);
+extern void alu_adc(struct CPU *cpu, uint8_t val);
+extern void alu_sub(struct CPU *cpu, uint8_t val);
+extern void alu_sbb(struct CPU *cpu, uint8_t val);
+extern void alu_ana(struct CPU *cpu, uint8_t val);
+extern void alu_xra(struct CPU *cpu, uint8_t val);
+extern void alu_ora(struct CPU *cpu, uint8_t val);
+extern void alu_cmp(struct CPU *cpu, uint8_t val);
+extern uint8_t alu_inr(struct CPU *cpu, uint8_t val);
+extern uint8_t alu_dcr(struct CPU *cpu, uint8_t val);
+extern void alu_dad(struct CPU *cpu, uint16_t val);
+extern void stack_push(struct CPU *cpu, uint16_t value);
+extern uint16_t stack_pop(struct CPU *cpu);
+extern bool cpu_condition_flag(unsigned cc, size_t *offset, uint8_t *mask);
+extern bool cpu_condition(struct CPU *cpu, unsigned cc);
+#endif
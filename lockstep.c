@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "lockstep.h"
+
+#define LOCKSTEP_LOG_SIZE 4096  /* entries a log starts with */
+
+bool lockstep_grow(void **array, size_t *size, size_t item)
+{
+    size_t grown = *size ? 2 * *size : LOCKSTEP_LOG_SIZE;
+    void *larger = realloc(*array, grown * item);
+    if (!larger)
+        return false;
+    *array = larger;
+    *size = grown;
+    return true;
+}
+
+#ifdef EMU8080_LOCKSTEP
+static void clear(struct LockstepLog *log)
+{
+    log->nwrites = 0;
+    log->nio = 0;
+    log->lost = false;
+}
+
+struct Lockstep *lockstep_create(struct CPU *cpu, uint64_t block)
+{
+    /* a device page would be read twice */
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        if (cpu->page_flags[page] & PAGE_IO)
+            return NULL;
+    struct Lockstep *ls = calloc(1, sizeof(*ls));
+    if (!ls)
+        return NULL;
+    ls->cpu = cpu;
+    ls->block = block ? block : 1;
+    if (!(ls->ref = ref_create(&ls->ref_log, cpu->memory, cpu->page_flags))) {
+        free(ls);
+        return NULL;
+    }
+    cpu->lockstep = &ls->log;
+    return ls;
+}
+
+void lockstep_destroy(struct Lockstep *ls)
+{
+    if (!ls)
+        return;
+    ls->cpu->lockstep = NULL;
+    ref_destroy(ls->ref);
+    free(ls->log.writes);
+    free(ls->log.io);
+    free(ls->ref_log.writes);
+    free(ls->ref_log.io);
+    free(ls->report);
+    free(ls);
+}
+
+/* Bring the reference up to what the host did since the last run */
+static void sync(struct Lockstep *ls)
+{
+    struct LockstepState state;
+    for (size_t i = 0; i < ls->log.nwrites; ++i)
+        ref_poke(ls->ref, ls->log.writes[i].addr, ls->log.writes[i].value);
+    lockstep_save(ls->cpu, cpu_get_psw(ls->cpu), &state);
+    ref_load(ls->ref, &state);
+    clear(&ls->log);
+    clear(&ls->ref_log);
+}
+
+static void print_write(FILE *out, const char *label, const struct LockstepWrite *write)
+{
+    if (write)
+        fprintf(out, "  %-10s %04x <- %02x at instruction %llu\n", label, write->addr,
+                write->value, (unsigned long long) write->insn);
+    else
+        fprintf(out, "  %-10s no write\n", label);
+}
+
+static void print_row(FILE *out, const char *name, unsigned long long core,
+                      unsigned long long ref, int width)
+{
+    fprintf(out, "  %-10s %0*llx %*s%0*llx%s\n", name, width, core, 20 - width, "", width, ref,
+            core != ref ? "  <" : "");
+}
+
+/* Keep a description of the divergence for lockstep_report(). core and ref
+ * are the states the cores ended in, if they got as far as comparing them,
+ * and [from, to) are the writes the core made meanwhile. */
+static bool diverge(struct Lockstep *ls, const char *what, uint64_t start,
+                    const struct LockstepState *core, const struct LockstepState *ref,
+                    size_t from, size_t to)
+{
+    ls->diverged = true;
+    FILE *out = open_memstream(&ls->report, &ls->report_len);
+    if (!out)
+        return false;
+    fprintf(out, "%s the block starting at instruction %llu\n", what, (unsigned long long) start);
+    if (core && ref) {
+        fprintf(out, "  %-10s %-20s %s\n", "", "core", "reference");
+        print_row(out, "pc", core->pc, ref->pc, 4);
+        print_row(out, "sp", core->sp, ref->sp, 4);
+        print_row(out, "bc", core->bc, ref->bc, 4);
+        print_row(out, "de", core->de, ref->de, 4);
+        print_row(out, "hl", core->hl, ref->hl, 4);
+        print_row(out, "a", core->a, ref->a, 2);
+        print_row(out, "psw", core->psw, ref->psw, 2);
+        print_row(out, "ie", core->interrupt_enabled, ref->interrupt_enabled, 1);
+        print_row(out, "pending", core->interrupt_pending, ref->interrupt_pending, 1);
+        print_row(out, "vector", core->interrupt_vector, ref->interrupt_vector, 1);
+        print_row(out, "halted", core->halted, ref->halted, 1);
+        fprintf(out, "  %-10s %-20llu %llu%s\n", "cycles", (unsigned long long) core->cycles,
+                (unsigned long long) ref->cycles, core->cycles != ref->cycles ? "  <" : "");
+        fprintf(out, "  %-10s %-20llu %llu%s\n", "executed",
+                (unsigned long long) core->instructions, (unsigned long long) ref->instructions,
+                core->instructions != ref->instructions ? "  <" : "");
+        /* the first write that differs, or the first one only one side made */
+        size_t n = ls->ref_log.nwrites, i = 0;
+        const struct LockstepWrite *writes = ls->log.writes + from;
+        while (i < to - from && i < n && writes[i].addr == ls->ref_log.writes[i].addr &&
+               writes[i].value == ls->ref_log.writes[i].value)
+            ++i;
+        if (i < to - from || i < n) {
+            fprintf(out, "  write %zu of the block:\n", i + 1);
+            print_write(out, "core", i < to - from ? &writes[i] : NULL);
+            print_write(out, "ref", i < n ? &ls->ref_log.writes[i] : NULL);
+        }
+    }
+    uint16_t pcs[LOCKSTEP_HISTORY];
+    size_t n = ref_history(ls->ref, pcs);
+    fprintf(out, "  the reference executed last:");
+    for (size_t i = 0; i < n; ++i)
+        fprintf(out, " %04x", pcs[i]);
+    fprintf(out, "\n");
+    fclose(out);
+    return false;
+}
+
+/* Whether the reference ended in the same state as the core, having made
+ * the writes [from, to) of the core's log */
+static bool same(struct Lockstep *ls, const char *when, uint64_t start,
+                 const struct LockstepState *core, const struct LockstepState *ref,
+                 size_t from, size_t to)
+{
+    bool writes = to - from == ls->ref_log.nwrites;
+    for (size_t i = 0; writes && i < ls->ref_log.nwrites; ++i)
+        writes = ls->log.writes[from + i].addr == ls->ref_log.writes[i].addr &&
+                 ls->log.writes[from + i].value == ls->ref_log.writes[i].value;
+    bool registers = core->pc == ref->pc && core->sp == ref->sp && core->bc == ref->bc &&
+                     core->de == ref->de && core->hl == ref->hl && core->a == ref->a &&
+                     core->psw == ref->psw && core->halted == ref->halted &&
+                     core->interrupt_enabled == ref->interrupt_enabled &&
+                     core->interrupt_pending == ref->interrupt_pending &&
+                     core->interrupt_vector == ref->interrupt_vector;
+    bool timing = core->cycles == ref->cycles && core->instructions == ref->instructions;
+    if (writes && registers && timing)
+        return true;
+    char what[80];
+    snprintf(what, sizeof(what), "%s differ %s", !registers ? "registers" : !writes ? "writes" :
+             "T-states", when);
+    return diverge(ls, what, start, core, ref, from, to);
+}
+
+/* Step the reference through the instructions the core executed in its
+ * last block, handing it over what devices did, and compare */
+static bool check(struct Lockstep *ls, uint64_t start)
+{
+    struct CPU *cpu = ls->cpu;
+    struct LockstepLog *log = &ls->log;
+    struct LockstepState core, ref;
+    size_t consumed = 0, nio = 0;
+    if (log->lost || ls->ref_log.lost)
+        return diverge(ls, "out of memory for the write log in", start, NULL, NULL, 0, 0);
+    ref_save(ls->ref, &ref);
+    while (ref.instructions < cpu->instructions) {
+        uint64_t before = ref.instructions;
+        int ret = ref_step(ls->ref);
+        ref_save(ls->ref, &ref);
+        if (ref.instructions == before)
+            break;
+        if (ret != EXIT_IO)
+            continue;
+        ls->ref_log.nio = 0;
+        if (nio == log->nio)
+            return diverge(ls, "only the reference reached IN or OUT in", start, NULL, NULL, 0, 0);
+        const struct LockstepIo *io = &log->io[nio++];
+        if (!same(ls, "at IN or OUT in", start, &io->before, &ref, consumed, io->mark))
+            return false;
+        ls->ref_log.nwrites = 0;
+        consumed = io->mark;
+        if (!io->done)
+            break;
+        for (size_t i = io->mark; i < io->end; ++i)
+            ref_poke(ls->ref, log->writes[i].addr, log->writes[i].value);
+        consumed = io->end;
+        ref_load(ls->ref, &io->after);
+        ref = io->after;
+    }
+    if (nio < log->nio)
+        return diverge(ls, "only the core reached IN or OUT in", start, NULL, NULL, 0, 0);
+    lockstep_save(cpu, cpu_get_psw(cpu), &core);
+    /* the core skips the time it would spend halted */
+    if (core.halted && ref.halted && core.interrupt_enabled)
+        ref.cycles = core.cycles;
+    if (!same(ls, "at the end of", start, &core, &ref, consumed, log->nwrites))
+        return false;
+    clear(log);
+    clear(&ls->ref_log);
+    return true;
+}
+
+int lockstep_run(struct Lockstep *ls, uint64_t budget)
+{
+    struct CPU *cpu = ls->cpu;
+    if (ls->diverged)
+        return EXIT_DIVERGED;
+    uint64_t end = cpu->cycles + budget;
+    if (end < cpu->cycles)
+        end = UINT64_MAX;
+    sync(ls);
+    int ret;
+    do {
+        uint64_t start = cpu->instructions;
+        ret = run(cpu, end - cpu->cycles < ls->block ? end - cpu->cycles : ls->block);
+        if (!check(ls, start))
+            return EXIT_DIVERGED;
+    } while (ret == EXIT_BUDGET && !cpu->halted && cpu->cycles < end);
+    /* as run() does, idle to the end of the budget */
+    if (cpu->halted && cpu->interrupt_enabled && cpu->cycles < end)
+        cpu->cycles = end;
+    return ret;
+}
+
+#else
+struct Lockstep *lockstep_create(struct CPU *cpu, uint64_t block)
+{
+    (void) cpu;
+    (void) block;
+    return NULL;
+}
+
+void lockstep_destroy(struct Lockstep *ls)
+{
+    (void) ls;
+}
+
+int lockstep_run(struct Lockstep *ls, uint64_t budget)
+{
+    (void) ls;
+    (void) budget;
+    return EXIT_DIVERGED;
+}
+#endif
+
+void lockstep_report(FILE *out, const struct Lockstep *ls)
+{
+    if (ls->report)
+        fwrite(ls->report, 1, ls->report_len, out);
+    else
+        fprintf(out, "no divergence\n");
+}
@@ -0,0 +1,145 @@
+#ifndef EMU8080_LOCKSTEPH
+#define EMU8080_LOCKSTEPH
+#include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define EXIT_DIVERGED (5)       /* the two cores disagree; see lockstep_report() */
+#define LOCKSTEP_DEFAULT_BLOCK 100000
+#define LOCKSTEP_HISTORY 16     /* instructions the report shows before a divergence */
+
+/* What is compared after each block, in a form both cores can fill in
+ * however they keep their registers */
+struct LockstepState {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint16_t pc, sp, bc, de, hl;
+    uint8_t a, psw;
+    bool interrupt_enabled;
+    bool interrupt_pending;
+    uint8_t interrupt_vector;
+    bool halted;
+};
+
+struct LockstepWrite {
+    uint64_t insn;          /* instructions executed, counting the one writing */
+    uint16_t addr;
+    uint8_t value;
+};
+
+/* An IN or OUT: the state the device was handed and, once it is done, the
+ * state it left. The writes between mark and end are the device's. */
+struct LockstepIo {
+    struct LockstepState before, after;
+    size_t mark, end;
+    bool done;              /* not when the machine stopped for the host */
+};
+
+/* Kept by a machine with cpu->lockstep set */
+struct LockstepLog {
+    struct LockstepWrite *writes;
+    size_t nwrites, write_size;
+    struct LockstepIo *io;
+    size_t nio, io_size;
+    bool lost;              /* out of memory; the block cannot be checked */
+};
+
+struct RefCPU;
+
+struct Lockstep {
+    struct CPU *cpu;
+    struct RefCPU *ref;
+    uint64_t block;         /* T-states run before each comparison */
+    struct LockstepLog log, ref_log;
+    bool diverged;
+    char *report;
+    size_t report_len;
+};
+
+/* Run cpu side by side with the reference core: cpu runs block T-states at
+ * a time, however it was built to run, and the reference then executes the
+ * same number of instructions one instruction() at a time. Registers, flags,
+ * interrupt state, T-states and every write are compared after each block.
+ * Devices only run on cpu; the reference picks up what they did. The memory
+ * map must not have device pages and must not change during the run.
+ * Builds without LOCKSTEP=1 return NULL. */
+extern struct Lockstep *lockstep_create(struct CPU *cpu, uint64_t block);
+extern void lockstep_destroy(struct Lockstep *ls);
+/* As run(), but EXIT_DIVERGED as soon as the cores disagree, and from then
+ * on. Registers set and writes made through write_byte() by the host
+ * between runs are passed on to the reference. */
+extern int lockstep_run(struct Lockstep *ls, uint64_t budget);
+/* Describe the first divergence: where, which registers and writes differ,
+ * and the instructions the reference executed last */
+extern void lockstep_report(FILE *out, const struct Lockstep *ls);
+
+extern bool lockstep_grow(void **array, size_t *size, size_t item);
+
+static inline void lockstep_write(struct LockstepLog *log, uint64_t insn, uint16_t addr,
+                                  uint8_t value)
+{
+    if (log->nwrites == log->write_size &&
+        !lockstep_grow((void **) &log->writes, &log->write_size, sizeof(*log->writes))) {
+        log->lost = true;
+        return;
+    }
+    log->writes[log->nwrites++] = (struct LockstepWrite) {insn, addr, value};
+}
+
+static inline void lockstep_io(struct LockstepLog *log, const struct LockstepState *state,
+                               bool done)
+{
+    if (done) {
+        if (log->nio) {
+            log->io[log->nio - 1].after = *state;
+            log->io[log->nio - 1].end = log->nwrites;
+            log->io[log->nio - 1].done = true;
+        }
+        return;
+    }
+    if (log->nio == log->io_size &&
+        !lockstep_grow((void **) &log->io, &log->io_size, sizeof(*log->io))) {
+        log->lost = true;
+        return;
+    }
+    log->io[log->nio++] = (struct LockstepIo) {.before = *state, .mark = log->nwrites};
+}
+
+/* Compiled separately against each core's own struct Registers */
+static inline void lockstep_save(const struct CPU *cpu, uint8_t psw, struct LockstepState *state)
+{
+    *state = (struct LockstepState) {
+        .cycles = cpu->cycles,
+        .instructions = cpu->instructions,
+        .pc = cpu->regs.pc,
+        .sp = cpu->regs.sp,
+        .bc = cpu->regs.bc,
+        .de = cpu->regs.de,
+        .hl = cpu->regs.hl,
+        .a = cpu->regs.a,
+        .psw = psw,
+        .interrupt_enabled = cpu->interrupt_enabled,
+        .interrupt_pending = cpu->interrupt_pending,
+        .interrupt_vector = cpu->interrupt_vector,
+        .halted = cpu->halted,
+    };
+}
+
+/* The reference core, built from cpu.c by ref.c. It starts from memory,
+ * treats the pages flagged PAGE_ROM as ROM, records its writes in log and
+ * stops on every IN and OUT with EXIT_IO. */
+extern struct RefCPU *ref_create(struct LockstepLog *log, const uint8_t *memory,
+                                 const uint8_t *page_flags);
+extern void ref_destroy(struct RefCPU *ref);
+extern void ref_load(struct RefCPU *ref, const struct LockstepState *state);
+extern void ref_save(struct RefCPU *ref, struct LockstepState *state);
+/* Change memory without recording a write */
+extern void ref_poke(struct RefCPU *ref, uint16_t addr, uint8_t value);
+/* Take an interrupt that is ready or execute one instruction, returning
+ * what instruction() does, or EXIT_HLT without doing anything while halted */
+extern int ref_step(struct RefCPU *ref);
+/* The pcs of up to LOCKSTEP_HISTORY instructions stepped last, oldest first */
+extern size_t ref_history(const struct RefCPU *ref, uint16_t *pcs);
+#endif
@@ -1,16 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include "cpu.h"
 #include "io.h"
+#include "batch.h"
+#include "state.h"
+#include "trace.h"
+#include "profile.h"
+#include "cpm.h"
+#include "lockstep.h"
+
+#define SLICE_CYCLES 10000000
+#define PROFILE_TOP 20     /* pcs listed in the profile */
+
+static struct CPU *traced;
+static int trace_fd = -1;
+
+/* Write the trace over the file on SIGUSR1, or on a crash before dying of it */
+static void dump_trace(int sig)
+{
+    if (lseek(trace_fd, 0, SEEK_SET) == 0 && ftruncate(trace_fd, 0) == 0)
+        trace_dump(traced->trace, trace_fd);
+    if (sig != SIGUSR1) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+static int start_trace(const char *program_name, struct CPU *cpu, const char *path)
+{
+    if (cpu_trace(cpu, TRACE_DEFAULT_SIZE)) {
+        fprintf(stderr, "%s: cannot trace, build with TRACE=1\n", program_name);
+        return -1;
+    }
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        perror(path);
+        return -1;
+    }
+    traced = cpu;
+    const int signals[] = {SIGUSR1, SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+        signal(signals[i], dump_trace);
+    return 0;
+}
+
+static int run_batch(const char *program_name, const char *manifest, unsigned nthreads, uint64_t limit)
+{
+    size_t njobs;
+    struct Job *jobs = batch_load_manifest(manifest, &njobs);
+    if (!jobs) {
+        fprintf(stderr, "%s: could not load manifest %s\n", program_name, manifest);
+        return EXIT_FAILURE;
+    }
+    batch_run(jobs, njobs, nthreads, limit);
+    batch_report(stdout, jobs, njobs);
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < njobs; ++i) {
+        if (jobs[i].exit == JOB_ERROR)
+            status = EXIT_FAILURE;
+    }
+    batch_free(jobs, njobs);
+    return status;
+}
 
 int main(int argc, char **argv)
 {
     const char *program_name = argv[0];
     static struct option const long_options[] = {
             {"offset", required_argument, NULL, 'o'},
+            {"batch", required_argument, NULL, 'b'},
+            {"jobs", required_argument, NULL, 'j'},
+            {"limit", required_argument, NULL, 'l'},
+            {"save-state", required_argument, NULL, 's'},
+            {"load-state", required_argument, NULL, 'r'},
+            {"trace", required_argument, NULL, 't'},
+            {"print-trace", required_argument, NULL, 'T'},
+            {"profile", required_argument, NULL, 'p'},
+            {"cpm", required_argument, NULL, 'c'},
+            {"lockstep", required_argument, NULL, 'd'},
             {"version", no_argument, NULL, 'v'},
             {"help", no_argument, NULL, 'h'},
             {NULL, 0, NULL, 0},
@@ -18,7 +92,12 @@ int main(int argc, char **argv)
     /* parse options */
     int c;
     size_t offset = 0;
-    while ((c = getopt_long(argc, argv, "vho:", long_options, NULL)) != -1) {
+    const char *manifest = NULL;
+    unsigned nthreads = 0;
+    uint64_t limit = 0;
+    const char *save = NULL, *load = NULL, *trace = NULL, *profile = NULL, *cpm_dir = NULL;
+    uint64_t block = 0;
+    while ((c = getopt_long(argc, argv, "vho:b:j:l:s:r:t:T:p:c:d:", long_options, NULL)) != -1) {
         switch (c) {
             case 'o':
                 errno = 0;
@@ -39,25 +118,150 @@ int main(int argc, char **argv)
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'b':
+                manifest = optarg;
+                break;
+            case 'j':
+                nthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                errno = 0;
+                limit = strtoull(optarg, NULL, 0);
+                if (errno) {
+                    fprintf(stderr, "%s: limit %s is out of range\n", program_name, optarg);
+                    return errno;
+                }
+                break;
+            case 's':
+                save = optarg;
+                break;
+            case 'r':
+                load = optarg;
+                break;
+            case 't':
+                trace = optarg;
+                break;
+            case 'T':
+                return trace_print(stdout, optarg) ? EXIT_FAILURE : EXIT_SUCCESS;
+            case 'p':
+                profile = optarg;
+                break;
+            case 'c':
+                cpm_dir = optarg;
+                break;
+            case 'd':
+                block = strtoull(optarg, NULL, 0);
+                if (!block)
+                    block = LOCKSTEP_DEFAULT_BLOCK;
+                break;
         }
     }
-    if (optind >= argc) {
+    if (manifest)
+        return run_batch(program_name, manifest, nthreads, limit);
+    if (optind >= argc && !load) {
         fprintf(stderr, "%s: expected arguments\n", program_name);
         return EXIT_FAILURE;
     }
-    unsigned char *rom = memory + offset;
-    for (int argind = optind; argind < argc; ++argind) {
-        /* load rom into memory; files are loaded left to right */
-        size_t bytes_read;
-        if (!(bytes_read = load_rom(rom, MEM_SIZE - offset,argv[argind]))) {
+    struct CPU *cpu = cpu_create();
+    if (!cpu) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    struct Cpm *cpm = NULL;
+    if (cpm_dir) {
+        /* one program, and the rest of the arguments are its command line */
+        struct Image *image = optind < argc ? image_open(argv[optind]) : NULL;
+        int end = image ? image_load(cpu, image, CPM_TPA) : optind < argc ? -1 : 0;
+        image_close(image);
+        if (end < 0 || !(cpm = cpm_create(cpu, cpm_dir, stdin, stdout))) {
+            cpu_destroy(cpu);
             return EXIT_FAILURE;
         }
-        rom = rom + bytes_read;
+        size_t len = 1;
+        for (int argind = optind + 1; argind < argc; ++argind)
+            len += strlen(argv[argind]) + 1;
+        char tail[len];
+        tail[0] = '\0';
+        for (int argind = optind + 1; argind < argc; ++argind) {
+            strcat(tail, " ");
+            strcat(tail, argv[argind]);
+        }
+        cpm_boot(cpm, tail);
+    } else {
+        size_t next = offset;
+        for (int argind = optind; argind < argc; ++argind) {
+            /* load images into memory; raw files are loaded left to right */
+            struct Image *image = image_open(argv[argind]);
+            int end = image ? image_load(cpu, image, next) : -1;
+            image_close(image);
+            if (end < 0) {
+                cpu_destroy(cpu);
+                return EXIT_FAILURE;
+            }
+            next = end;
+        }
+        cpu->regs.pc = offset;
+    }
+    /* a saved state replaces whatever the files put in RAM */
+    if ((load && state_load(cpu, load)) || (trace && start_trace(program_name, cpu, trace))) {
+        cpm_destroy(cpm);
+        cpu_destroy(cpu);
+        return EXIT_FAILURE;
+    }
+    if (profile && cpu_profile(cpu, true)) {
+        fprintf(stderr, "%s: cannot profile, build with PROFILE=1\n", program_name);
+        cpm_destroy(cpm);
+        cpu_destroy(cpu);
+        return EXIT_FAILURE;
     }
-    regs.pc = offset;
-    while(1) {
-        enum OpCode opcode = read_next_byte();
-        if (instruction(opcode))
+    struct Lockstep *ls = NULL;
+    if (block && !(ls = lockstep_create(cpu, block))) {
+        fprintf(stderr, "%s: cannot run in lockstep, build with LOCKSTEP=1\n", program_name);
+        cpm_destroy(cpm);
+        cpu_destroy(cpu);
+        return EXIT_FAILURE;
+    }
+    /* nothing here raises interrupts, so a halted machine is done */
+    int ret = EXIT_BUDGET;
+    while (!limit || cpu->cycles < limit) {
+        /* stop at the limit itself, so a state saved there can be reproduced */
+        uint64_t slice = SLICE_CYCLES;
+        if (limit && limit - cpu->cycles < slice)
+            slice = limit - cpu->cycles;
+        ret = ls ? lockstep_run(ls, slice) : run(cpu, slice);
+        if (cpm)
+            cpm_flush(cpm);
+        if (ret != EXIT_BUDGET || cpu->halted)
             break;
     }
+    cpm_destroy(cpm);
+    int status = save && state_save(cpu, save) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (ret == EXIT_DIVERGED) {
+        fprintf(stderr, "%s: ", program_name);
+        lockstep_report(stderr, ls);
+        status = EXIT_FAILURE;
+    }
+    lockstep_destroy(ls);
+    if (trace) {
+        signal(SIGUSR1, SIG_IGN);
+        if (trace_dump(cpu->trace, trace_fd)) {
+            perror(trace);
+            status = EXIT_FAILURE;
+        }
+        close(trace_fd);
+    }
+    if (profile) {
+        /* the summary goes to stdout and the call stacks to the file */
+        profile_report(stdout, cpu->profile, PROFILE_TOP);
+        FILE *folded = fopen(profile, "w");
+        if (folded) {
+            profile_folded(folded, cpu->profile);
+        }
+        if (!folded || fclose(folded) == EOF) {
+            perror(profile);
+            status = EXIT_FAILURE;
+        }
+    }
+    cpu_destroy(cpu);
+    return status;
 }
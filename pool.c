@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pool.h"
+
+/* A worker's queue of task indices. The owner takes from the bottom,
+ * thieves take from the top, so a steal grabs the oldest queued work. */
+struct Deque {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t top, bottom;
+};
+
+struct Pool {
+    struct Deque *deques;
+    unsigned nworkers;
+    void (*task)(size_t index, void *arg);
+    void *arg;
+};
+
+struct Worker {
+    struct Pool *pool;
+    unsigned id;
+};
+
+static int take_own(struct Deque *dq, size_t *index)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *index = dq->tasks[--dq->bottom];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int steal(struct Deque *dq, size_t *index)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *index = dq->tasks[dq->top++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static void *worker_main(void *arg)
+{
+    struct Worker *self = arg;
+    struct Pool *pool = self->pool;
+    size_t index;
+
+    for (;;) {
+        if (take_own(&pool->deques[self->id], &index)) {
+            pool->task(index, pool->arg);
+            continue;
+        }
+        /* nothing left locally; no task ever enqueues more work, so once
+         * every victim is empty we are done */
+        int stole = 0;
+        for (unsigned i = 1; i < pool->nworkers && !stole; ++i) {
+            unsigned victim = (self->id + i) % pool->nworkers;
+            stole = steal(&pool->deques[victim], &index);
+        }
+        if (!stole)
+            break;
+        pool->task(index, pool->arg);
+    }
+    return NULL;
+}
+
+unsigned pool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned) n : 1;
+}
+
+int pool_run(size_t ntasks, unsigned nthreads,
+             void (*task)(size_t index, void *arg), void *arg)
+{
+    if (!nthreads)
+        nthreads = pool_default_threads();
+    if (nthreads > ntasks)
+        nthreads = ntasks ? (unsigned) ntasks : 1;
+
+    struct Pool pool = {.nworkers = nthreads, .task = task, .arg = arg};
+    pool.deques = calloc(nthreads, sizeof(*pool.deques));
+    struct Worker *workers = calloc(nthreads, sizeof(*workers));
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    size_t *slots = calloc(ntasks ? ntasks : 1, sizeof(*slots));
+    if (!pool.deques || !workers || !threads || !slots) {
+        perror("calloc");
+        free(pool.deques);
+        free(workers);
+        free(threads);
+        free(slots);
+        return -1;
+    }
+
+    /* deal tasks round-robin; each deque owns a contiguous slice of slots */
+    size_t base = 0;
+    for (unsigned w = 0; w < nthreads; ++w) {
+        struct Deque *dq = &pool.deques[w];
+        pthread_mutex_init(&dq->lock, NULL);
+        dq->tasks = slots + base;
+        for (size_t t = w; t < ntasks; t += nthreads)
+            dq->tasks[dq->bottom++] = t;
+        base += dq->bottom;
+    }
+
+    /* queue bottoms hold the lowest indices, so reverse them to have the
+     * owner start with its first task */
+    for (unsigned w = 0; w < nthreads; ++w) {
+        struct Deque *dq = &pool.deques[w];
+        for (size_t i = 0, j = dq->bottom; i + 1 < j; ++i, --j) {
+            size_t t = dq->tasks[i];
+            dq->tasks[i] = dq->tasks[j - 1];
+            dq->tasks[j - 1] = t;
+        }
+    }
+
+    unsigned started = 0;
+    for (unsigned w = 0; w < nthreads; ++w) {
+        workers[w] = (struct Worker) {.pool = &pool, .id = w};
+        if (pthread_create(&threads[w], NULL, worker_main, &workers[w])) {
+            perror("pthread_create");
+            break;
+        }
+        ++started;
+    }
+    /* if a thread failed to start, run its share on this one; the
+     * remaining queues get stolen from */
+    if (started < nthreads) {
+        struct Worker self = {.pool = &pool, .id = started};
+        worker_main(&self);
+    }
+    for (unsigned w = 0; w < started; ++w)
+        pthread_join(threads[w], NULL);
+
+    for (unsigned w = 0; w < nthreads; ++w)
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    free(slots);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef EMU8080_POOLH
+#define EMU8080_POOLH
+#include <stddef.h>
+
+/* Run task(0) .. task(ntasks - 1) on nthreads workers; 0 means one per core.
+ * Tasks are dealt out round-robin and idle workers steal from busy ones. */
+extern int pool_run(size_t ntasks, unsigned nthreads,
+                    void (*task)(size_t index, void *arg), void *arg);
+extern unsigned pool_default_threads(void);
+#endif
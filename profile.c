@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "profile.h"
+
+static const char *const opcode_names[256] = {
+    [NOP     ] = "NOP",
+    [LXI_B   ] = "LXI B",
+    [STAX_B  ] = "STAX B",
+    [INX_B   ] = "INX B",
+    [INR_B   ] = "INR B",
+    [DCR_B   ] = "DCR B",
+    [MVI_B   ] = "MVI B",
+    [RLC     ] = "RLC",
+    [DSUB    ] = "DSUB",
+    [DAD_B   ] = "DAD B",
+    [LDAX_B  ] = "LDAX B",
+    [DCX_B   ] = "DCX B",
+    [INR_C   ] = "INR C",
+    [DCR_C   ] = "DCR C",
+    [MVI_C   ] = "MVI C",
+    [RRC     ] = "RRC",
+    [AHRL    ] = "AHRL",
+    [LXI_D   ] = "LXI D",
+    [STAX_D  ] = "STAX D",
+    [INX_D   ] = "INX D",
+    [INR_D   ] = "INR D",
+    [DCR_D   ] = "DCR D",
+    [MVI_D   ] = "MVI D",
+    [RAL     ] = "RAL",
+    [RDEL    ] = "RDEL",
+    [DAD_D   ] = "DAD D",
+    [LDAX_D  ] = "LDAX D",
+    [DCX_D   ] = "DCX D",
+    [INR_E   ] = "INR E",
+    [DCR_E   ] = "DCR E",
+    [MVI_E   ] = "MVI E",
+    [RAR     ] = "RAR",
+    [RIM     ] = "RIM",
+    [LXI_H   ] = "LXI H",
+    [SHLD    ] = "SHLD",
+    [INX_H   ] = "INX H",
+    [INR_H   ] = "INR H",
+    [DCR_H   ] = "DCR H",
+    [MVI_H   ] = "MVI H",
+    [DAA     ] = "DAA",
+    [LDHI    ] = "LDHI",
+    [DAD_H   ] = "DAD H",
+    [LHLD    ] = "LHLD",
+    [DCX_H   ] = "DCX H",
+    [INR_L   ] = "INR L",
+    [DCR_L   ] = "DCR L",
+    [MVI_L   ] = "MVI L",
+    [CMA     ] = "CMA",
+    [SIM     ] = "SIM",
+    [LXI_SP  ] = "LXI SP",
+    [STA     ] = "STA",
+    [INX_SP  ] = "INX SP",
+    [INR_M   ] = "INR M",
+    [DCR_M   ] = "DCR M",
+    [MVI_M   ] = "MVI M",
+    [STC     ] = "STC",
+    [LDSI    ] = "LDSI",
+    [DAD_SP  ] = "DAD SP",
+    [LDA     ] = "LDA",
+    [DCX_SP  ] = "DCX SP",
+    [INR_A   ] = "INR A",
+    [DCR_A   ] = "DCR A",
+    [MVI_A   ] = "MVI A",
+    [CMC     ] = "CMC",
+    [MOV_B_B ] = "MOV B,B",
+    [MOV_B_C ] = "MOV B,C",
+    [MOV_B_D ] = "MOV B,D",
+    [MOV_B_E ] = "MOV B,E",
+    [MOV_B_H ] = "MOV B,H",
+    [MOV_B_L ] = "MOV B,L",
+    [MOV_B_M ] = "MOV B,M",
+    [MOV_B_A ] = "MOV B,A",
+    [MOV_C_B ] = "MOV C,B",
+    [MOV_C_C ] = "MOV C,C",
+    [MOV_C_D ] = "MOV C,D",
+    [MOV_C_E ] = "MOV C,E",
+    [MOV_C_H ] = "MOV C,H",
+    [MOV_C_L ] = "MOV C,L",
+    [MOV_C_M ] = "MOV C,M",
+    [MOV_C_A ] = "MOV C,A",
+    [MOV_D_B ] = "MOV D,B",
+    [MOV_D_C ] = "MOV D,C",
+    [MOV_D_D ] = "MOV D,D",
+    [MOV_D_E ] = "MOV D,E",
+    [MOV_D_H ] = "MOV D,H",
+    [MOV_D_L ] = "MOV D,L",
+    [MOV_D_M ] = "MOV D,M",
+    [MOV_D_A ] = "MOV D,A",
+    [MOV_E_B ] = "MOV E,B",
+    [MOV_E_C ] = "MOV E,C",
+    [MOV_E_D ] = "MOV E,D",
+    [MOV_E_E ] = "MOV E,E",
+    [MOV_E_H ] = "MOV E,H",
+    [MOV_E_L ] = "MOV E,L",
+    [MOV_E_M ] = "MOV E,M",
+    [MOV_E_A ] = "MOV E,A",
+    [MOV_H_B ] = "MOV H,B",
+    [MOV_H_C ] = "MOV H,C",
+    [MOV_H_D ] = "MOV H,D",
+    [MOV_H_E ] = "MOV H,E",
+    [MOV_H_H ] = "MOV H,H",
+    [MOV_H_L ] = "MOV H,L",
+    [MOV_H_M ] = "MOV H,M",
+    [MOV_H_A ] = "MOV H,A",
+    [MOV_L_B ] = "MOV L,B",
+    [MOV_L_C ] = "MOV L,C",
+    [MOV_L_D ] = "MOV L,D",
+    [MOV_L_E ] = "MOV L,E",
+    [MOV_L_H ] = "MOV L,H",
+    [MOV_L_L ] = "MOV L,L",
+    [MOV_L_M ] = "MOV L,M",
+    [MOV_L_A ] = "MOV L,A",
+    [MOV_M_B ] = "MOV M,B",
+    [MOV_M_C ] = "MOV M,C",
+    [MOV_M_D ] = "MOV M,D",
+    [MOV_M_E ] = "MOV M,E",
+    [MOV_M_H ] = "MOV M,H",
+    [MOV_M_L ] = "MOV M,L",
+    [HLT     ] = "HLT",
+    [MOV_M_A ] = "MOV M,A",
+    [MOV_A_B ] = "MOV A,B",
+    [MOV_A_C ] = "MOV A,C",
+    [MOV_A_D ] = "MOV A,D",
+    [MOV_A_E ] = "MOV A,E",
+    [MOV_A_H ] = "MOV A,H",
+    [MOV_A_L ] = "MOV A,L",
+    [MOV_A_M ] = "MOV A,M",
+    [MOV_A_A ] = "MOV A,A",
+    [ADD_B   ] = "ADD B",
+    [ADD_C   ] = "ADD C",
+    [ADD_D   ] = "ADD D",
+    [ADD_E   ] = "ADD E",
+    [ADD_H   ] = "ADD H",
+    [ADD_L   ] = "ADD L",
+    [ADD_M   ] = "ADD M",
+    [ADD_A   ] = "ADD A",
+    [ADC_B   ] = "ADC B",
+    [ADC_C   ] = "ADC C",
+    [ADC_D   ] = "ADC D",
+    [ADC_E   ] = "ADC E",
+    [ADC_H   ] = "ADC H",
+    [ADC_L   ] = "ADC L",
+    [ADC_M   ] = "ADC M",
+    [ADC_A   ] = "ADC A",
+    [SUB_B   ] = "SUB B",
+    [SUB_C   ] = "SUB C",
+    [SUB_D   ] = "SUB D",
+    [SUB_E   ] = "SUB E",
+    [SUB_H   ] = "SUB H",
+    [SUB_L   ] = "SUB L",
+    [SUB_M   ] = "SUB M",
+    [SUB_A   ] = "SUB A",
+    [SBB_B   ] = "SBB B",
+    [SBB_C   ] = "SBB C",
+    [SBB_D   ] = "SBB D",
+    [SBB_E   ] = "SBB E",
+    [SBB_H   ] = "SBB H",
+    [SBB_L   ] = "SBB L",
+    [SBB_M   ] = "SBB M",
+    [SBB_A   ] = "SBB A",
+    [ANA_B   ] = "ANA B",
+    [ANA_C   ] = "ANA C",
+    [ANA_D   ] = "ANA D",
+    [ANA_E   ] = "ANA E",
+    [ANA_H   ] = "ANA H",
+    [ANA_L   ] = "ANA L",
+    [ANA_M   ] = "ANA M",
+    [ANA_A   ] = "ANA A",
+    [XRA_B   ] = "XRA B",
+    [XRA_C   ] = "XRA C",
+    [XRA_D   ] = "XRA D",
+    [XRA_E   ] = "XRA E",
+    [XRA_H   ] = "XRA H",
+    [XRA_L   ] = "XRA L",
+    [XRA_M   ] = "XRA M",
+    [XRA_A   ] = "XRA A",
+    [ORA_B   ] = "ORA B",
+    [ORA_C   ] = "ORA C",
+    [ORA_D   ] = "ORA D",
+    [ORA_E   ] = "ORA E",
+    [ORA_H   ] = "ORA H",
+    [ORA_L   ] = "ORA L",
+    [ORA_M   ] = "ORA M",
+    [ORA_A   ] = "ORA A",
+    [CMP_B   ] = "CMP B",
+    [CMP_C   ] = "CMP C",
+    [CMP_D   ] = "CMP D",
+    [CMP_E   ] = "CMP E",
+    [CMP_H   ] = "CMP H",
+    [CMP_L   ] = "CMP L",
+    [CMP_M   ] = "CMP M",
+    [CMP_A   ] = "CMP A",
+    [RNZ     ] = "RNZ",
+    [POP_B   ] = "POP B",
+    [JNZ     ] = "JNZ",
+    [JMP     ] = "JMP",
+    [CNZ     ] = "CNZ",
+    [PUSH_B  ] = "PUSH B",
+    [ADI     ] = "ADI",
+    [RST_0   ] = "RST 0",
+    [RZ      ] = "RZ",
+    [RET     ] = "RET",
+    [JZ      ] = "JZ",
+    [RSTV    ] = "RSTV",
+    [CZ      ] = "CZ",
+    [CALL    ] = "CALL",
+    [ACI     ] = "ACI",
+    [RST_1   ] = "RST 1",
+    [RNC     ] = "RNC",
+    [POP_D   ] = "POP D",
+    [JNC     ] = "JNC",
+    [OUT     ] = "OUT",
+    [CNC     ] = "CNC",
+    [PUSH_D  ] = "PUSH D",
+    [SUI     ] = "SUI",
+    [RST_2   ] = "RST 2",
+    [RC      ] = "RC",
+    [SHLX    ] = "SHLX",
+    [JC      ] = "JC",
+    [IN      ] = "IN",
+    [CC      ] = "CC",
+    [JNUI    ] = "JNUI",
+    [SBI     ] = "SBI",
+    [RST_3   ] = "RST 3",
+    [RPO     ] = "RPO",
+    [POP_H   ] = "POP H",
+    [JPO     ] = "JPO",
+    [XTHL    ] = "XTHL",
+    [CPO     ] = "CPO",
+    [PUSH_H  ] = "PUSH H",
+    [ANI     ] = "ANI",
+    [RST_4   ] = "RST 4",
+    [RPE     ] = "RPE",
+    [PCHL    ] = "PCHL",
+    [JPE     ] = "JPE",
+    [XCHG    ] = "XCHG",
+    [CPE     ] = "CPE",
+    [LHLX    ] = "LHLX",
+    [XRI     ] = "XRI",
+    [RST_5   ] = "RST 5",
+    [RP      ] = "RP",
+    [POP_PSW ] = "POP PSW",
+    [JP      ] = "JP",
+    [DI      ] = "DI",
+    [CP      ] = "CP",
+    [PUSH_PSW] = "PUSH PSW",
+    [ORI     ] = "ORI",
+    [RST_6   ] = "RST 6",
+    [RM      ] = "RM",
+    [SPHL    ] = "SPHL",
+    [JM      ] = "JM",
+    [EI      ] = "EI",
+    [CM      ] = "CM",
+    [JUI     ] = "JUI",
+    [CPI     ] = "CPI",
+    [RST_7   ] = "RST 7",
+};
+
+struct Profile *profile_create(const struct CPU *cpu)
+{
+    struct Profile *profile = calloc(1, sizeof(*profile));
+    if (!profile)
+        return NULL;
+    profile->cpu = cpu;
+    profile->nodes_size = 256;
+    profile->children_size = 2 * profile->nodes_size;
+    profile->nodes = calloc(profile->nodes_size, sizeof(*profile->nodes));
+    profile->children = calloc(profile->children_size, sizeof(*profile->children));
+    if (!profile->nodes || !profile->children) {
+        profile_destroy(profile);
+        return NULL;
+    }
+    profile->nnodes = 1;
+    return profile;
+}
+
+void profile_destroy(struct Profile *profile)
+{
+    if (!profile)
+        return;
+    free(profile->nodes);
+    free(profile->children);
+    free(profile);
+}
+
+static size_t child_slot(const struct Profile *profile, uint32_t parent, uint16_t addr)
+{
+    size_t mask = profile->children_size - 1;
+    size_t slot = (parent * 0x9E3779B1u ^ addr) & mask;
+    for (;;) {
+        uint32_t node = profile->children[slot];
+        if (!node || (profile->nodes[node - 1].parent == parent &&
+                      profile->nodes[node - 1].addr == addr))
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+static bool grow(struct Profile *profile)
+{
+    size_t nodes_size = 2 * profile->nodes_size;
+    struct ProfileNode *nodes = realloc(profile->nodes, nodes_size * sizeof(*nodes));
+    if (!nodes)
+        return false;
+    profile->nodes = nodes;
+    profile->nodes_size = nodes_size;
+    uint32_t *children = calloc(2 * nodes_size, sizeof(*children));
+    if (!children)
+        return false;
+    free(profile->children);
+    profile->children = children;
+    profile->children_size = 2 * nodes_size;
+    for (size_t node = 1; node < profile->nnodes; ++node)
+        children[child_slot(profile, nodes[node].parent, nodes[node].addr)] = node + 1;
+    return true;
+}
+
+/* The node for a call to addr from parent, or parent if there is no room */
+static uint32_t child(struct Profile *profile, uint32_t parent, uint16_t addr)
+{
+    size_t slot = child_slot(profile, parent, addr);
+    if (profile->children[slot])
+        return profile->children[slot] - 1;
+    if (profile->nnodes == profile->nodes_size) {
+        if (!grow(profile))
+            return parent;
+        slot = child_slot(profile, parent, addr);
+    }
+    uint32_t node = profile->nnodes++;
+    profile->nodes[node] = (struct ProfileNode) {.parent = parent, .addr = addr};
+    profile->children[slot] = node + 1;
+    return node;
+}
+
+static uint32_t current(const struct Profile *profile)
+{
+    return profile->depth ? profile->frames[profile->depth - 1].node : 0;
+}
+
+/* Charge the last instruction with the T-states taken since it started */
+static void charge(struct Profile *profile)
+{
+    uint64_t spent = profile->cpu->cycles - profile->cycles;
+    profile->cycles = profile->cpu->cycles;
+    profile->opcodes[profile->opcode].cycles += spent;
+    profile->pcs[profile->pc].cycles += spent;
+    profile->nodes[current(profile)].cycles += spent;
+}
+
+static bool is_call(uint8_t opcode)
+{
+    /* CALL, conditional calls and RST */
+    return opcode == CALL || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7;
+}
+
+/* Called before the instruction at pc runs. Calls are recognised by the
+ * return address they push; a function is over once the stack is back
+ * above that, whether by RET or any other way of dropping it. */
+void profile_step(struct Profile *profile, uint16_t pc, uint8_t opcode)
+{
+    uint16_t sp = profile->cpu->regs.sp;
+    if (profile->started) {
+        charge(profile);
+        while (profile->depth &&
+               (uint16_t) (sp - profile->frames[profile->depth - 1].sp - 1) < 0x8000)
+            --profile->depth;
+        if (is_call(profile->opcode) && sp == (uint16_t) (profile->sp - 2) &&
+            profile->depth < PROFILE_DEPTH) {
+            uint32_t node = child(profile, current(profile), pc);
+            profile->frames[profile->depth++] = (struct ProfileFrame) {.node = node, .sp = sp};
+        }
+    } else {
+        profile->started = true;
+        profile->cycles = profile->cpu->cycles;
+        profile->nodes[0].addr = pc;
+    }
+    ++profile->opcodes[opcode].executions;
+    ++profile->pcs[pc].executions;
+    profile->opcode = opcode;
+    profile->pc = pc;
+    profile->sp = sp;
+}
+
+struct Ranked {
+    uint64_t cycles;
+    uint32_t key;
+};
+
+static int by_cycles(const void *a, const void *b)
+{
+    uint64_t x = ((const struct Ranked *) a)->cycles, y = ((const struct Ranked *) b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* The keys with a count, most T-states first */
+static size_t rank(struct Ranked *ranked, const struct ProfileCount *counts, size_t n)
+{
+    size_t nranked = 0;
+    for (uint32_t key = 0; key < n; ++key)
+        if (counts[key].executions)
+            ranked[nranked++] = (struct Ranked) {.cycles = counts[key].cycles, .key = key};
+    qsort(ranked, nranked, sizeof(*ranked), by_cycles);
+    return nranked;
+}
+
+void profile_report(FILE *out, struct Profile *profile, unsigned top)
+{
+    if (profile->started)
+        charge(profile);
+    struct Ranked *ranked = malloc(MEM_SIZE * sizeof(*ranked));
+    if (!ranked) {
+        perror("malloc");
+        return;
+    }
+    uint64_t total = 0;
+    for (unsigned op = 0; op < 256; ++op)
+        total += profile->opcodes[op].cycles;
+    double scale = total ? 100.0 / total : 0;
+
+    size_t n = rank(ranked, profile->opcodes, 256);
+    fprintf(out, "opcode  mnemonic   executions       T-states       %%\n");
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t op = ranked[i].key;
+        fprintf(out, "  %02x    %-9s %11llu %14llu %6.2f\n", (unsigned) op, opcode_names[op],
+                (unsigned long long) profile->opcodes[op].executions,
+                (unsigned long long) ranked[i].cycles, ranked[i].cycles * scale);
+    }
+
+    n = rank(ranked, profile->pcs, MEM_SIZE);
+    fprintf(out, "\n  pc    mnemonic   executions       T-states       %%\n");
+    for (size_t i = 0; i < n && i < top; ++i) {
+        uint32_t pc = ranked[i].key;
+        /* the opcode there now, which self-modifying code may have changed */
+        uint8_t op = profile->cpu->memory[pc];
+        fprintf(out, "%04x    %-9s %11llu %14llu %6.2f\n", (unsigned) pc, opcode_names[op],
+                (unsigned long long) profile->pcs[pc].executions,
+                (unsigned long long) ranked[i].cycles, ranked[i].cycles * scale);
+    }
+    free(ranked);
+}
+
+void profile_folded(FILE *out, struct Profile *profile)
+{
+    if (profile->started)
+        charge(profile);
+    for (size_t node = 0; node < profile->nnodes; ++node) {
+        if (!profile->nodes[node].cycles)
+            continue;
+        uint16_t path[PROFILE_DEPTH + 1];
+        unsigned len = 0;
+        for (uint32_t n = node; ; n = profile->nodes[n].parent) {
+            path[len++] = profile->nodes[n].addr;
+            if (!n)
+                break;
+        }
+        while (len--)
+            fprintf(out, "%04x%c", path[len], len ? ';' : ' ');
+        fprintf(out, "%llu\n", (unsigned long long) profile->nodes[node].cycles);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef EMU8080_PROFILEH
+#define EMU8080_PROFILEH
+#include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define PROFILE_DEPTH 64        /* calls deeper than this count as their caller */
+
+/* A function called from its parent, identified by its entry address */
+struct ProfileNode {
+    uint32_t parent;
+    uint16_t addr;
+    uint64_t cycles;        /* spent in the function itself */
+};
+
+struct ProfileFrame {
+    uint32_t node;
+    uint16_t sp;            /* where the return address is */
+};
+
+struct ProfileCount {
+    uint64_t executions;
+    uint64_t cycles;
+};
+
+struct Profile {
+    const struct CPU *cpu;
+    struct ProfileCount opcodes[256];
+    struct ProfileCount pcs[MEM_SIZE];
+    /* the instruction whose T-states are still to be counted */
+    bool started;
+    uint8_t opcode;
+    uint16_t pc, sp;
+    uint64_t cycles;
+    /* shadow call stack; node 0 is wherever profiling started */
+    struct ProfileFrame frames[PROFILE_DEPTH];
+    unsigned depth;
+    struct ProfileNode *nodes;
+    size_t nnodes, nodes_size;
+    uint32_t *children;     /* node + 1 by parent and addr, open addressing */
+    size_t children_size;
+};
+
+extern struct Profile *profile_create(const struct CPU *cpu);
+extern void profile_destroy(struct Profile *profile);
+extern void profile_step(struct Profile *profile, uint16_t pc, uint8_t opcode);
+/* Executions and T-states by opcode, then the top pcs by T-states */
+extern void profile_report(FILE *out, struct Profile *profile, unsigned top);
+/* One line per call stack with the T-states spent at its top, in the
+ * collapsed format flamegraph.pl and similar tools read */
+extern void profile_folded(FILE *out, struct Profile *profile);
+#endif
@@ -0,0 +1,127 @@
+/* The reference core for lockstep runs: cpu.c built the plain way, with a
+ * switch, a bool per flag and nothing compiled, under names of its own so
+ * that it links next to the core being checked */
+#ifdef EMU8080_LOCKSTEP
+#undef EMU8080_THREADED
+#undef EMU8080_JIT
+#undef EMU8080_LAZY_FLAGS
+#undef EMU8080_PACKED_FLAGS
+#undef EMU8080_TRACE
+#undef EMU8080_PROFILE
+
+#define cpu_attach_port ref_cpu_attach_port
+#define cpu_buffer_port ref_cpu_buffer_port
+#define cpu_clear_breakpoint ref_cpu_clear_breakpoint
+#define cpu_create ref_cpu_create
+#define cpu_destroy ref_cpu_destroy
+#define cpu_flush_ports ref_cpu_flush_ports
+#define cpu_free_snapshot ref_cpu_free_snapshot
+#define cpu_get_psw ref_cpu_get_psw
+#define cpu_interrupt ref_cpu_interrupt
+#define cpu_invalidate ref_cpu_invalidate
+#define cpu_map_io ref_cpu_map_io
+#define cpu_map_ram ref_cpu_map_ram
+#define cpu_map_rom ref_cpu_map_rom
+#define cpu_profile ref_cpu_profile
+#define cpu_reset ref_cpu_reset
+#define cpu_restore ref_cpu_restore
+#define cpu_set_breakpoint ref_cpu_set_breakpoint
+#define cpu_set_psw ref_cpu_set_psw
+#define cpu_share_rom ref_cpu_share_rom
+#define cpu_snapshot ref_cpu_snapshot
+#define cpu_trace ref_cpu_trace
+#define instruction ref_instruction
+#define merge_bytes ref_merge_bytes
+#define read_byte ref_read_byte
+#define read_next_byte ref_read_next_byte
+#define run ref_run
+#define write_byte ref_write_byte
+
+#include "cpu.c"
+
+struct RefCPU {
+    struct CPU *cpu;
+    bool after_ei;          /* an interrupt waits for one more instruction */
+    uint16_t history[LOCKSTEP_HISTORY];
+    uint64_t steps;
+};
+
+struct RefCPU *ref_create(struct LockstepLog *log, const uint8_t *memory,
+                          const uint8_t *page_flags)
+{
+    struct RefCPU *ref = calloc(1, sizeof(*ref));
+    if (!ref || !(ref->cpu = cpu_create())) {
+        free(ref);
+        return NULL;
+    }
+    memcpy(ref->cpu->memory, memory, MEM_SIZE);
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        ref->cpu->page_flags[page] = page_flags[page] & PAGE_ROM;
+    ref->cpu->io_trap = true;
+    ref->cpu->lockstep = log;
+    return ref;
+}
+
+void ref_destroy(struct RefCPU *ref)
+{
+    if (!ref)
+        return;
+    cpu_destroy(ref->cpu);
+    free(ref);
+}
+
+void ref_load(struct RefCPU *ref, const struct LockstepState *state)
+{
+    struct CPU *cpu = ref->cpu;
+    cpu->cycles = state->cycles;
+    cpu->instructions = state->instructions;
+    cpu->regs.pc = state->pc;
+    cpu->regs.sp = state->sp;
+    cpu->regs.bc = state->bc;
+    cpu->regs.de = state->de;
+    cpu->regs.hl = state->hl;
+    cpu->regs.a = state->a;
+    set_psw(cpu, state->psw);
+    cpu->interrupt_enabled = state->interrupt_enabled;
+    cpu->interrupt_pending = state->interrupt_pending;
+    cpu->interrupt_vector = state->interrupt_vector;
+    cpu->halted = state->halted;
+    ref->after_ei = false;
+}
+
+void ref_save(struct RefCPU *ref, struct LockstepState *state)
+{
+    lockstep_save(ref->cpu, get_psw(ref->cpu), state);
+}
+
+void ref_poke(struct RefCPU *ref, uint16_t addr, uint8_t value)
+{
+    if (!(ref->cpu->page_flags[addr >> MEM_PAGE_SHIFT] & PAGE_ROM))
+        ref->cpu->memory[addr] = value;
+}
+
+int ref_step(struct RefCPU *ref)
+{
+    struct CPU *cpu = ref->cpu;
+    ref->history[ref->steps++ % LOCKSTEP_HISTORY] = cpu->regs.pc;
+    if (interrupt_ready(cpu) && !ref->after_ei) {
+        take_interrupt(cpu);
+        return EXIT_OK;
+    }
+    if (cpu->halted) {
+        --ref->steps;
+        return EXIT_HLT;
+    }
+    uint8_t opcode = read_next_byte(cpu);
+    ref->after_ei = opcode == EI;
+    return instruction(cpu, opcode);
+}
+
+size_t ref_history(const struct RefCPU *ref, uint16_t *pcs)
+{
+    size_t n = ref->steps < LOCKSTEP_HISTORY ? ref->steps : LOCKSTEP_HISTORY;
+    for (size_t i = 0; i < n; ++i)
+        pcs[i] = ref->history[(ref->steps - n + i) % LOCKSTEP_HISTORY];
+    return n;
+}
+#endif
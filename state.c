@@ -0,0 +1,202 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cpu.h"
+#include "state.h"
+
+/* Read back as a different number on a host of the other byte order */
+#define STATE_MAGIC 0x53303838u    /* "880S" */
+
+#define PAGE_ZERO 0     /* all zeros, not stored */
+#define PAGE_STORED 1   /* stored after the header, in page order */
+#define PAGE_SKIPPED 2  /* ROM or a device when saved, left alone */
+
+/* The file is this header followed by the stored pages. It is laid out so
+ * that a mapped file can be used in place. */
+struct StateFile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t checksum;  /* Adler-32 of everything from npages on */
+    uint32_t npages;    /* pages stored after the header */
+    uint16_t pc, sp, bc, de, hl;
+    uint8_t a, psw;
+    uint8_t interrupt_enabled, interrupt_pending, interrupt_vector, halted;
+    uint8_t port;
+    uint8_t reserved[7];
+    uint64_t cycles;
+    uint64_t instructions;
+    uint8_t pages[MEM_PAGES];
+};
+
+_Static_assert(sizeof(struct StateFile) == 56 + MEM_PAGES, "padding in struct StateFile");
+
+#define CHECKED_FROM offsetof(struct StateFile, npages)
+
+static uint32_t adler32(uint32_t adler, const uint8_t *data, size_t len)
+{
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (len) {
+        /* the most bytes before b can overflow */
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+static bool is_zero(const uint8_t *data, size_t len)
+{
+    return !data[0] && !memcmp(data, data + 1, len - 1);
+}
+
+int state_save(struct CPU *cpu, const char *path)
+{
+    struct StateFile header = {
+            .magic = STATE_MAGIC,
+            .version = STATE_VERSION,
+            .pc = cpu->regs.pc,
+            .sp = cpu->regs.sp,
+            .bc = cpu->regs.bc,
+            .de = cpu->regs.de,
+            .hl = cpu->regs.hl,
+            .a = cpu->regs.a,
+            .psw = cpu_get_psw(cpu),
+            .interrupt_enabled = cpu->interrupt_enabled,
+            .interrupt_pending = cpu->interrupt_pending,
+            .interrupt_vector = cpu->interrupt_vector,
+            .halted = cpu->halted,
+            .port = cpu->port,
+            .cycles = cpu->cycles,
+            .instructions = cpu->instructions,
+    };
+    for (unsigned page = 0; page < MEM_PAGES; ++page) {
+        const uint8_t *data = cpu->memory + page * MEM_PAGE_SIZE;
+        if (cpu->page_flags[page] & (PAGE_ROM | PAGE_IO))
+            header.pages[page] = PAGE_SKIPPED;
+        else if (!is_zero(data, MEM_PAGE_SIZE)) {
+            header.pages[page] = PAGE_STORED;
+            ++header.npages;
+        }
+    }
+    uint32_t checksum = adler32(1, (const uint8_t *) &header + CHECKED_FROM,
+                                sizeof(header) - CHECKED_FROM);
+    for (unsigned page = 0; page < MEM_PAGES; ++page)
+        if (header.pages[page] == PAGE_STORED)
+            checksum = adler32(checksum, cpu->memory + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+    header.checksum = checksum;
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("fopen");
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (unsigned page = 0; ok && page < MEM_PAGES; ++page)
+        if (header.pages[page] == PAGE_STORED)
+            ok = fwrite(cpu->memory + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE, 1, file) == 1;
+    if (fclose(file) == EOF || !ok) {
+        perror("fwrite");
+        return -1;
+    }
+    return 0;
+}
+
+/* Everything is checked before cpu is touched */
+static bool valid(const struct StateFile *header, size_t size, const char *path)
+{
+    if (size < sizeof(*header) || header->magic != STATE_MAGIC) {
+        fprintf(stderr, "%s: not a save state\n", path);
+        return false;
+    }
+    if (header->version != STATE_VERSION) {
+        fprintf(stderr, "%s: save state version %u, expected %u\n", path,
+                (unsigned) header->version, STATE_VERSION);
+        return false;
+    }
+    unsigned stored = 0;
+    for (unsigned page = 0; page < MEM_PAGES; ++page) {
+        if (header->pages[page] > PAGE_SKIPPED) {
+            fprintf(stderr, "%s: corrupt save state\n", path);
+            return false;
+        }
+        stored += header->pages[page] == PAGE_STORED;
+    }
+    if (stored != header->npages || size != sizeof(*header) + (size_t) stored * MEM_PAGE_SIZE ||
+        adler32(1, (const uint8_t *) header + CHECKED_FROM, size - CHECKED_FROM) != header->checksum) {
+        fprintf(stderr, "%s: corrupt save state\n", path);
+        return false;
+    }
+    return true;
+}
+
+int state_load(struct CPU *cpu, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (size)
+            perror("mmap");
+        else
+            fprintf(stderr, "%s: not a save state\n", path);
+        return -1;
+    }
+    const struct StateFile *header = map;
+    if (!valid(header, size, path)) {
+        munmap(map, size);
+        return -1;
+    }
+
+    cpu->regs.pc = header->pc;
+    cpu->regs.sp = header->sp;
+    cpu->regs.bc = header->bc;
+    cpu->regs.de = header->de;
+    cpu->regs.hl = header->hl;
+    cpu->regs.a = header->a;
+    cpu_set_psw(cpu, header->psw);
+    cpu->interrupt_enabled = header->interrupt_enabled;
+    cpu->interrupt_pending = header->interrupt_pending;
+    cpu->interrupt_vector = header->interrupt_vector & 7;
+    cpu->halted = header->halted;
+    cpu->port = header->port;
+    cpu->cycles = header->cycles;
+    cpu->instructions = header->instructions;
+    const uint8_t *data = (const uint8_t *) (header + 1);
+    for (unsigned page = 0; page < MEM_PAGES; ++page) {
+        uint8_t *memory = cpu->memory + page * MEM_PAGE_SIZE;
+        if (header->pages[page] == PAGE_SKIPPED || cpu->page_flags[page] & (PAGE_ROM | PAGE_IO)) {
+            data += header->pages[page] == PAGE_STORED ? MEM_PAGE_SIZE : 0;
+            continue;
+        }
+        if (header->pages[page] == PAGE_STORED) {
+            memcpy(memory, data, MEM_PAGE_SIZE);
+            data += MEM_PAGE_SIZE;
+        } else {
+            memset(memory, 0, MEM_PAGE_SIZE);
+        }
+    }
+    munmap(map, size);
+    cpu_invalidate(cpu);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef EMU8080_STATEH
+#define EMU8080_STATEH
+#include "cpu.h"
+
+#define STATE_VERSION 1
+
+/* Write registers, interrupt state, counters and RAM to path. Pages of
+ * zeros are left out, and so are ROM and device pages, which belong to the
+ * host like the rest of the memory map. */
+extern int state_save(struct CPU *cpu, const char *path);
+/* Map a file written by state_save() and apply it to cpu. Files of another
+ * version, or whose checksum does not match, are refused and leave cpu as
+ * it was. */
+extern int state_load(struct CPU *cpu, const char *path);
+#endif
@@ -1,39 +1,374 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "cpu.h"
 #include "io.h"
+#include "cpm.h"
+#include "pool.h"
+
+#define SLICE_CYCLES 10000000
+#define SUITE_CYCLES 100000000000ull   /* far more than 8080EXM takes */
+#define EXPECTED_DIR "roms/"           /* NAME.out next to NAME.COM */
 
 const char *test_files[] = {"CPUTEST.COM", "TST8080.COM", "8080PRE.COM", "8080EXM.COM",};
+#define NSUITES (sizeof(test_files) / sizeof(test_files[0]))
+
+struct Suite {
+    const char *rom;
+    char *output;           /* console transcript */
+    size_t len;
+    const char *error;      /* why the suite did not run to the end */
+    uint64_t instructions;
+    double seconds;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run one suite on a machine of its own, capturing its console */
+static void run_suite(size_t index, void *arg)
+{
+    struct Suite *suite = (struct Suite *) arg + index;
+    double start = now();
+    FILE *out = open_memstream(&suite->output, &suite->len);
+    struct CPU *cpu = out ? cpu_create() : NULL;
+    struct Cpm *cpm = cpu ? cpm_create(cpu, ".", NULL, out) : NULL;
+    struct Image *image = cpm ? image_open(suite->rom) : NULL;
+    suite->error = "cannot load";
+    if (image && image_load(cpu, image, CPM_TPA) >= 0) {
+        cpm_boot(cpm, NULL);
+        /* the program ends by going back to 0 */
+        int ret;
+        while ((ret = run(cpu, SLICE_CYCLES)) == EXIT_BUDGET && cpu->cycles < SUITE_CYCLES)
+            ;
+        suite->error = ret == EXIT_RST ? NULL : ret == EXIT_BUDGET ? "did not finish" : "stopped";
+        suite->instructions = cpu->instructions;
+    }
+    image_close(image);
+    cpm_destroy(cpm);
+    cpu_destroy(cpu);
+    if (out)
+        fclose(out);
+    suite->seconds = now() - start;
+}
+
+static char *expected_path(const char *rom)
+{
+    const char *dot = strrchr(rom, '.');
+    int base = dot ? (int) (dot - rom) : (int) strlen(rom);
+    size_t size = sizeof(EXPECTED_DIR) + base + sizeof(".out");
+    char *path = malloc(size);
+    if (path)
+        snprintf(path, size, "%s%.*s.out", EXPECTED_DIR, base, rom);
+    return path;
+}
+
+/* The whole file at path in a malloc'd buffer */
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    char *data = NULL;
+    if (!fseek(file, 0, SEEK_END) && (*len = ftell(file)) != (size_t) -1 &&
+        !fseek(file, 0, SEEK_SET) && (data = malloc(*len + 1)) &&
+        fread(data, 1, *len, file) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
 
-int main(void)
+static void print_line(FILE *out, const char *label, const char *text, size_t len, size_t at)
 {
-    for (size_t z = 0; z < sizeof(test_files) / sizeof(test_files[0]); ++z) {
-        size_t offset = 0x100;
-        uint8_t *rom = memory + offset;
-        /* clear memory */
-        memset(&memory[0], 0, sizeof(memory));
-        /* load rom into memory */
-        if (!load_rom(rom, MEM_SIZE - offset, test_files[z])) {
-            return EXIT_FAILURE;
+    size_t end = at;
+    while (end < len && text[end] != '\n' && text[end] != '\r')
+        ++end;
+    fprintf(out, "  %s %.*s\n", label, (int) (end - at), text + at);
+}
+
+/* Compare the transcript with what is expected, telling out about the
+ * first line that differs */
+static bool check(FILE *out, const struct Suite *suite, const char *path)
+{
+    size_t len;
+    char *expected = read_file(path, &len);
+    if (!expected) {
+        fprintf(out, "  %s: cannot read; ./test -w writes it\n", path);
+        return false;
+    }
+    size_t at = 0, line = 1, line_start = 0;
+    while (at < len && at < suite->len && expected[at] == suite->output[at]) {
+        if (expected[at++] == '\n') {
+            ++line;
+            line_start = at;
         }
-        regs.pc = offset;
-        /* Inject ret instruction */
-        memory[0x05] = RET;
-        /* Main CPU loop */
-        while (1) {
-            if (regs.pc == 0x05) {
-                if (regs.c == 0x09) {
-                    uint16_t i;
-                    for (i = regs.de; read_byte(i) != '$'; ++i)
-                        putc(read_byte(i), stdout);
-                } else if (regs.c == 0x02)
-                    putc(regs.e, stdout);
-            }
-            enum OpCode opcode = read_next_byte();
-            if (instruction(opcode))
+    }
+    bool same = at == len && at == suite->len;
+    if (!same) {
+        fprintf(out, "  %s:%zu differs\n", path, line);
+        print_line(out, "expected:", expected, len, line_start);
+        print_line(out, "got:     ", suite->output, suite->len, line_start);
+    }
+    free(expected);
+    return same;
+}
+
+/* A write to a banked page must reach the bank when it is mapped out,
+ * even after a snapshot marked the page clean */
+static bool check_bank_snapshot(void)
+{
+    static uint8_t bank_a[MEM_PAGE_SIZE], bank_b[MEM_PAGE_SIZE];
+    static const uint8_t program[] = {MVI_A, 0x42, STA, 0x00, 0x80, HLT};
+    struct CPU *cpu = cpu_create();
+    if (!cpu)
+        return false;
+    bool ok = !cpu_map_ram(cpu, 0x8000, MEM_PAGE_SIZE, bank_a);
+    for (size_t i = 0; i < sizeof(program); ++i)
+        write_byte(cpu, 0x100 + i, program[i]);
+    cpu->regs.pc = 0x100;
+    ok = ok && run(cpu, 100) == EXIT_HLT;
+    struct Snapshot *snapshot = ok ? cpu_snapshot(cpu) : NULL;
+    ok = snapshot && !cpu_map_ram(cpu, 0x8000, MEM_PAGE_SIZE, bank_b) && bank_a[0] == 0x42;
+    if (snapshot) {
+        /* and a restore marks it clean just the same */
+        ok = !cpu_map_ram(cpu, 0x8000, MEM_PAGE_SIZE, bank_a) && ok;
+        write_byte(cpu, 0x8001, 0x24);
+        cpu_restore(cpu, snapshot);
+        write_byte(cpu, 0x8002, 0x99);
+        cpu_reset(cpu);
+        ok = ok && bank_a[2] == 0x99;
+    }
+    cpu_free_snapshot(snapshot);
+    cpu_destroy(cpu);
+    return ok;
+}
+
+/* Two machines map the same ROM, shared where it fills host pages and
+ * copied after: guest writes to either part are dropped, and neither a
+ * restore nor a reset touches it */
+static bool check_shared_rom(void)
+{
+    static const uint8_t program[] = {MVI_A, 0x5A, STA, 0x00, 0x40, STA, 0x00, 0x80, HLT};
+    struct Image *image = image_open("CPUTEST.COM");
+    struct CPU *cpus[2] = {cpu_create(), cpu_create()};
+    bool ok = image && cpus[0] && cpus[1];
+    for (int i = 0; ok && i < 2; ++i)
+        ok = !image_map_rom(cpus[i], image, 0x4000) && (cpus[i]->page_flags[0x40] & PAGE_SHARED) &&
+             !(cpus[i]->page_flags[0x80] & PAGE_SHARED) && (cpus[i]->page_flags[0x80] & PAGE_ROM);
+    struct CPU *cpu = cpus[0];
+    for (size_t i = 0; ok && i < sizeof(program); ++i)
+        write_byte(cpu, 0x100 + i, program[i]);
+    struct Snapshot *snapshot = ok ? cpu_snapshot(cpu) : NULL;
+    if (snapshot) {
+        cpu->regs.pc = 0x100;
+        ok = run(cpu, 100) == EXIT_HLT;
+        cpu_restore(cpu, snapshot);
+        cpu_reset(cpus[1]);
+        cpu_reset(cpu);
+        for (int i = 0; i < 2; ++i)
+            ok = ok && !memcmp(cpus[i]->memory + 0x4000, image->data, image->size);
+    }
+    ok = ok && snapshot;
+    cpu_free_snapshot(snapshot);
+    cpu_destroy(cpus[0]);
+    cpu_destroy(cpus[1]);
+    if (image)
+        image_close(image);
+    return ok;
+}
+
+/* Reset cpu with program at 0x100, HLT at the RST 1 and RST 2 vectors and
+ * the stack at 0x8000 */
+static void load_program(struct CPU *cpu, const uint8_t *program, size_t len)
+{
+    cpu_reset(cpu);
+    for (size_t i = 0; i < len; ++i)
+        write_byte(cpu, 0x100 + i, program[i]);
+    write_byte(cpu, 0x08, HLT);
+    write_byte(cpu, 0x10, HLT);
+    cpu->regs.pc = 0x100;
+    cpu->regs.sp = 0x8000;
+}
+
+static uint16_t stacked_pc(struct CPU *cpu)
+{
+    return merge_bytes(read_byte(cpu, cpu->regs.sp), read_byte(cpu, cpu->regs.sp + 1));
+}
+
+/* An RST asked for under DI is taken one instruction after EI, or out of
+ * the HLT that follows it, and not at all while interrupts stay disabled */
+static bool check_interrupts(void)
+{
+    static const uint8_t ei_nop[] = {EI, NOP, NOP}, ei_hlt[] = {EI, HLT}, di[] = {DI, NOP, HLT};
+    struct CPU *cpu = cpu_create();
+    if (!cpu)
+        return false;
+    /* EI 4, NOP 4, RST 11, HLT 7 */
+    load_program(cpu, ei_nop, sizeof(ei_nop));
+    cpu_interrupt(cpu, 1);
+    bool ok = run(cpu, 1000) == EXIT_HLT && cpu->regs.pc == 0x09 && cpu->cycles == 26 &&
+              stacked_pc(cpu) == 0x102 && !cpu->interrupt_enabled && !cpu->interrupt_pending;
+    /* halted with nothing pending: the slice idles out, the RST comes in the next */
+    load_program(cpu, ei_hlt, sizeof(ei_hlt));
+    ok = ok && run(cpu, 100) == EXIT_BUDGET && cpu->halted && cpu->regs.pc == 0x102 &&
+         cpu->cycles == 100;
+    cpu_interrupt(cpu, 2);
+    ok = ok && run(cpu, 100) == EXIT_HLT && cpu->regs.pc == 0x11 && cpu->cycles == 118 &&
+         stacked_pc(cpu) == 0x102;
+    load_program(cpu, di, sizeof(di));
+    cpu_interrupt(cpu, 1);
+    ok = ok && run(cpu, 1000) == EXIT_HLT && cpu->regs.pc == 0x103 && cpu->cycles == 15 &&
+         cpu->regs.sp == 0x8000 && cpu->interrupt_pending;
+    cpu_destroy(cpu);
+    return ok;
+}
+
+/* A printer taking buffered output, with a status port reading back how
+ * many characters it has been handed */
+struct Printer {
+    char log[16];       /* flushed batches, each ended by '|', and 'S' per status read */
+    size_t len;
+    uint8_t printed;
+};
+
+static void printer_flush(void *device, uint8_t port, const uint8_t *data, size_t len)
+{
+    (void) port;
+    struct Printer *printer = device;
+    for (size_t i = 0; i < len && printer->len < sizeof(printer->log) - 1; ++i)
+        printer->log[printer->len++] = data[i];
+    if (printer->len < sizeof(printer->log) - 1)
+        printer->log[printer->len++] = '|';
+    printer->printed += len;
+}
+
+static uint8_t printer_status(void *device, uint8_t port)
+{
+    (void) port;
+    struct Printer *printer = device;
+    if (printer->len < sizeof(printer->log) - 1)
+        printer->log[printer->len++] = 'S';
+    return printer->printed;
+}
+
+/* Buffered OUTs reach the device in one batch before an unbuffered port is
+ * read and before run() returns; with io_trap set an unattached port stops
+ * the run */
+static bool check_ports(void)
+{
+    static const uint8_t status[] = {
+        MVI_A, 'a', OUT, 0x10, MVI_A, 'b', OUT, 0x10, IN, 0x20, MOV_B_A, MVI_A, 'c', OUT, 0x10, HLT,
+    };
+    static const uint8_t trap[] = {MVI_A, 'd', OUT, 0x10, OUT, 0x30, HLT};
+    struct Printer printer = {0};
+    struct CPU *cpu = cpu_create();
+    if (!cpu)
+        return false;
+    load_program(cpu, status, sizeof(status));
+    bool ok = !cpu_buffer_port(cpu, 0x10, printer_flush, &printer) &&
+              !cpu_attach_port(cpu, 0x20, printer_status, NULL, &printer);
+    ok = ok && run(cpu, 1000) == EXIT_HLT && cpu->regs.b == 2 && !strcmp(printer.log, "ab|Sc|");
+    load_program(cpu, trap, sizeof(trap));
+    cpu->io_trap = true;
+    ok = ok && run(cpu, 1000) == EXIT_IO && cpu->port == 0x30 && cpu->regs.pc == 0x106 &&
+         !strcmp(printer.log, "ab|Sc|d|");
+    cpu_destroy(cpu);
+    return ok;
+}
+
+static void usage(const char *program_name)
+{
+    fprintf(stderr, "usage: %s [-v] [-w] [-j threads]\n"
+                    "  -v  print each transcript\n"
+                    "  -w  write the transcripts as the expected output\n", program_name);
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false, write = false;
+    unsigned nthreads = 0;
+    int c;
+    while ((c = getopt(argc, argv, "hvwj:")) != -1) {
+        switch (c) {
+            case 'v':
+                verbose = true;
                 break;
+            case 'w':
+                write = true;
+                break;
+            case 'j':
+                nthreads = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    struct Suite suites[NSUITES] = {0};
+    for (size_t i = 0; i < NSUITES; ++i)
+        suites[i].rom = test_files[i];
+    double start = now();
+    if (pool_run(NSUITES, nthreads, run_suite, suites)) {
+        perror("pool_run");
+        return EXIT_FAILURE;
+    }
+    double elapsed = now() - start;
+
+    bool ok = check_bank_snapshot();
+    printf("%-12s %s\n", "banks", ok ? "ok" : "FAIL");
+    bool shared = check_shared_rom();
+    printf("%-12s %s\n", "shared rom", shared ? "ok" : "FAIL");
+    ok = ok && shared;
+    bool interrupts = check_interrupts();
+    printf("%-12s %s\n", "interrupts", interrupts ? "ok" : "FAIL");
+    ok = ok && interrupts;
+    bool ports = check_ports();
+    printf("%-12s %s\n", "ports", ports ? "ok" : "FAIL");
+    ok = ok && ports;
+    for (size_t i = 0; i < NSUITES; ++i) {
+        struct Suite *suite = &suites[i];
+        char *path = expected_path(suite->rom), *report = NULL;
+        size_t report_len;
+        bool passed = false;
+        if (!path) {
+            perror("malloc");
+        } else if (suite->error) {
+            printf("%-12s %s\n", suite->rom, suite->error);
+        } else if (write) {
+            FILE *file = fopen(path, "wb");
+            passed = file && fwrite(suite->output, 1, suite->len, file) == suite->len;
+            if (!file || fclose(file) == EOF)
+                passed = false;
+            if (!passed)
+                perror(path);
+        } else {
+            /* the details go under the suite's line */
+            FILE *detail = open_memstream(&report, &report_len);
+            passed = detail && check(detail, suite, path);
+            if (detail)
+                fclose(detail);
         }
-        printf("\n\n");
+        if (!suite->error)
+            printf("%-12s %-4s %8.2f s %14llu instructions\n%s", suite->rom, passed ? "ok" : "FAIL",
+                   suite->seconds, (unsigned long long) suite->instructions, report ? report : "");
+        free(report);
+        ok &= passed;
+        free(path);
     }
+    printf("%zu suites in %.2f s\n", NSUITES, elapsed);
+    for (size_t i = 0; verbose && i < NSUITES; ++i)
+        printf("\n%s:\n%.*s\n", suites[i].rom, (int) suites[i].len, suites[i].output);
+    for (size_t i = 0; i < NSUITES; ++i)
+        free(suites[i].output);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "cycles.h"
+#include "trace.h"
+
+/* Read back as a different number on a host of the other byte order */
+#define TRACE_MAGIC 0x54303838u    /* "880T" */
+
+/* The file is this header followed by its chunks, oldest first */
+struct TraceFile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+};
+
+struct Trace *trace_create(const struct CPU *cpu, size_t size)
+{
+    struct Trace *trace = calloc(1, sizeof(*trace));
+    if (!trace)
+        return NULL;
+    trace->cpu = cpu;
+    trace->nchunks = size > TRACE_CHUNK ? size / TRACE_CHUNK : 1;
+    if (!(trace->buffer = malloc(trace->nchunks * TRACE_CHUNK))) {
+        free(trace);
+        return NULL;
+    }
+    /* the first record opens the first chunk */
+    return trace;
+}
+
+void trace_destroy(struct Trace *trace)
+{
+    if (!trace)
+        return;
+    free(trace->buffer);
+    free(trace);
+}
+
+/* Start the next chunk over the oldest one */
+void trace_chunk(struct Trace *trace)
+{
+    size_t start = trace->chunks++ % trace->nchunks * TRACE_CHUNK;
+    uint8_t *chunk = trace->buffer + start;
+    memset(chunk, TRACE_END, TRACE_CHUNK);
+    trace->last.cycles = trace->cpu->cycles;
+    trace->last.instructions = trace->cpu->instructions;
+    memcpy(chunk, &trace->last, sizeof(trace->last));
+    trace->pos = start + sizeof(trace->last);
+    trace->chunk_end = start + TRACE_CHUNK;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data = (const uint8_t *) data + n;
+        len -= n;
+    }
+    return true;
+}
+
+int trace_dump(const struct Trace *trace, int fd)
+{
+    uint64_t nchunks = trace->chunks < trace->nchunks ? trace->chunks : trace->nchunks;
+    struct TraceFile header = {
+            .magic = TRACE_MAGIC,
+            .version = TRACE_VERSION,
+            .chunk_size = TRACE_CHUNK,
+            .nchunks = nchunks,
+    };
+    if (!write_all(fd, &header, sizeof(header)))
+        return -1;
+    for (uint64_t chunk = trace->chunks - nchunks; chunk < trace->chunks; ++chunk)
+        if (!write_all(fd, trace->buffer + chunk % trace->nchunks * TRACE_CHUNK, TRACE_CHUNK))
+            return -1;
+    return 0;
+}
+
+static uint16_t get16(const uint8_t **p)
+{
+    uint16_t value = (*p)[0] | (*p)[1] << 8;
+    *p += 2;
+    return value;
+}
+
+/* Print one chunk. T-states are counted from the table, so a HLT that
+ * skipped to the end of a slice is only caught up with at the next chunk. */
+static bool print_chunk(FILE *out, const uint8_t *chunk)
+{
+    struct TraceKey key;
+    memcpy(&key, chunk, sizeof(key));
+    fprintf(out, "-- %llu T-states, %llu instructions\n", (unsigned long long) key.cycles,
+            (unsigned long long) key.instructions);
+    uint64_t cycles = key.cycles;
+    uint16_t fallthrough = key.pc;
+    int last_opcode = -1;
+    const uint8_t *p = chunk + sizeof(key), *end = chunk + TRACE_CHUNK;
+    while (p < end && *p != TRACE_END) {
+        uint8_t tag = *p++;
+        if (tag & TRACE_INSN) {
+            if (end - p < 1 + 2 * 4 + 2 + 2)
+                return false;
+            uint8_t opcode = *p++;
+            uint16_t pc = tag & TRACE_PC ? get16(&p) : fallthrough;
+            if (tag & TRACE_BC)
+                key.bc = get16(&p);
+            if (tag & TRACE_DE)
+                key.de = get16(&p);
+            if (tag & TRACE_HL)
+                key.hl = get16(&p);
+            if (tag & TRACE_SP)
+                key.sp = get16(&p);
+            if (tag & TRACE_A)
+                key.a = *p++;
+            if (tag & TRACE_PSW)
+                key.psw = *p++;
+            if (last_opcode >= 0) {
+                cycles += cycle_table[last_opcode];
+                /* conditional CALL and RET cost more when taken */
+                if ((last_opcode & 0xC3) == 0xC0 && pc != fallthrough)
+                    cycles += COND_TAKEN_CYCLES;
+            }
+            fprintf(out, "%12llu %04x %02x  a=%02x psw=%02x bc=%04x de=%04x hl=%04x sp=%04x\n",
+                    (unsigned long long) cycles, pc, opcode, key.a, key.psw, key.bc, key.de,
+                    key.hl, key.sp);
+            fallthrough = pc + 1 + operand_bytes[opcode];
+            last_opcode = opcode;
+        } else if (tag >= TRACE_WRITE && tag <= TRACE_WRITE_UP) {
+            if (end - p < (tag == TRACE_WRITE ? 3 : 1))
+                return false;
+            key.addr = tag == TRACE_WRITE ? get16(&p) : key.addr + (tag == TRACE_WRITE_UP ? 1 : -1);
+            fprintf(out, "%22s(%04x) <- %02x\n", "", key.addr, *p++);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int trace_print(FILE *out, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    struct TraceFile header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        fclose(file);
+        return -1;
+    }
+    if (header.version != TRACE_VERSION || header.chunk_size != TRACE_CHUNK) {
+        fprintf(stderr, "%s: trace version %u, expected %u\n", path,
+                (unsigned) header.version, TRACE_VERSION);
+        fclose(file);
+        return -1;
+    }
+    uint8_t chunk[TRACE_CHUNK];
+    int ret = 0;
+    for (uint32_t i = 0; i < header.nchunks && !ret; ++i) {
+        if (fread(chunk, TRACE_CHUNK, 1, file) != 1 || !print_chunk(out, chunk)) {
+            fprintf(stderr, "%s: corrupt trace\n", path);
+            ret = -1;
+        }
+    }
+    fclose(file);
+    return ret;
+}
@@ -0,0 +1,128 @@
+#ifndef EMU8080_TRACEH
+#define EMU8080_TRACEH
+#include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_SIZE (1 << 20)
+#define TRACE_CHUNK 4096        /* the ring is overwritten a chunk at a time */
+
+/* Records are a tag byte and what it says follows, little-endian. An
+ * instruction gives its opcode, then its pc unless it follows on from the
+ * last one, then each register that changed since the last record. */
+#define TRACE_END 0x00          /* nothing more in this chunk */
+#define TRACE_WRITE 0x01        /* address and value */
+#define TRACE_WRITE_DOWN 0x02   /* value, to the byte below the last write */
+#define TRACE_WRITE_UP 0x03     /* value, to the byte above the last write */
+#define TRACE_INSN 0x80
+#define TRACE_PC 0x40
+#define TRACE_BC 0x01
+#define TRACE_DE 0x02
+#define TRACE_HL 0x04
+#define TRACE_SP 0x08
+#define TRACE_A 0x10
+#define TRACE_PSW 0x20
+/* room for an instruction and the two writes it can make */
+#define TRACE_RESERVE (2 + 2 + 4 * 2 + 2 + 2 * 4)
+
+/* Where decoding picks up: every chunk starts with the state after the
+ * record before it */
+struct TraceKey {
+    uint64_t cycles;        /* before the chunk's first instruction */
+    uint64_t instructions;
+    uint16_t pc;            /* where the next instruction is expected */
+    uint16_t bc, de, hl, sp;
+    uint16_t addr;          /* last write */
+    uint16_t a, psw;
+};
+
+struct Trace {
+    const struct CPU *cpu;
+    struct TraceKey last;
+    uint8_t *buffer;
+    size_t nchunks;
+    uint64_t chunks;        /* chunks started, the last one still open */
+    size_t pos, chunk_end;
+};
+
+extern struct Trace *trace_create(const struct CPU *cpu, size_t size);
+extern void trace_destroy(struct Trace *trace);
+extern void trace_chunk(struct Trace *trace);
+/* Write the ring, oldest chunk first. Only calls write(), so it can be used
+ * from a signal handler. */
+extern int trace_dump(const struct Trace *trace, int fd);
+/* Decode a file written by trace_dump() as one line per instruction */
+extern int trace_print(FILE *out, const char *path);
+
+static inline uint8_t *trace_room(struct Trace *trace, size_t len)
+{
+    if (trace->pos + len > trace->chunk_end)
+        trace_chunk(trace);
+    return trace->buffer + trace->pos;
+}
+
+static inline void trace_put16(uint8_t *p, uint16_t value)
+{
+    p[0] = (uint8_t) value;
+    p[1] = value >> 8;
+}
+
+/* Store value at p if it differs from *last, and say so in tag */
+static inline uint8_t *trace_field(uint8_t *p, uint8_t *tag, uint8_t flag, uint16_t *last,
+                                   uint16_t value, unsigned bytes)
+{
+    if (value == *last)
+        return p;
+    *last = value;
+    p[0] = (uint8_t) value;
+    if (bytes == 2)
+        p[1] = value >> 8;
+    *tag |= flag;
+    return p + bytes;
+}
+
+/* Record the instruction of length bytes about to run at pc, with the
+ * registers as they are before it */
+static inline void trace_step(struct Trace *trace, uint16_t pc, uint8_t opcode,
+                              unsigned length, uint8_t psw)
+{
+    const struct Registers *regs = &trace->cpu->regs;
+    struct TraceKey *last = &trace->last;
+    uint8_t *start = trace_room(trace, TRACE_RESERVE), *p = start + 2;
+    uint8_t tag = TRACE_INSN;
+    p = trace_field(p, &tag, TRACE_PC, &last->pc, pc, 2);
+    p = trace_field(p, &tag, TRACE_BC, &last->bc, regs->bc, 2);
+    p = trace_field(p, &tag, TRACE_DE, &last->de, regs->de, 2);
+    p = trace_field(p, &tag, TRACE_HL, &last->hl, regs->hl, 2);
+    p = trace_field(p, &tag, TRACE_SP, &last->sp, regs->sp, 2);
+    p = trace_field(p, &tag, TRACE_A, &last->a, regs->a, 1);
+    p = trace_field(p, &tag, TRACE_PSW, &last->psw, psw, 1);
+    start[0] = tag;
+    start[1] = opcode;
+    last->pc = pc + length;
+    trace->pos += p - start;
+}
+
+static inline void trace_write(struct Trace *trace, uint16_t addr, uint8_t value)
+{
+    uint8_t *p = trace_room(trace, 4);
+    if (addr == (uint16_t) (trace->last.addr - 1)) {
+        p[0] = TRACE_WRITE_DOWN;
+        p[1] = value;
+        trace->pos += 2;
+    } else if (addr == (uint16_t) (trace->last.addr + 1)) {
+        p[0] = TRACE_WRITE_UP;
+        p[1] = value;
+        trace->pos += 2;
+    } else {
+        p[0] = TRACE_WRITE;
+        trace_put16(p + 1, addr);
+        p[3] = value;
+        trace->pos += 4;
+    }
+    trace->last.addr = addr;
+}
+#endif